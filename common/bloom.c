@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bloom.h"
+
+/* FNV-1a and the murmur3 finalizer, split into two 32 bit hashes */
+static uint64_t bloom_hash(const char *key, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (len--) {
+        h ^= (unsigned char)*key++;
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb93fe1a85ec5ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * Words needed for nkeys keys
+ */
+uint32_t bloom_nwords(uint32_t nkeys)
+{
+    uint64_t bits = (uint64_t)nkeys * BLOOM_BITS_PER_KEY;
+    uint32_t nwords = 2;
+    while ((uint64_t)nwords * 32 < bits && nwords < (1U << 28))
+        nwords <<= 1;
+    return nwords;
+}
+
+int bloom_init(struct bloom *b, uint32_t nkeys)
+{
+    b->nwords = bloom_nwords(nkeys);
+    b->own = (uint32_t*)calloc(b->nwords, sizeof(uint32_t));
+    b->words = b->own;
+    return b->own ? 0 : -1;
+}
+
+void bloom_add(struct bloom *b, const char *key, size_t len)
+{
+    uint64_t h = bloom_hash(key, len);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1, mask = b->nwords * 32 - 1, i;
+    if (!b->own)
+        return;
+    for (i = 0; i < BLOOM_HASHES; i++, h1 += h2)
+        b->own[(h1 & mask) >> 5] |= 1U << (h1 & 31);
+}
+
+/*
+ * False if key was certainly never added
+ */
+bool bloom_maybe(const struct bloom *b, const char *key, size_t len)
+{
+    uint64_t h;
+    uint32_t h1, h2, mask, i;
+    if (!b->words)
+        return true;
+    h = bloom_hash(key, len);
+    h1 = (uint32_t)h;
+    h2 = (uint32_t)(h >> 32) | 1;
+    mask = b->nwords * 32 - 1;
+    for (i = 0; i < BLOOM_HASHES; i++, h1 += h2)
+        if (!(b->words[(h1 & mask) >> 5] & (1U << (h1 & 31))))
+            return false;
+    return true;
+}
+
+void bloom_free(struct bloom *b)
+{
+    free(b->own);
+    memset(b, 0, sizeof *b);
+}
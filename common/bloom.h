@@ -0,0 +1,30 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Bloom filter over the names a configuration knows about ("from" names
+ * and excluded users), so lookups of unknown names are answered without
+ * touching the mappings.  The words are either owned or point into the
+ * compiled index.
+ */
+
+#define BLOOM_BITS_PER_KEY 16   /* about 0.2% false positives */
+#define BLOOM_HASHES 4
+
+struct bloom {
+    const uint32_t *words;  /* NULL: no filter, everything may be known */
+    uint32_t nwords;        /* a power of two */
+    uint32_t *own;          /* words, if allocated by bloom_init() */
+};
+
+extern uint32_t bloom_nwords(uint32_t nkeys);
+extern int bloom_init(struct bloom *b, uint32_t nkeys);
+extern void bloom_add(struct bloom *b, const char *key, size_t len);
+extern bool bloom_maybe(const struct bloom *b, const char *key, size_t len);
+extern void bloom_free(struct bloom *b);
+
+#endif
@@ -30,24 +30,66 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include "rcu.h"
 
 
-static const char* config_file = "/etc/pam_nss.conf";
+static const char* config_file = MAP_CONFIG_FILE;
 
 /* set from configuration file parsing; stripped from exported symbols
  * in build, so local to the shared lib. */
 config_setting_t *iam_mappings, *debug, *excl_users;
 
 
-struct map* mapped_users = NULL;
-struct list* excluded_users = NULL;
 char *mappeduser;
-int map_debug = 0;
+int map_debug = 0;    /* copied from the current snapshot, a plain int is fine racing */
 
 config_t cf;
-static int conf_parsed = 0;
 static const char *libname = NULL;    /* for syslogs, set in each library */
-static const char dbdir[] = "/run/mapiamuser/";
+const char dbdir[] = "/run/mapiamuser/";    /* runtime state, e.g. token cache */
+bool map_use_index = true;  /* false while compiling the index */
+bool map_start_watch = true;    /* false in modules that may be unloaded (pam_ssh.so) */
+
+/* current configuration, replaced as a whole, see map_acquire() */
+static struct map_snapshot *map_current = NULL;
+/* serializes the writers of map_current (the parsers) */
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A fork() while another thread reloads would leave the child with
+ * locks nobody releases: all of them are taken, in the order the
+ * reloads take them, before the process is copied.
+ */
+static void map_atfork_prepare(void)
+{
+    pthread_mutex_lock(&config_lock);
+    pwcache_atfork_prepare();
+    rcu_atfork_prepare();
+}
+
+static void map_atfork_parent(void)
+{
+    rcu_atfork_parent();
+    pwcache_atfork_parent();
+    pthread_mutex_unlock(&config_lock);
+}
+
+static void map_atfork_child(void)
+{
+    rcu_atfork_child();
+    pwcache_atfork_child();
+    pthread_mutex_init(&config_lock, NULL);
+    map_watch_atfork_child();
+}
+
+/* before any thread of ours exists; removed again by dlclose() */
+__attribute__((constructor))
+static void map_register_atfork(void)
+{
+    pthread_atfork(map_atfork_prepare, map_atfork_parent, map_atfork_child);
+}
 
 /*
  * If you aren't using glibc or a variant that supports this,
@@ -67,61 +109,208 @@ void sys_log(int err, const char *format, ...)
    closelog();
 }
 
-/*  reset all config variables when we are going to re-parse */
-static void reset_config(void)
+/*  free a configuration snapshot nobody references any more */
+static void map_snapshot_free(struct map_snapshot *snap)
 {
-    /*  reset the config variables that we use, freeing memory where needed */
     if (map_debug > 1)
-        sys_log(LOG_DEBUG,"reset_config start");
-    config_destroy(&cf);
-    if (mapped_users) {
-        map_close(&mapped_users);
+        sys_log(LOG_DEBUG,"map_snapshot_free start");
+    if (snap->users)
+        map_close(&snap->users);
+    if (snap->excluded)
+        list_close(&snap->excluded);
+    free(snap->settings.broker_socket);
+    bloom_free(&snap->names);
+    mapidx_close(&snap->index);
+    free(snap);
+}
+
+/*
+ * Reference the current configuration, NULL if there is none.  The
+ * snapshot never changes; a reload publishes a new one and the old one
+ * is freed by the last map_release().
+ */
+struct map_snapshot* map_acquire(void)
+{
+    unsigned int token = rcu_read_lock();
+    struct map_snapshot *snap = __atomic_load_n(&map_current, __ATOMIC_ACQUIRE);
+    if (snap)
+        __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+    rcu_read_unlock(token);
+    return snap;
+}
+
+void map_release(struct map_snapshot *snap)
+{
+    if (snap && __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        map_snapshot_free(snap);
+}
+
+/*
+ * Replace the current configuration; readers still using the old one
+ * keep it until they release it.  Called with config_lock held.
+ */
+static void map_publish(struct map_snapshot *snap)
+{
+    struct map_snapshot *old = __atomic_exchange_n(&map_current, snap, __ATOMIC_SEQ_CST);
+    /* nobody can be between loading old and referencing it after this */
+    rcu_synchronize();
+    map_release(old);
+    pwcache_reset();
+}
+
+/*
+ * Read the top level settings used by PAM and its helpers
+ */
+static void config_read_settings(config_t *config, struct map_settings *settings)
+{
+    const char *value;
+    if (config_lookup_string(config, "broker_socket", &value))
+        settings->broker_socket = strdup(value);
+    if (!config_lookup_int(config, "cache_ttl", &settings->cache_ttl)
+        || settings->cache_ttl < 0)
+        settings->cache_ttl = 0;
+    if (!config_lookup_int(config, "max_response", &settings->max_response)
+        || settings->max_response < 0)
+        settings->max_response = 0;
+    if (!config_lookup_bool(config, "watch_config", &settings->watch_config))
+        settings->watch_config = 0;
+    if (!config_lookup_bool(config, "warmup", &settings->warmup))
+        settings->warmup = 0;
+    if (!config_lookup_bool(config, "tls_sessions", &settings->tls_sessions))
+        settings->tls_sessions = 0;
+    if (!config_lookup_bool(config, "parallel_auth", &settings->parallel_auth))
+        settings->parallel_auth = 0;
+    if (!config_lookup_bool(config, "prewarm", &settings->prewarm))
+        settings->prewarm = 1;
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "broker_socket: %s",
+            settings->broker_socket ? settings->broker_socket : "(default)");
+}
+
+/*
+ * Read the optional per section settings
+ */
+static void config_read_section(config_setting_t *mapping, struct mapitem *item)
+{
+    const char *value;
+    if (config_setting_lookup_string(mapping, "jwks_url", &value))
+        item->jwks_url = strdup(value);
+    if (config_setting_lookup_string(mapping, "issuer", &value))
+        item->issuer = strdup(value);
+    if (config_setting_lookup_string(mapping, "audience", &value))
+        item->audience = strdup(value);
+    if (!config_setting_lookup_int(mapping, "jwks_refresh", &item->jwks_refresh)
+        || item->jwks_refresh <= 0)
+        item->jwks_refresh = JWKS_REFRESH;
+    if (!config_setting_lookup_int(mapping, "timeout", &item->timeout)
+        || item->timeout < 0)
+        item->timeout = 0;
+    if (map_debug > 1 && item->jwks_url)
+        sys_log(LOG_DEBUG, "Mappings section: %s, jwks_url: %s, issuer: %s",
+            item->name, item->jwks_url, item->issuer ? item->issuer : "(none)");
+}
+
+/*
+ * Add the endpoints after the first one, stored one per line
+ */
+static void config_read_index_urls(const char *urls, struct mapitem *item)
+{
+    char url[PATH_MAX];
+    size_t len;
+    while (urls && *urls) {
+        len = strcspn(urls, "\n");
+        if (len < sizeof url) {
+            memcpy(url, urls, len);
+            url[len] = '\0';
+            map_add_url(item, url);
+        }
+        urls += len + (urls[len] == '\n');
+    }
+}
+
+/*
+ * Load the configuration from the compiled index: only the sections and
+ * excluded users are copied, user mappings are looked up in the mmap'ed
+ * index by map_find_section() and map_section_lookup().
+ */
+static void config_read_index(struct map_snapshot *snap)
+{
+    const struct mapidx *idx = &snap->index;
+    const struct mapidx_header *hdr = idx->hdr;
+    uint32_t i;
+    map_debug = hdr->debug;
+    snap->settings.cache_ttl = hdr->cache_ttl > 0 ? hdr->cache_ttl : 0;
+    snap->settings.max_response = hdr->max_response > 0 ? hdr->max_response : 0;
+    snap->settings.watch_config = (hdr->flags & MAPIDX_F_WATCH) != 0;
+    snap->settings.warmup = (hdr->flags & MAPIDX_F_WARMUP) != 0;
+    snap->settings.tls_sessions = (hdr->flags & MAPIDX_F_TLS_SESSIONS) != 0;
+    snap->settings.parallel_auth = (hdr->flags & MAPIDX_F_PARALLEL_AUTH) != 0;
+    snap->settings.prewarm = (hdr->flags & MAPIDX_F_NO_PREWARM) == 0;
+    if (mapidx_str(idx, hdr->broker_socket))
+        snap->settings.broker_socket = strdup(mapidx_str(idx, hdr->broker_socket));
+    if (hdr->nexcluded)
+        snap->excluded = list_new();
+    for (i = 0; i < hdr->nexcluded; i++) {
+        const uint32_t *excl = (const uint32_t*)(idx->base + hdr->excluded_off);
+        const char *name = mapidx_str(idx, excl[i]);
+        if (name)
+            list_add(name, &snap->excluded);
     }
-    if (excluded_users) {
-        list_close(&excluded_users);
+    snap->users = map_new();
+    /* item i of snap->users is section i of the index */
+    for (i = 0; i < hdr->nsections; i++) {
+        const struct mapidx_section *sec = mapidx_section(idx, i);
+        struct mapitem *item;
+        map_add(mapidx_str(idx, sec->name), mapidx_str(idx, sec->url),
+                map_items_new(), &snap->users);
+        item = snap->users->items + snap->users->size - 1;
+        if (mapidx_str(idx, sec->jwks_url))
+            item->jwks_url = strdup(mapidx_str(idx, sec->jwks_url));
+        if (mapidx_str(idx, sec->issuer))
+            item->issuer = strdup(mapidx_str(idx, sec->issuer));
+        if (mapidx_str(idx, sec->audience))
+            item->audience = strdup(mapidx_str(idx, sec->audience));
+        item->jwks_refresh = sec->jwks_refresh > 0 ? sec->jwks_refresh : JWKS_REFRESH;
+        item->timeout = sec->timeout > 0 ? sec->timeout : 0;
+        config_read_index_urls(mapidx_str(idx, sec->urls), item);
     }
-    map_debug = 0;
+    map_build_index(snap->users);
+    mapidx_bloom(idx, &snap->names);
     if (map_debug > 1)
-        sys_log( LOG_DEBUG,"reset_config end");
+        sys_log(LOG_DEBUG, "Index: %u sections, %u users",
+            hdr->nsections, hdr->nfroms);
 }
 
 /*
- * Read pam_nss config file and allocates the necessary memory for the input data
- * return 0 on succesful parsing (at least no hard errors), 1 if
- *  an error, and 2 if already parsed and no change to config file
+ * Filter of every name a lookup can match, see map_name_maybe_known()
  */
+static void config_build_bloom(struct map_snapshot *snap)
+{
+    uint32_t nkeys = snap->excluded ? snap->excluded->size : 0;
+    int i, j;
+    for (i = 0; snap->users && i < snap->users->size; i++)
+        if ((snap->users->items + i)->users)
+            nkeys += (snap->users->items + i)->users->size;
+    if (bloom_init(&snap->names, nkeys))
+        return;     /* no filter, every name goes the long way */
+    for (i = 0; snap->users && i < snap->users->size; i++) {
+        const struct user *users = (snap->users->items + i)->users;
+        for (j = 0; users && j < users->size; j++)
+            bloom_add(&snap->names, (users->items + j)->from, strlen((users->items + j)->from));
+    }
+    for (i = 0; snap->excluded && i < snap->excluded->size; i++)
+        bloom_add(&snap->names, (snap->excluded->items + i)->data,
+                  strlen((snap->excluded->items + i)->data));
+}
 
-int nss_mapiamuser_config(int *errnop, const char *lname)
+/*
+ * Parse the configuration file into snap
+ * return 0 on success, 1 on a parse error
+ */
+static int config_read_file_into(struct map_snapshot *snap)
 {
-    //const config_setting_t *mappings;
     int count;
-    static struct stat lastconf;
     struct user* mapped_users_items = NULL;
-    libname = lname;
-    if (map_debug > 1)
-        sys_log(LOG_DEBUG,"nss_mapiamuser_config start, conf_parsed=%d", conf_parsed);
-    if (conf_parsed) {
-        struct stat st, *lst = &lastconf;
-        /*
-         *  check to see if the config file(s) have changed since last time,
-         *  in case we are part of a long-lived daemon.  If any changed,
-         *  reparse.  If not, return the appropriate status (err or OK)
-         */
-
-        if (stat(config_file, &st) && st.st_ino == lst->st_ino &&
-            st.st_mtime == lst->st_mtime
-            && st.st_ctime == lst->st_ctime)
-            return 2;    //  nothing to reparse
-        reset_config();
-        conf_parsed = 0;
-        if (map_debug && conf_parsed)
-            sys_log(LOG_DEBUG,
-                   "%s: Configuration file changed, re-initializing",
-                   libname);
-    }    
-    if (map_debug > 1)
-        sys_log(LOG_DEBUG, "Setting lib name: %s", libname);
-    //cf = &cfg;
     config_init(&cf);
     if (map_debug > 1)
         sys_log(LOG_DEBUG, "Calling config init");
@@ -135,10 +324,9 @@ int nss_mapiamuser_config(int *errnop, const char *lname)
     }
     if (map_debug > 1)
         sys_log(LOG_DEBUG, "Config read");
-    if (stat(config_file, &lastconf) > 0)
-        memset(&lastconf, 0, sizeof lastconf);    
     if (!config_lookup_int(&cf, "debug", &map_debug))
         map_debug = 0;
+    config_read_settings(&cf, &snap->settings);
 
     if (map_debug > 1)
         sys_log(LOG_DEBUG, "Config read excluded_users");
@@ -146,8 +334,8 @@ int nss_mapiamuser_config(int *errnop, const char *lname)
     if (excl_users != NULL && config_setting_is_list(excl_users) == CONFIG_TRUE){
         if (map_debug > 1)
             sys_log(LOG_DEBUG, "Excluded users: OK\n");
-        if (!excluded_users)
-            excluded_users = list_new();
+        if (!snap->excluded)
+            snap->excluded = list_new();
         count = config_setting_length(excl_users);
         int i;
         if (map_debug > 1)
@@ -155,20 +343,18 @@ int nss_mapiamuser_config(int *errnop, const char *lname)
         for(i = 0; i < count; ++i)
         {
             const char* e_name = config_setting_get_string_elem(excl_users, i);
-            const char *name;
             if (e_name != NULL)
             {
-                  name = strdup(e_name);
                   if (map_debug > 1)
-                      sys_log(LOG_DEBUG, "Adding: %s", name);
-                list_add((char*)name, &excluded_users);
+                      sys_log(LOG_DEBUG, "Adding: %s", e_name);
+                list_add(e_name, &snap->excluded);    // list_add keeps its own copy
             }
         }
     }
     
     iam_mappings = config_lookup(&cf, "mappings");
     if (iam_mappings != NULL){        
-        mapped_users = map_new();        
+        snap->users = map_new();        
         count = config_setting_length(iam_mappings);
         if (map_debug > 1)
             sys_log(LOG_DEBUG, "Mappings: OK, sections count: %d\n", count);
@@ -177,11 +363,15 @@ int nss_mapiamuser_config(int *errnop, const char *lname)
         {
             config_setting_t *mapping = config_setting_get_elem(iam_mappings, i);
             config_setting_t *users = config_setting_get_member(mapping, "users");
+            config_setting_t *urls = config_setting_get_member(mapping, "url");
             int count_users = users ? config_setting_length(users): 0;
-            const char *name, *url;
+            const char *name, *url = NULL;
+            // url is one endpoint or a list of equivalent ones
+            if (urls)
+                url = config_setting_is_aggregate(urls) ? config_setting_get_string_elem(urls, 0)
+                                                        : config_setting_get_string(urls);
             if (!(config_setting_lookup_string(mapping, (char*)"name", &name)
-                   && config_setting_lookup_string(mapping, (char*)"url", &url)
-                   && users))
+                   && url && users))
                 continue;
             char* name_ = strdup(name);
             char* url_ = strdup(url);
@@ -190,7 +380,14 @@ int nss_mapiamuser_config(int *errnop, const char *lname)
                 sys_log(LOG_DEBUG, "Mappings section: %s, users count: %d\n", name, count_users);
             mapped_users_items = map_items_new();
             map_item_add(users, &mapped_users_items);
-            map_add((char*)name_, (char*)url_, mapped_users_items, &mapped_users);
+            int added = snap->users->size;
+            map_add((char*)name_, (char*)url_, mapped_users_items, &snap->users);
+            if (snap->users->size > added) {
+                int more = config_setting_is_aggregate(urls) ? config_setting_length(urls) : 0;
+                for (int u = 1; u < more; u++)
+                    map_add_url(snap->users->items + added, config_setting_get_string_elem(urls, u));
+                config_read_section(mapping, snap->users->items + added);
+            }
             if (name_)
                 free(name_);
             if (url_)
@@ -198,11 +395,192 @@ int nss_mapiamuser_config(int *errnop, const char *lname)
         }
     }
     
+    map_build_index(snap->users);
+    config_build_bloom(snap);
     config_destroy(&cf);
-    conf_parsed = 1;
+    return 0;
+}
+
+/*
+ * stat() of the configuration file
+ */
+int map_config_stat(struct stat *st)
+{
+    return stat(config_file, st);
+}
+
+/* the configuration file is the one a snapshot was read from */
+static bool config_unchanged(const struct stat *st, const struct map_snapshot *snap)
+{
+    const struct stat *lst = &snap->conf;
+    return st->st_dev == lst->st_dev &&
+        st->st_ino == lst->st_ino && st->st_size == lst->st_size &&
+        st->st_mtim.tv_sec == lst->st_mtim.tv_sec &&
+        st->st_mtim.tv_nsec == lst->st_mtim.tv_nsec &&
+        st->st_ctime == lst->st_ctime;
+}
+
+/*
+ * Publish a parsed configuration in MAPIDX_SHM, so the other processes
+ * map it instead of parsing the file again.  Only root does: the segment
+ * is only trusted when owned by root.  The configuration file identity
+ * recorded in it tells the generation apart.
+ */
+static void config_share(const struct map_snapshot *snap)
+{
+    if (geteuid() != 0 || !snap->users)
+        return;
+    if (mapidx_write(MAPIDX_SHM, snap->users, snap->excluded, &snap->settings,
+                     map_debug, &snap->conf)) {
+        if (map_debug)
+            sys_log(LOG_DEBUG, "%s: %m", MAPIDX_SHM);
+    } else if (map_debug > 1)
+        sys_log(LOG_DEBUG, "%s: shared %d sections", MAPIDX_SHM, snap->users->size);
+}
+
+/*
+ * Re-read the configuration if the file changed since the current
+ * snapshot was taken; return values as nss_mapiamuser_config()
+ */
+int map_config_reload(void)
+{
+    struct map_snapshot *snap;
+    struct stat st;
+    int ret;
+    bool unchanged;
+
+    pthread_mutex_lock(&config_lock);
+    if (stat(config_file, &st) != 0)
+        memset(&st, 0, sizeof st);
+    snap = map_acquire();
+    unchanged = snap && config_unchanged(&st, snap);
+    map_release(snap);
+    if (unchanged) {
+        pthread_mutex_unlock(&config_lock);
+        return 2;    //  nothing to reparse
+    }
+    if (map_debug)
+        sys_log(LOG_DEBUG,
+               "%s: Configuration file changed, re-initializing",
+               libname);
+    snap = (struct map_snapshot*)calloc(1, sizeof *snap);
+    if (!snap) {
+        pthread_mutex_unlock(&config_lock);
+        return(EXIT_FAILURE);
+    }
+    snap->refs = 1;    /* the reference of map_current */
+    /* stat before reading, so a write racing the parse triggers another one */
+    snap->conf = st;
+    if (st.st_ino && map_use_index && (mapidx_open(MAPIDX_FILE, &st, &snap->index) == 0
+                                       || mapidx_open(MAPIDX_SHM, &st, &snap->index) == 0)) {
+        config_read_index(snap);
+        ret = 0;
+    } else {
+        ret = config_read_file_into(snap);
+        if (!ret && st.st_ino && map_use_index)
+            config_share(snap);
+    }
+    if (ret) {
+        map_snapshot_free(snap);
+        snap = NULL;
+    }
+    map_publish(snap);
+    if (snap && snap->settings.watch_config && map_start_watch)
+        map_watch_start();
+    ret = ret || !snap->users ? 1 : 0;
+    pthread_mutex_unlock(&config_lock);
+    return ret;
+}
+
+/*
+ * warmup = true in the configuration, looked up without reading it into
+ * a snapshot: from the compiled index when it is current, otherwise by
+ * parsing the file alone
+ */
+bool map_warmup_enabled(void)
+{
+    struct stat st;
+    struct mapidx idx;
+    config_t config;
+    int warmup = 0;
+
+    if (stat(config_file, &st) != 0)
+        return false;
+    if (map_use_index && (mapidx_open(MAPIDX_FILE, &st, &idx) == 0
+                          || mapidx_open(MAPIDX_SHM, &st, &idx) == 0)) {
+        warmup = (idx.hdr->flags & MAPIDX_F_WARMUP) != 0;
+        mapidx_close(&idx);
+        return warmup;
+    }
+    config_init(&config);
+    if (config_read_file(&config, config_file) != CONFIG_TRUE
+        || !config_lookup_bool(&config, "warmup", &warmup))
+        warmup = 0;
+    config_destroy(&config);
+    return warmup;
+}
+
+/*
+ * true at most once per MAP_POLL_INTERVAL; the coarse clock is read
+ * from the vDSO, without a system call
+ */
+static bool config_poll_due(void)
+{
+    static long long next_poll;
+    struct timespec now;
+    long long now_ms, next;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    now_ms = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    next = __atomic_load_n(&next_poll, __ATOMIC_RELAXED);
+    if (next && now_ms < next)
+        return false;
+    /* one thread polls, the others keep the current snapshot */
+    return __atomic_compare_exchange_n(&next_poll, &next, now_ms + MAP_POLL_INTERVAL,
+                                       false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * Read pam_nss config file and allocates the necessary memory for the input data
+ * return 0 on succesful parsing (at least no hard errors), 1 if
+ *  an error, and 2 if already parsed and no change to config file
+ */
+
+int nss_mapiamuser_config(int *errnop, const char *lname)
+{
+    struct map_snapshot *snap;
+    struct stat st;
+    int ret;
+    bool unchanged;
+    libname = lname;
     if (map_debug > 1)
-        sys_log(LOG_DEBUG, "nss_mapiamuser_config on return: %d", mapped_users ? 0 : 1);
-    return mapped_users ? 0 : 1;
+        sys_log(LOG_DEBUG,"nss_mapiamuser_config start");
+    /*
+     *  check to see if the config file(s) have changed since last time,
+     *  in case we are part of a long-lived daemon.  If any changed,
+     *  reparse.  If not, return the appropriate status (err or OK).
+     *  With the watcher running, changes are picked up by it; otherwise
+     *  the file is stat()ed at most every MAP_POLL_INTERVAL ms.
+     */
+    if (map_watching() || !config_poll_due()) {
+        snap = map_acquire();
+        ret = snap ? 2 : 1;
+        map_release(snap);
+        if (ret == 2 || map_watching())
+            return ret;
+        /* none read yet, or a broken one: try again as before */
+    }
+    if (stat(config_file, &st) != 0)
+        memset(&st, 0, sizeof st);
+    snap = map_acquire();
+    unchanged = snap && config_unchanged(&st, snap);
+    map_release(snap);
+    if (unchanged)
+        return 2;    //  nothing to reparse
+
+    ret = map_config_reload();
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "nss_mapiamuser_config on return: %d", ret);
+    return ret;
 }
 
 
@@ -296,83 +674,6 @@ pwcopy(char *buf, size_t len, const char *usename, struct passwd *srcpw,
     }
     return 0;
 }
-/*
- * pb->name is non-NULL when we have the name and want to look it up
- * from the mapping.  mapuid will be the auid if we found it in the
- * files, otherwise will be what was passed down, which should
- * be the UID we are looking up when pb->name is NULL, when it's
- * the uid lookup, and otherwise should be -1 when pb->name is not NULL.
- * Returns 0 on success, 1 if uid not found in mapping files (even if
- * uid matches the radius mapping users; let nss_files handle that).
- */
-int
-get_pw_mapuser(const char *name, struct pwbuf *pb)
-{
-    FILE *pwfile;
-    struct passwd *pwd;
-    int ret = 1;
-    if (map_debug > 1){
-        sys_log(LOG_DEBUG,"get_pw_mapuser start");
-        sys_log(LOG_DEBUG,"checking /etc/passwd");
-    }
-
-    pwfile = fopen("/etc/passwd", "r");
-    if (!pwfile) {
-        if (map_debug > 1)
-            sys_log(LOG_WARNING, "%s: failed to open /etc/passwd: %m",
-                   libname);
-        return 1;
-    }
-    
-    for (ret = 1; ret && (pwd = fgetpwent(pwfile));) {
-        if (!pwd->pw_name)
-            continue;    // shouldn't happen
-        if (strcmp(pwd->pw_name, name) == 0) {
-            ret = pwcopy(pb->buf, pb->buflen, pb->name, pwd, pb->pw);
-            if (map_debug > 1)
-                sys_log(LOG_DEBUG,"strcmp(pwd->pw_name, name) == OK, ret=%d", ret); 
-            break;
-        }
-    }
-    fclose(pwfile);
-    if (map_debug > 1)
-            sys_log(LOG_DEBUG,"After /etc/passwd checking section.");
-    if (ret) {
-        if (map_debug > 1){
-            sys_log(LOG_DEBUG,"Finding user details in next in next db.");
-            sys_log(LOG_DEBUG,"get_pw_mapuser before while loop");
-        }
-        while ((pwd = getpwent()) != NULL && ret)
-        {
-            if (!pwd->pw_name)
-                continue;
-            
-            if (map_debug > 1)
-                sys_log(LOG_DEBUG,"user = '%s', uid = %d, gid = %d, name = '%s'",
-                   pwd->pw_name, pwd->pw_uid, pwd->pw_gid, pwd->pw_gecos);
-            
-            if (!strcmp(pwd->pw_name, name)) {            
-                ret =
-                    pwcopy(pb->buf, pb->buflen, pb->name, pwd, pb->pw);
-                if (map_debug > 1)
-                    sys_log(LOG_DEBUG,"strcmp(pwd->pw_name, name) == OK, ret=%d", ret);
-                break;
-            }        
-        }
-        if (map_debug > 1)
-            sys_log(LOG_DEBUG,"get_pw_mapuser after while loop");
-    }
-    if (ret) {
-        *pb->errnop = ERANGE;
-    }
-    if (map_debug > 1)
-        sys_log(LOG_DEBUG,"get_pw_mapuser on return %d", ret);
-    return ret;
-}
-
-
-
-
 /*
  * Used when there are no mapping entries, just create an entry from
  * the default radius user
@@ -380,16 +681,15 @@ get_pw_mapuser(const char *name, struct pwbuf *pb)
  */
 int make_mapuser(struct pwbuf *pb, const char *mappedname)
 {
-    int ret;
     if (map_debug > 1)
         sys_log(LOG_DEBUG,"make_mapuser");
-    ret = get_pw_mapuser(mappedname, pb);
-    return ret;
+    // resolved once per configuration, an unknown account as well
+    return pwcache_get(mappedname, pb) == PWCACHE_FOUND ? 0 : 1;
 }
 
 static char*_getcmdname(void)
 {
-    static char buf[TASK_COMM_LEN + 1];
+    static __thread char buf[TASK_COMM_LEN + 1];
     char *rv = NULL;
     int ret, fd;
     if (map_debug > 1)
@@ -411,7 +711,7 @@ static char*_getcmdname(void)
                        "%s: read /proc/self/comm ret %d: %m",
                        libname, ret);
         } else {
-            (void)strtok(buf, "\n\r ");
+            buf[strcspn(buf, "\n\r ")] = '\0';
             rv = buf;
         }
     }
@@ -487,49 +787,59 @@ void remove_char(char *str, char c) {
     *pw = '\0';
 }
 
+/*
+ * Splits address ("user@host") into username and host without copying,
+ * the parts are views into address; host is empty if there is none.
+ * Leading and repeated '@' are skipped, the part after a second '@' is
+ * ignored.
+ */
+bool split_username(const char* address, const char** username, size_t* username_len,
+                    const char** host, size_t* host_len)
+{
+    const char* cp;
+    if (!address)
+        return false;
+    cp = address + strspn(address, "@");
+    if (!*cp) {
+        /* no name at all: take the address as it is */
+        *username = address;
+        *username_len = strlen(address);
+        *host = address + *username_len;
+        *host_len = 0;
+        return true;
+    }
+    *username = cp;
+    *username_len = strcspn(cp, "@");
+    cp += *username_len;
+    cp += strspn(cp, "@");
+    *host = cp;
+    *host_len = strcspn(cp, "@");
+    return true;
+}
+
 /*
  * Splits address into username and host.
  * Input: address
- * Output: username and host -> have to be allocated prior to function call
+ * Output: username and host -> have to be allocated prior to function call,
+ * at least as long as address
  */
 
 bool traverse_username(const char* address, char** username, char** host)
 {
-    char* token;
-    const char sep[2] = "@";
-    int cnt;
+    const char *user, *location;
+    size_t user_len, location_len;
     if (!address || !*username || !*host)
         return false;
       
     if (map_debug > 1)
         sys_log(LOG_DEBUG,"traverse_username start");
       
-    int len_username = strlen(*username);
-    int len_address = strlen(address);
-    char* address_cpy =  (char *)calloc(len_address, sizeof(char));
-    if (!address_cpy)
+    if (!split_username(address, &user, &user_len, &location, &location_len))
         return false;
-    cnt = snprintf(address_cpy, len_address + 1, "%s", address);
-    if (cnt < 1) return false;
-    token = strtok(address_cpy, sep);
-    if (token){
-        int len_token = strlen(token);
-        snprintf(*username, len_token + 1, "%s", token);
-        token = strtok(NULL, sep);          
-        if (token){                             
-            len_token = strlen(token);
-            cnt = snprintf(*host, len_token + 1, "%s", token);
-            if (cnt < 1) return false;
-        } else 
-            memset(*host, '\0', strlen(*host));
-        // no need to free token!
-    } else {
-        int l_user_add = len_username < len_address? len_username : len_address;
-        cnt = snprintf(*username, l_user_add + 1, "%s", address_cpy);
-        if (cnt < 1) return false;
-        memset(*host, '\0', strlen(*host));
-    }
-    free(address_cpy);  
+    memmove(*username, user, user_len);
+    (*username)[user_len] = '\0';
+    memmove(*host, location, location_len);
+    (*host)[location_len] = '\0';
     return true;
 }
 
@@ -573,17 +883,77 @@ bool traverse_username2(const char* address, char** username, char** host){
 }
 */
 
+/*
+ * Section of the configuration by name, NULL if none
+ */
+static struct mapitem* map_find_section(const struct map_snapshot* snap, const char* name)
+{
+    if (snap->index.hdr) {
+        int n = mapidx_find_section(&snap->index, name);
+        return (n >= 0 && n < snap->users->size) ? snap->users->items + n : NULL;
+    }
+    return (struct mapitem*)map_get_key(name, snap->users);
+}
+
+/*
+ * Mapped ("to") name of a user in a section, NULL if not mapped there
+ */
+static const char* map_section_lookup(const struct map_snapshot* snap,
+                                      struct mapitem* item, const char* from)
+{
+    struct useritem *user;
+    if (snap->index.hdr)
+        return mapidx_lookup(&snap->index, item - snap->users->items, from);
+    user = map_user_get(item->users, from);
+    return user ? user->to : NULL;
+}
+
+/*
+ * False if name is certainly neither mapped nor excluded, checked before
+ * any allocation; the user part of "user@section" is what is mapped
+ */
+bool map_name_maybe_known(const struct map_snapshot* snap, const char* name)
+{
+    size_t user = strcspn(name, "@");
+    if (!user)
+        return true;    /* traverse_username() skips leading '@', take the long way */
+    if (bloom_maybe(&snap->names, name, user))
+        return true;
+    /* excluded users are compared whole */
+    return name[user] && bloom_maybe(&snap->names, name, strlen(name));
+}
+
+/*
+ * Sections mapping the unqualified name from, at most max of them in
+ * items; returns how many there are
+ */
+int map_sections_for_user(const struct map_snapshot* snap, const char* from,
+                          struct mapitem** items, int max)
+{
+    int i, n = 0;
+    if (!snap || !snap->users || !map_name_maybe_known(snap, from))
+        return 0;
+    for (i = 0; i < snap->users->size; i++) {
+        struct mapitem* item = snap->users->items + i;
+        if ((snap->index.hdr || item->users) && map_section_lookup(snap, item, from)) {
+            if (n < max)
+                items[n] = item;
+            n++;
+        }
+    }
+    return n;
+}
+
 /*
  * Get mapped username based on pam_nss.conf file
- *
+ * with used_in_pam the url returned for a qualified name points into snap
 */
-char* map_get_mapped_user(const char* fullusername, const bool used_in_pam){
-    if (!fullusername)
+char* map_get_mapped_user(const struct map_snapshot* snap, const char* fullusername, const bool used_in_pam){
+    if (!fullusername || !snap)
         return NULL;
     char *location = strdup(fullusername);
     char *username = strdup(fullusername);
     //const char *to = NULL, *url = NULL;    
-    bool found = false;
     if (map_debug > 1)
         sys_log(LOG_DEBUG, "map_get_mapped_user start, fullusername: %s, used_in_pam: %d", fullusername, used_in_pam);
     bool code = traverse_username(fullusername, &username, &location);
@@ -593,31 +963,35 @@ char* map_get_mapped_user(const char* fullusername, const bool used_in_pam){
         sys_log(LOG_DEBUG, "strcmp: %d", !strcmp(fullusername, username));
         sys_log(LOG_DEBUG, "username: %s, location: %s", username, location);
     }
-    if (mapped_users && username){
-        if (code && location){
-            struct mapitem* mapped_item = (struct mapitem*)map_get_key(location, mapped_users);
+    if (snap->users && username){
+        // traverse_username() leaves location empty for unqualified names
+        if (code && location && *location){
+            struct mapitem* mapped_item = map_find_section(snap, location);
             if (mapped_item && mapped_item->users){
-                int i = 0;                
-                while (i < mapped_item->users->size && !found)
-                {
-                    if (strcmp((mapped_item->users->items + i)->from, username) == 0)
-                        found = true;
-                    i++;
-                }
-                if (found){
+                const char* to = map_section_lookup(snap, mapped_item, username);
+                if (to){
                     if (map_debug > 1)
                         sys_log(LOG_DEBUG, "map_get_mapped_user on return when user found");
                     if (username)
                         free(username);
                     if (location)
                         free(location);
-                    return (used_in_pam)? mapped_item->url: strdup((mapped_item->users->items + i - 1)->to);
+                    return (used_in_pam)? mapped_item->url: strdup(to);
                 }
             }
         } else {
             //char *to_or_url = (char*)calloc(10, sizeof(char));
             char *to_or_url = NULL;
-            bool unique = map_check_uniqueness_and_set(username, mapped_users, (char**)&to_or_url, used_in_pam);
+            bool unique;
+            if (snap->index.hdr) {
+                uint32_t section;
+                const char *to;
+                unique = mapidx_unique(&snap->index, username, &section, &to)
+                    && section < (uint32_t)snap->users->size;
+                if (unique)
+                    to_or_url = strdup(used_in_pam ? (snap->users->items + section)->url : to);
+            } else
+                unique = map_check_uniqueness_and_set(username, snap->users, (char**)&to_or_url, used_in_pam);
             if (map_debug > 1)
                 sys_log(LOG_DEBUG, "map_get_mapped_user on return when unique: %d", unique);
             //sys_log(LOG_DEBUG, "unique: %d, to: %s\n", unique, to);
@@ -675,11 +1049,11 @@ void* map_get_mapped_user_pam(const char* fullusername, const bool used_in_pam){
 }
 */
 
-char* map_get_url_for_location(const char* location){
+char* map_get_url_for_location(const struct map_snapshot* snap, const char* location){
     if (map_debug > 1)
         sys_log(LOG_DEBUG, "map_get_url_for_location start");
-    if (mapped_users){
-        struct mapitem* mapped_item = (struct mapitem*)map_get_key(location, mapped_users);
+    if (snap && snap->users){
+        struct mapitem* mapped_item = map_find_section(snap, location);
         if (mapped_item){
             if (map_debug > 1)
                 sys_log(LOG_DEBUG, "mapped_item is not null, url: %s", mapped_item->url);
@@ -34,9 +34,11 @@
 #include <libgen.h>
 #include <linux/sched.h>
 #include <nss.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
@@ -44,8 +46,17 @@
 
 #include "map.h"
 #include "list.h"
+#include "mapidx.h"
+#include "pwcache.h"
+#include "bloom.h"
+#include "watch.h"
 
 #define TASK_COMM_LEN 16
+#define JWKS_REFRESH 300    /* default min seconds between JWKS downloads */
+#ifndef MAP_CONFIG_FILE   /* -D'd by test harnesses, must contain a '/' */
+#define MAP_CONFIG_FILE "/etc/pam_nss.conf"
+#endif
+#define MAP_POLL_INTERVAL 1000  /* min ms between two stat() of MAP_CONFIG_FILE */
 /*
  * pwbuf is used to reduce number of arguments passed around; the strings in
  * the passwd struct need to point into this buffer.
@@ -58,16 +69,57 @@ struct pwbuf {
     size_t buflen;
 };
 
-extern struct map* mapped_users;
-extern struct list* excluded_users;
+/*
+ * Settings for the PAM side (pam_ssh.so and its helper daemons), read
+ * from the top level of the configuration file next to 'debug'.
+ */
+struct map_settings {
+    char *broker_socket;    /* pam_ssh_broker socket, "" disables it */
+    int cache_ttl;          /* seconds a validated token is cached, 0 disables */
+    int max_response;       /* bytes of a userinfo response, 0 for the default */
+    int watch_config;       /* reload from an inotify thread instead of polling */
+    int warmup;             /* pam_ssh.so prepares HTTP when loaded, before sshd forks */
+    int tls_sessions;       /* keep TLS sessions in dbdir for the next sshd child */
+    int parallel_auth;      /* try every section of an ambiguous unqualified name */
+    int prewarm;            /* connect to the IAM while the token is typed, default on */
+};
+
+/*
+ * One parsed configuration.  It is never modified once published; a
+ * reload builds a new snapshot and swaps it in, so a caller holding a
+ * reference from map_acquire() sees consistent data without locking.
+ */
+struct map_snapshot {
+    struct map *users;
+    struct list *excluded;
+    struct map_settings settings;
+    struct mapidx index;    /* hdr is NULL unless loaded from MAPIDX_FILE */
+    struct bloom names;     /* "from" names and excluded users */
+    struct stat conf;       /* of the configuration file when read */
+    int refs;
+};
+
 extern int map_debug;
 extern config_t cf;
+extern const char dbdir[];
+extern bool map_use_index;
+extern bool map_start_watch;
 
 extern void sys_log(int err, const char *format, ...);
 extern int make_mapuser(struct pwbuf*, const char*);
 extern int map_init_common(int*, const char*);
-extern char* map_get_mapped_user(const char* fullusername, const bool used_in_pam);
-extern char* map_get_url_for_location(const char* location);
+extern int nss_mapiamuser_config(int *errnop, const char *lname);
+extern int map_config_stat(struct stat* st);
+extern int map_config_reload(void);
+extern bool map_warmup_enabled(void);
+extern struct map_snapshot* map_acquire(void);
+extern void map_release(struct map_snapshot* snap);
+extern bool map_name_maybe_known(const struct map_snapshot* snap, const char* name);
+extern char* map_get_mapped_user(const struct map_snapshot* snap, const char* fullusername, const bool used_in_pam);
+extern int map_sections_for_user(const struct map_snapshot* snap, const char* from, struct mapitem** items, int max);
+extern char* map_get_url_for_location(const struct map_snapshot* snap, const char* location);
 extern bool traverse_username(const char* address, char** username, char** host);
+extern bool split_username(const char* address, const char** username, size_t* username_len,
+                           const char** host, size_t* host_len);
 
 #endif
\ No newline at end of file
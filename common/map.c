@@ -1,263 +1,531 @@
-#include <stdlib.h>
-#include <string.h>
-#include <libconfig.h>
-#include <stdbool.h>
-#include <sys/stat.h>
-#include <stddef.h>
-#include <signal.h>
-#include <fcntl.h>
-#include <dirent.h>
-#include <ctype.h>
-#include <syslog.h>
-#include <sys/types.h>
-#include "map.h"
-
-#define MAP_BY_VAL 0
-#define MAP_BY_REF 1
-
-// Based on https://github.com/soywod/c-map/blob/master/map.c
-
-/*
- * Create a map
- */
-M* map_new()
-{
-    M* map;
-
-    map = malloc(sizeof(M));
-    map->size = 0;
-    map->items = NULL;
-
-    return map;
-}
-
-/*
- * Allocate items for a map
- */
-
-U* map_items_new()
-{
-    U* users;
-
-    users = malloc(sizeof(U));
-    users->size = 0;
-    users->items = NULL;
-
-    return users;
-}
-
-/*
- * Add item to map; maps user from libconfig structure (config_setting_t) into map structure
- * users_from: config_setting_t element taken from config
- * users_to: output element of struct user type
- */
-
-
-void map_item_add(config_setting_t* users_from, struct user** users_to)
-{    
-    int i;
-    int count_users = (config_setting_t *)users_from ? config_setting_length((config_setting_t *)users_from): 0;
-    if (map_debug > 1)
-        syslog(LOG_DEBUG, "map_item_add start, count: %d", count_users);
-    for(i = 0; i < count_users; ++i){
-        config_setting_t *user = config_setting_get_elem(users_from, i);
-        const char *from, *to;
-        if (!(config_setting_lookup_string(user, (char*)"from", &from)
-              && config_setting_lookup_string(user, (char*)"to", &to)))
-               continue;
-        if ((*users_to)->size == 0)
-        {
-            (*users_to)->items = malloc(sizeof(UI));
-        }
-        else
-        {
-            (*users_to)->items = realloc((*users_to)->items, sizeof(UI) * ((*users_to)->size + 1) );
-        }
-        ((*users_to)->items + (*users_to)->size)->from = strdup(from);
-        ((*users_to)->items + (*users_to)->size++)->to = strdup(to);
-    }
-    if (map_debug > 1)
-        syslog(LOG_DEBUG, "map_item_add end, size: %d", (*users_to)->size);
-}
-
-/*
- * Add item to map
- * name: section/group name to add
- * url: section/group authentication url
- */
-void map_add(const char* name, const char* url, struct user* users, M** map)
-{
-    char* newname, *newurl;
-    int cnt;
-    if (map_debug > 1)
-        syslog(LOG_DEBUG, "map_add start");
-    if (!*map || !name || !url)
-        return;
-    newname = (char*)calloc(strlen(name) + 1, sizeof(char));
-    cnt = snprintf(newname, strlen(name) + 1, "%s", name);
-    if (cnt < 1) return;
-    newurl = (char*)calloc(strlen(url) + 1, sizeof(char));
-    cnt = snprintf(newurl, strlen(url) + 1, "%s", url);
-    if (cnt < 1) return;
-    if ((*map)->size == 0)
-        (*map)->items = malloc(sizeof(MI));
-    else
-        (*map)->items = realloc((*map)->items, sizeof(MI) * ((*map)->size + 1) );
-
-    ((*map)->items + (*map)->size)->name = newname;
-    ((*map)->items + (*map)->size)->url = newurl;
-    ((*map)->items + (*map)->size)->users = users;
-    ((*map)->items + (*map)->size++)->type = MAP_BY_VAL;
-    if (map_debug > 1)
-        syslog(LOG_DEBUG, "map_add end, size: %d", (*map)->size);
-}
-
-
-/*
- * Get map key
- */
-
-
-void* map_get_key(const char* name, M* map)
-{
-    int i;
-    if (!map || ! name)
-        return NULL;
-    for (i = 0; i < map->size; i++)
-    {
-        if (strcmp((map->items + i)->name, name) == 0) // == 0
-            return (map->items + i);
-    }
-    return NULL;
-}
-
-/*
- * Check if user name if unique within the map
- */
-
-bool map_check_uniqueness_and_set(const char* username, M* map, char** name, int option)
-{
-    int i, j = 0;
-    bool unique = true;
-    bool found = false;
-    if (!map)
-        return false;
-    if (!*name)
-        return false;
-    for (i = 0; i < map->size; i++)
-    {
-        struct mapitem* item = (struct mapitem*)(map->items + i);
-        if (!item) continue;
-        int j = 0;
-        int len = 0;
-        for(; j < item->users->size; j++)
-        {
-            if (strcmp((item->users->items + j)->from, username) == 0){ 
-                if (found) unique = false;
-                found = true;
-
-                if (option == UNUSED_IN_PAM){
-                    *name = strdup((item->users->items + j)->to);
-                    /*
-                    len = strlen((item->users->items + j)->to);
-                    if (len != strlen(*name)){
-                        *name = realloc(*name, sizeof(char)*(len + 1));
-                        snprintf(*name, len + 1, "%s", (item->users->items + j)->to);
-                    }
-                    */
-                }
-                else {
-                    *name = strdup(item->url);
-                    /*
-                    len = strlen(item->url);
-                    if (len != strlen(*name)){
-                        *name = realloc(*name, sizeof(char)*(len + 1));
-                        snprintf(*name, len + 1, "%s", item->url);
-                    }*/
-                }
-            }
-        }
-    }
-    if (map_debug > 1)
-        syslog(LOG_DEBUG, "map_check_uniqueness_and_set: unique: %d, found: %d\n", unique, found);
-    return unique && found;
-}
-
-/*
- * Close map and free pointers
- */
-void map_close(M** map) {
-    int i = 0;
-    if (!*map) {
-        if (map_debug > 1)
-            syslog(LOG_DEBUG, "Map is null");
-        return;
-    }
-    if (map_debug > 1)
-        syslog(LOG_DEBUG, "map_close start, size: %d", (*map)->size);
-
-    for (; i < (*map)->size; i++) {
-        if (map_debug > 2)
-            syslog(LOG_DEBUG, "free(((*map)->items + %d)->name: %s)", i, ((*map)->items + i)->name);
-        if (((*map)->items + i)->name) {
-            free(((*map)->items + i)->name);
-            ((*map)->items + i)->name = NULL;
-        }
-
-        if (map_debug > 2)
-            syslog(LOG_DEBUG, "free(((*map)->items + %d)->url: %s)", i, ((*map)->items + i)->url);
-        if (((*map)->items + i)->url) {
-            free(((*map)->items + i)->url);
-            ((*map)->items + i)->url = NULL;
-        }
-        int j = 0;
-
-        if (map_debug > 2)
-            syslog(LOG_DEBUG, "((*map)->items + %d)->users->size: %d", i, ((*map)->items + i)->users->size);
-        for (; j < ((*map)->items + i)->users->size; j++) {
-            if (map_debug > 2)
-                syslog(LOG_DEBUG, "(((*map)->items + %d)->users->items + %d)->from: %s", i, j, (((*map)->items + i)->users->items + j)->from);
-            if ((((*map)->items + i)->users->items + j)->from) {
-                free((((*map)->items + i)->users->items + j)->from);
-                (((*map)->items + i)->users->items + j)->from = NULL;
-            }
-
-            if (map_debug > 2)
-                syslog(LOG_DEBUG, "(((*map)->items + %d)->users->items + %d)->to: %s", i, j, (((*map)->items + i)->users->items + j)->to);
-            if ((((*map)->items + i)->users->items + j)->to) {
-                free((((*map)->items + i)->users->items + j)->to);
-                (((*map)->items + i)->users->items + j)->to = NULL;
-            }
-        }
-
-        if (map_debug > 2)
-            syslog(LOG_DEBUG, "free(((*map)->items + %d)->users->items, size: %d", i, ((*map)->items + i)->users->size);
-        if (((*map)->items + i)->users->items) {
-            free(((*map)->items + i)->users->items);
-            ((*map)->items + i)->users->items = NULL;
-        }
-
-        if (map_debug > 2)
-            syslog(LOG_DEBUG, "free(((*map)->items + %d)->users", i);
-        if ((*map)->items->users) {
-            free(((*map)->items + i)->users);
-            ((*map)->items + i)->users = NULL;
-        }
-    }
-
-        if (map_debug > 1)
-            syslog(LOG_DEBUG, "free((*map)->items)");
-        if ((*map)->items) {
-            free((*map)->items);
-            (*map)->items = NULL;
-        }
-           if (map_debug > 1)
-            syslog(LOG_DEBUG, "free(*map)");
-        if (*map) {
-            free(*map);
-            *map = NULL;
-        }
-
-    if (map_debug > 1)
-        syslog(LOG_DEBUG, "map_close end");
-}
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <libconfig.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include "map.h"
+
+#define MAP_BY_VAL 0
+#define MAP_BY_REF 1
+
+// Based on https://github.com/soywod/c-map/blob/master/map.c
+
+/*
+ * Create a map
+ */
+M* map_new()
+{
+    M* map;
+
+    map = malloc(sizeof(M));
+    map->size = 0;
+    map->items = NULL;
+    map->index = NULL;
+    map->mask = 0;
+    map->froms = NULL;
+    map->froms_mask = 0;
+
+    return map;
+}
+
+/*
+ * Allocate items for a map
+ */
+
+U* map_items_new()
+{
+    U* users;
+
+    users = malloc(sizeof(U));
+    users->size = 0;
+    users->items = NULL;
+    users->index = NULL;
+    users->mask = 0;
+
+    return users;
+}
+
+/*
+ * Add item to map; maps user from libconfig structure (config_setting_t) into map structure
+ * users_from: config_setting_t element taken from config
+ * users_to: output element of struct user type
+ */
+
+
+void map_item_add(config_setting_t* users_from, struct user** users_to)
+{    
+    int i;
+    int count_users = (config_setting_t *)users_from ? config_setting_length((config_setting_t *)users_from): 0;
+    if (map_debug > 1)
+        syslog(LOG_DEBUG, "map_item_add start, count: %d", count_users);
+    for(i = 0; i < count_users; ++i){
+        config_setting_t *user = config_setting_get_elem(users_from, i);
+        const char *from, *to;
+        if (!(config_setting_lookup_string(user, (char*)"from", &from)
+              && config_setting_lookup_string(user, (char*)"to", &to)))
+               continue;
+        if ((*users_to)->size == 0)
+        {
+            (*users_to)->items = malloc(sizeof(struct useritem));
+        }
+        else if (((*users_to)->size & ((*users_to)->size - 1)) == 0)
+        {
+            /* capacity doubles whenever size reaches a power of two */
+            (*users_to)->items = realloc((*users_to)->items, sizeof(struct useritem) * (*users_to)->size * 2);
+        }
+        ((*users_to)->items + (*users_to)->size)->from = strdup(from);
+        ((*users_to)->items + (*users_to)->size++)->to = strdup(to);
+    }
+    if (map_debug > 1)
+        syslog(LOG_DEBUG, "map_item_add end, size: %d", (*users_to)->size);
+}
+
+/*
+ * Take an endpoint url apart: scheme://[userinfo@]host[:port][/path]
+ * url: endpoint of a section, a missing scheme is http as for curl
+ * parsed: host, port and path of url, host NULL if false is returned
+ * Done when the configuration is loaded so that a login only looks at
+ * the result.  errno is ENOMEM if there was no memory for the host,
+ * EINVAL if url does not parse.
+ */
+bool map_url_parse(const char* url, struct mapurl* parsed)
+{
+    const char *authority = url, *end, *at, *host, *host_end, *port;
+    size_t i, len;
+    long n = 0;
+
+    parsed->host = NULL;
+    parsed->port = 0;
+    parsed->path = "";
+    errno = EINVAL;
+    if (!url)
+        return false;
+    end = strstr(url, "://");
+    if (end && (size_t)(end - url) < strcspn(url, "/?#")) {
+        len = (size_t)(end - url);
+        if (len == 5 && !strncasecmp(url, "https", 5))
+            parsed->port = 443;
+        else if (len == 4 && !strncasecmp(url, "http", 4))
+            parsed->port = 80;
+        authority = end + 3;
+    } else {
+        parsed->port = 80;
+    }
+    end = authority + strcspn(authority, "/?#");
+    parsed->path = end;
+    /* userinfo ends at the last '@' */
+    for (host = authority, at = authority; at < end; at++)
+        if (*at == '@')
+            host = at + 1;
+    if (*host == '[') {
+        host_end = memchr(host, ']', (size_t)(end - host));
+        if (!host_end)
+            return false;
+        port = host_end + 1;
+        host++;
+    } else {
+        host_end = memchr(host, ':', (size_t)(end - host));
+        if (!host_end)
+            host_end = end;
+        port = host_end;
+    }
+    if (host_end == host)
+        return false;
+    /* an empty port is the default one, as for curl */
+    if (port < end && *port++ != ':')
+        return false;
+    if (port < end) {
+        for (; port < end; port++) {
+            if (!isdigit((unsigned char)*port) || (n = n * 10 + (*port - '0')) > 65535)
+                return false;
+        }
+        if (n == 0)
+            return false;
+        parsed->port = (int)n;
+    }
+    len = (size_t)(host_end - host);
+    if (!(parsed->host = malloc(len + 1)))
+        return false;
+    for (i = 0; i < len; i++)
+        parsed->host[i] = tolower((unsigned char)host[i]);
+    parsed->host[len] = '\0';
+    return true;
+}
+
+/*
+ * Parse url into item->parsed[item->nurls] and make it urls[nurls]; a
+ * url that does not parse is logged and left out, the other endpoints
+ * of the section stay usable.
+ */
+static bool map_url_add(struct mapitem* item, char* url)
+{
+    struct mapurl* parsed = item->parsed + item->nurls;
+    if (!map_url_parse(url, parsed)) {
+        if (errno == ENOMEM)
+            syslog(LOG_ERR, "section %s: no memory for url %s, left out", item->name, url);
+        else
+            syslog(LOG_ERR, "section %s: cannot parse url %s, left out", item->name, url);
+        return false;
+    }
+    if (map_debug > 1)
+        syslog(LOG_DEBUG, "section %s: host %s, port %d, path %s",
+               item->name, parsed->host, parsed->port, *parsed->path ? parsed->path : "/");
+    item->urls[item->nurls++] = url;
+    return true;
+}
+
+/*
+ * Add item to map
+ * name: section/group name to add
+ * url: section/group authentication url
+ */
+void map_add(const char* name, const char* url, struct user* users, M** map)
+{
+    char* newname, *newurl;
+    int cnt;
+    if (map_debug > 1)
+        syslog(LOG_DEBUG, "map_add start");
+    if (!*map || !name || !url)
+        return;
+    newname = (char*)calloc(strlen(name) + 1, sizeof(char));
+    cnt = snprintf(newname, strlen(name) + 1, "%s", name);
+    if (cnt < 1) return;
+    newurl = (char*)calloc(strlen(url) + 1, sizeof(char));
+    cnt = snprintf(newurl, strlen(url) + 1, "%s", url);
+    if (cnt < 1) return;
+    /* the index no longer covers every section */
+    free((*map)->index);
+    free((*map)->froms);
+    (*map)->index = NULL;
+    (*map)->froms = NULL;
+    if ((*map)->size == 0)
+        (*map)->items = malloc(sizeof(MI));
+    else
+        (*map)->items = realloc((*map)->items, sizeof(MI) * ((*map)->size + 1) );
+
+    ((*map)->items + (*map)->size)->name = newname;
+    ((*map)->items + (*map)->size)->url = newurl;
+    ((*map)->items + (*map)->size)->urls = malloc(sizeof(char*));
+    ((*map)->items + (*map)->size)->parsed = malloc(sizeof(struct mapurl));
+    ((*map)->items + (*map)->size)->nurls = 0;
+    if (((*map)->items + (*map)->size)->urls && ((*map)->items + (*map)->size)->parsed)
+        map_url_add((*map)->items + (*map)->size, newurl);
+    ((*map)->items + (*map)->size)->users = users;
+    ((*map)->items + (*map)->size)->jwks_url = NULL;
+    ((*map)->items + (*map)->size)->issuer = NULL;
+    ((*map)->items + (*map)->size)->audience = NULL;
+    ((*map)->items + (*map)->size)->jwks_refresh = 0;
+    ((*map)->items + (*map)->size)->timeout = 0;
+    ((*map)->items + (*map)->size++)->type = MAP_BY_VAL;
+    if (map_debug > 1)
+        syslog(LOG_DEBUG, "map_add end, size: %d", (*map)->size);
+}
+
+
+/*
+ * Add another endpoint, equivalent to item->url, to a section; left out
+ * if it does not parse
+ */
+void map_add_url(struct mapitem* item, const char* url)
+{
+    char** urls;
+    struct mapurl* parsed;
+    char* newurl;
+    if (!item->urls || !item->parsed || !url)
+        return;
+    urls = realloc(item->urls, sizeof(char*) * (item->nurls + 1));
+    if (!urls)
+        return;
+    item->urls = urls;
+    parsed = realloc(item->parsed, sizeof(struct mapurl) * (item->nurls + 1));
+    if (!parsed)
+        return;
+    item->parsed = parsed;
+    if (!(newurl = strdup(url)))
+        syslog(LOG_ERR, "section %s: no memory for url %s, left out", item->name, url);
+    else if (!map_url_add(item, newurl))
+        free(newurl);
+}
+
+/* FNV-1a */
+unsigned int map_hash(const char* s)
+{
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* power of two table size keeping the load factor under 1/2 */
+static unsigned int map_table_size(int n)
+{
+    unsigned int size = 8;
+    while (size < 2u * (unsigned int)n)
+        size <<= 1;
+    return size;
+}
+
+static struct mapfrom* map_from_get(M* map, const char* from)
+{
+    unsigned int h = map_hash(from), i = h & map->froms_mask;
+    for (; map->froms[i].count; i = (i + 1) & map->froms_mask) {
+        struct mapfrom* f = map->froms + i;
+        if (f->hash == h && strcmp(((map->items + f->section)->users->items + f->item)->from, from) == 0)
+            return f;
+    }
+    return map->froms + i;
+}
+
+/*
+ * Build the hash indexes once every section has been added: sections by
+ * name, users of each section by "from" and "from" names over all
+ * sections with their number of mappings, so that uniqueness checks do
+ * not scan the whole map.  On allocation failure lookups stay linear.
+ */
+void map_build_index(M* map)
+{
+    int i, j;
+    if (!map)
+        return;
+    free(map->index);
+    free(map->froms);
+    map->mask = map_table_size(map->size) - 1;
+    map->index = (unsigned int*)calloc(map->mask + 1, sizeof(unsigned int));
+    for (i = 0; map->index && i < map->size; i++) {
+        unsigned int h = map_hash((map->items + i)->name) & map->mask;
+        /* a repeated name stays bound to its first section */
+        for (; map->index[h]; h = (h + 1) & map->mask)
+            if (strcmp((map->items + map->index[h] - 1)->name, (map->items + i)->name) == 0)
+                break;
+        if (!map->index[h])
+            map->index[h] = i + 1;
+    }
+
+    int count = 0;
+    for (i = 0; i < map->size; i++) {
+        U* users = (map->items + i)->users;
+        if (!users)
+            continue;
+        count += users->size;
+        free(users->index);
+        users->mask = map_table_size(users->size) - 1;
+        users->index = (unsigned int*)calloc(users->mask + 1, sizeof(unsigned int));
+        for (j = 0; users->index && j < users->size; j++) {
+            unsigned int h = map_hash((users->items + j)->from) & users->mask;
+            for (; users->index[h]; h = (h + 1) & users->mask)
+                if (strcmp((users->items + users->index[h] - 1)->from, (users->items + j)->from) == 0)
+                    break;
+            if (!users->index[h])
+                users->index[h] = j + 1;
+        }
+    }
+
+    map->froms_mask = map_table_size(count) - 1;
+    map->froms = (struct mapfrom*)calloc(map->froms_mask + 1, sizeof(struct mapfrom));
+    for (i = 0; map->froms && i < map->size; i++) {
+        U* users = (map->items + i)->users;
+        for (j = 0; users && j < users->size; j++) {
+            struct mapfrom* f = map_from_get(map, (users->items + j)->from);
+            if (!f->count++) {
+                f->hash = map_hash((users->items + j)->from);
+                f->section = i;
+                f->item = j;
+            }
+        }
+    }
+    if (map_debug > 1)
+        syslog(LOG_DEBUG, "map_build_index: %d sections, %d users", map->size, count);
+}
+
+/*
+ * Get map key
+ */
+
+
+void* map_get_key(const char* name, M* map)
+{
+    int i;
+    if (!map || ! name)
+        return NULL;
+    if (map->index) {
+        unsigned int h = map_hash(name) & map->mask;
+        for (; map->index[h]; h = (h + 1) & map->mask)
+            if (strcmp((map->items + map->index[h] - 1)->name, name) == 0)
+                return map->items + map->index[h] - 1;
+        return NULL;
+    }
+    for (i = 0; i < map->size; i++)
+    {
+        if (strcmp((map->items + i)->name, name) == 0) // == 0
+            return (map->items + i);
+    }
+    return NULL;
+}
+
+/*
+ * Get the first mapping of a user within a section
+ */
+
+struct useritem* map_user_get(const U* users, const char* from)
+{
+    int i;
+    if (!users || !from)
+        return NULL;
+    if (users->index) {
+        unsigned int h = map_hash(from) & users->mask;
+        for (; users->index[h]; h = (h + 1) & users->mask)
+            if (strcmp((users->items + users->index[h] - 1)->from, from) == 0)
+                return users->items + users->index[h] - 1;
+        return NULL;
+    }
+    for (i = 0; i < users->size; i++)
+        if (strcmp((users->items + i)->from, from) == 0)
+            return users->items + i;
+    return NULL;
+}
+
+/*
+ * Check if user name if unique within the map; if so name is set to a
+ * copy of its mapped name (UNUSED_IN_PAM) or of its section url
+ */
+
+bool map_check_uniqueness_and_set(const char* username, M* map, char** name, int option)
+{
+    int i, j, count = 0, section = 0, item = 0;
+    if (!map || !name || !username)
+        return false;
+    if (map->froms) {
+        struct mapfrom* f = map_from_get(map, username);
+        count = f->count;
+        section = f->section;
+        item = f->item;
+    } else {
+        for (i = 0; i < map->size; i++)
+        {
+            U* users = (map->items + i)->users;
+            for (j = 0; users && j < users->size; j++)
+            {
+                if (strcmp((users->items + j)->from, username) == 0 && !count++) {
+                    section = i;
+                    item = j;
+                }
+            }
+        }
+    }
+    if (map_debug > 1)
+        syslog(LOG_DEBUG, "map_check_uniqueness_and_set: unique: %d, found: %d\n", count == 1, count > 0);
+    if (count != 1)
+        return false;
+    if (option == UNUSED_IN_PAM)
+        *name = strdup(((map->items + section)->users->items + item)->to);
+    else
+        *name = strdup((map->items + section)->url);
+    return *name != NULL;
+}
+
+/*
+ * Close map and free pointers
+ */
+void map_close(M** map) {
+    int i = 0;
+    if (!*map) {
+        if (map_debug > 1)
+            syslog(LOG_DEBUG, "Map is null");
+        return;
+    }
+    if (map_debug > 1)
+        syslog(LOG_DEBUG, "map_close start, size: %d", (*map)->size);
+
+    for (; i < (*map)->size; i++) {
+        if (map_debug > 2)
+            syslog(LOG_DEBUG, "free(((*map)->items + %d)->name: %s)", i, ((*map)->items + i)->name);
+        if (((*map)->items + i)->name) {
+            free(((*map)->items + i)->name);
+            ((*map)->items + i)->name = NULL;
+        }
+
+        /* url itself is urls[0] unless it did not parse */
+        while (((*map)->items + i)->nurls > 0) {
+            int last = --((*map)->items + i)->nurls;
+            free(((*map)->items + i)->parsed[last].host);
+            if (((*map)->items + i)->urls[last] != ((*map)->items + i)->url)
+                free(((*map)->items + i)->urls[last]);
+        }
+        if (map_debug > 2)
+            syslog(LOG_DEBUG, "free(((*map)->items + %d)->url: %s)", i, ((*map)->items + i)->url);
+        if (((*map)->items + i)->url) {
+            free(((*map)->items + i)->url);
+            ((*map)->items + i)->url = NULL;
+        }
+        free(((*map)->items + i)->urls);
+        ((*map)->items + i)->urls = NULL;
+        free(((*map)->items + i)->parsed);
+        ((*map)->items + i)->parsed = NULL;
+        free(((*map)->items + i)->jwks_url);
+        free(((*map)->items + i)->issuer);
+        free(((*map)->items + i)->audience);
+        int j = 0;
+
+        if (map_debug > 2)
+            syslog(LOG_DEBUG, "((*map)->items + %d)->users->size: %d", i, ((*map)->items + i)->users->size);
+        for (; j < ((*map)->items + i)->users->size; j++) {
+            if (map_debug > 2)
+                syslog(LOG_DEBUG, "(((*map)->items + %d)->users->items + %d)->from: %s", i, j, (((*map)->items + i)->users->items + j)->from);
+            if ((((*map)->items + i)->users->items + j)->from) {
+                free((((*map)->items + i)->users->items + j)->from);
+                (((*map)->items + i)->users->items + j)->from = NULL;
+            }
+
+            if (map_debug > 2)
+                syslog(LOG_DEBUG, "(((*map)->items + %d)->users->items + %d)->to: %s", i, j, (((*map)->items + i)->users->items + j)->to);
+            if ((((*map)->items + i)->users->items + j)->to) {
+                free((((*map)->items + i)->users->items + j)->to);
+                (((*map)->items + i)->users->items + j)->to = NULL;
+            }
+        }
+
+        if (map_debug > 2)
+            syslog(LOG_DEBUG, "free(((*map)->items + %d)->users->items, size: %d", i, ((*map)->items + i)->users->size);
+        if (((*map)->items + i)->users->items) {
+            free(((*map)->items + i)->users->items);
+            ((*map)->items + i)->users->items = NULL;
+        }
+
+        free(((*map)->items + i)->users->index);
+        if (map_debug > 2)
+            syslog(LOG_DEBUG, "free(((*map)->items + %d)->users", i);
+        if (((*map)->items + i)->users) {
+            free(((*map)->items + i)->users);
+            ((*map)->items + i)->users = NULL;
+        }
+    }
+
+        free((*map)->index);
+        free((*map)->froms);
+        if (map_debug > 1)
+            syslog(LOG_DEBUG, "free((*map)->items)");
+        if ((*map)->items) {
+            free((*map)->items);
+            (*map)->items = NULL;
+        }
+           if (map_debug > 1)
+            syslog(LOG_DEBUG, "free(*map)");
+        if (*map) {
+            free(*map);
+            *map = NULL;
+        }
+
+    if (map_debug > 1)
+        syslog(LOG_DEBUG, "map_close end");
+}
@@ -1,43 +1,82 @@
-#ifndef MAP_H
-#define MAP_H
-
-#define USED_IN_PAM 1
-#define UNUSED_IN_PAM 0
-
-typedef struct useritem
-{
-    char* from;
-    char* to;
-} UI;
-
-typedef struct user
-{
-    int size;
-    UI* items;	
-} U;
-
-typedef struct mapitem
-{
-    char* name;
-    char* url;
-    U* users;
-    int type;
-} MI;
-
-typedef struct map
-{
-    int size;
-    MI* items;
-} M;
-
-
-extern int map_debug;
-struct map* map_new();
-struct user* map_items_new();
-void map_add(const char* name, const char* url, struct user* users, struct map** map);
-void map_item_add(config_setting_t* users_from, struct user** users_to);
-void* map_get_key(const char* key, struct map* map);
-void map_close(struct map** map);
-bool map_check_uniqueness_and_set(const char* username, struct map* map, char** mapped_name, int option);
-
-#endif
+#ifndef MAP_H
+#define MAP_H
+
+#define USED_IN_PAM 1
+#define UNUSED_IN_PAM 0
+
+/* no short typedef: UI clashes with OpenSSL's UI type */
+struct useritem
+{
+    char* from;
+    char* to;
+};
+
+typedef struct user
+{
+    int size;
+    struct useritem* items;	
+    unsigned int* index;    /* items by "from", see map_build_index() */
+    unsigned int mask;
+} U;
+
+/* an endpoint url taken apart once, when the configuration is loaded */
+struct mapurl
+{
+    char* host;         /* lower case, IPv6 literals without [] */
+    int port;           /* given or the default of the scheme, 0 if neither */
+    const char* path;   /* into the url, "" if it has none */
+};
+
+typedef struct mapitem
+{
+    char* name;
+    char* url;
+    char** urls;        /* equivalent endpoints that parse, urls[0] is url if it does */
+    int nurls;          /* 0 if none does */
+    struct mapurl* parsed;  /* parsed[i] is urls[i] */
+    U* users;
+    int type;
+    /* optional offline verification of JWT access tokens */
+    char* jwks_url;
+    char* issuer;
+    char* audience;
+    int jwks_refresh;   /* min seconds between JWKS downloads */
+    int timeout;        /* ms budget of one IAM request, 0 for the default */
+} MI;
+
+/* a "from" name over all sections */
+struct mapfrom
+{
+    unsigned int hash;
+    int section;    /* first mapping of the name */
+    int item;
+    int count;      /* mappings of the name in all sections */
+};
+
+typedef struct map
+{
+    int size;
+    MI* items;
+    /* open addressing hash tables, NULL until map_build_index() */
+    unsigned int* index;    /* sections by name, item number + 1 */
+    unsigned int mask;
+    struct mapfrom* froms;  /* users by name over all sections */
+    unsigned int froms_mask;
+} M;
+
+
+extern int map_debug;
+struct map* map_new();
+struct user* map_items_new();
+void map_add(const char* name, const char* url, struct user* users, struct map** map);
+void map_add_url(struct mapitem* item, const char* url);
+bool map_url_parse(const char* url, struct mapurl* parsed);
+void map_item_add(config_setting_t* users_from, struct user** users_to);
+unsigned int map_hash(const char* s);
+void map_build_index(struct map* map);
+void* map_get_key(const char* key, struct map* map);
+struct useritem* map_user_get(const struct user* users, const char* from);
+void map_close(struct map** map);
+bool map_check_uniqueness_and_set(const char* username, struct map* map, char** mapped_name, int option);
+
+#endif
@@ -0,0 +1,667 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "common.h"
+#include "mapidx.h"
+#include "bloom.h"
+
+#define MAPIDX_GOLDEN 0x9e3779b97f4a7c15ULL
+#define MAPIDX_MAX_SEED 65536     /* displacements tried per bucket */
+#define MAPIDX_ATTEMPTS 8         /* table sizes tried before giving up */
+
+/* FNV-1a, good enough to seed the displacement mixer */
+static uint64_t mapidx_hash(const char* s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* murmur3 finalizer */
+static uint64_t mapidx_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb93fe1a85ec5ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint32_t mapidx_slot(uint64_t h, uint32_t seed, uint32_t nslots)
+{
+    return (uint32_t)(mapidx_mix(h ^ (seed * MAPIDX_GOLDEN)) % nslots);
+}
+
+/* array of count elements of elem bytes at off lies inside the file */
+static bool mapidx_range(const struct mapidx* idx, uint32_t off, uint64_t count, size_t elem)
+{
+    if (!count)
+        return true;
+    return off >= sizeof(struct mapidx_header) && off % sizeof(uint32_t) == 0
+        && off <= idx->size && count * elem <= idx->size - off;
+}
+
+static bool mapidx_phash_valid(const struct mapidx* idx, const struct mapidx_phash* ph, uint32_t n)
+{
+    if (n && (!ph->nbuckets || !ph->nslots))
+        return false;
+    return mapidx_range(idx, ph->seeds_off, ph->nbuckets, sizeof(uint32_t))
+        && mapidx_range(idx, ph->slots_off, ph->nslots, sizeof(uint32_t));
+}
+
+/*
+ * Check the header and that every table lies inside the file; entries
+ * are bound-checked again as they are used.
+ */
+static bool mapidx_valid(const struct mapidx* idx)
+{
+    const struct mapidx_header* hdr = idx->hdr;
+    uint32_t i;
+    if (hdr->magic != MAPIDX_MAGIC || hdr->version != MAPIDX_VERSION
+        || hdr->size != idx->size || idx->base[idx->size - 1] != '\0'
+        || hdr->strings_off < sizeof(struct mapidx_header) || hdr->strings_off >= idx->size)
+        return false;
+    if (!mapidx_range(idx, hdr->sections_off, hdr->nsections, sizeof(struct mapidx_section))
+        || !mapidx_range(idx, hdr->froms_off, hdr->nfroms, sizeof(struct mapidx_from))
+        || !mapidx_range(idx, hdr->postings_off, hdr->npostings, sizeof(struct mapidx_posting))
+        || !mapidx_range(idx, hdr->excluded_off, hdr->nexcluded, sizeof(uint32_t))
+        || !mapidx_range(idx, hdr->bloom_off, hdr->bloom_words, sizeof(uint32_t))
+        || (hdr->bloom_words & (hdr->bloom_words - 1))
+        || !mapidx_phash_valid(idx, &hdr->section_hash, hdr->nsections)
+        || !mapidx_phash_valid(idx, &hdr->from_hash, hdr->nfroms))
+        return false;
+    /* sections are copied into struct map on load, so check them all */
+    for (i = 0; i < hdr->nsections; i++) {
+        const struct mapidx_section* sec = mapidx_section(idx, i);
+        if (!mapidx_str(idx, sec->name) || !mapidx_str(idx, sec->url))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Map the index at path read-only.  It is only trusted when owned by root
+ * and not writable by anyone else, and only used when it was compiled
+ * from the configuration file described by src.
+ * Returns 0 on success, -1 if there is no usable index.
+ */
+int mapidx_open(const char* path, const struct stat* src, struct mapidx* idx)
+{
+    struct stat st;
+    void* base;
+    int fd;
+    memset(idx, 0, sizeof *idx);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != 0
+        || (st.st_mode & (S_IWGRP | S_IWOTH))
+        || st.st_size < (off_t)sizeof(struct mapidx_header) || st.st_size > UINT32_MAX) {
+        if (map_debug > 1)
+            sys_log(LOG_DEBUG, "%s: not a trusted index", path);
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+    idx->base = (const unsigned char*)base;
+    idx->size = st.st_size;
+    idx->hdr = (const struct mapidx_header*)base;
+    if (idx->hdr->magic == MAPIDX_MAGIC && idx->hdr->version != MAPIDX_VERSION) {
+        if (map_debug)
+            sys_log(LOG_DEBUG, "%s: index format %u ignored, run pam_nss_compile",
+                    path, idx->hdr->version);
+        mapidx_close(idx);
+        return -1;
+    }
+    if (!mapidx_valid(idx)) {
+        sys_log(LOG_ERR, "%s: corrupted index ignored", path);
+        mapidx_close(idx);
+        return -1;
+    }
+    if (src && (idx->hdr->src_dev != (uint64_t)src->st_dev
+                || idx->hdr->src_ino != (uint64_t)src->st_ino
+                || idx->hdr->src_size != (uint64_t)src->st_size
+                || idx->hdr->src_mtime_sec != (int64_t)src->st_mtim.tv_sec
+                || idx->hdr->src_mtime_nsec != (int64_t)src->st_mtim.tv_nsec)) {
+        if (map_debug)
+            sys_log(LOG_DEBUG, "%s: stale index ignored, run pam_nss_compile", path);
+        mapidx_close(idx);
+        return -1;
+    }
+    return 0;
+}
+
+void mapidx_close(struct mapidx* idx)
+{
+    if (idx->base)
+        munmap((void*)idx->base, idx->size);
+    memset(idx, 0, sizeof *idx);
+}
+
+/*
+ * String at off, NULL if not set or outside the strings area; the file
+ * ends with a NUL so every string in the area is terminated.
+ */
+const char* mapidx_str(const struct mapidx* idx, uint32_t off)
+{
+    if (!off || off < idx->hdr->strings_off || off >= idx->size)
+        return NULL;
+    return (const char*)idx->base + off;
+}
+
+const struct mapidx_section* mapidx_section(const struct mapidx* idx, uint32_t n)
+{
+    if (n >= idx->hdr->nsections)
+        return NULL;
+    return (const struct mapidx_section*)(idx->base + idx->hdr->sections_off) + n;
+}
+
+/* key number a perfect hash gives for key, to be confirmed by the caller */
+static int64_t mapidx_phash_find(const struct mapidx* idx, const struct mapidx_phash* ph, const char* key)
+{
+    const uint32_t* seeds = (const uint32_t*)(idx->base + ph->seeds_off);
+    const uint32_t* slots = (const uint32_t*)(idx->base + ph->slots_off);
+    uint64_t h;
+    uint32_t slot;
+    if (!ph->nbuckets || !ph->nslots)
+        return -1;
+    h = mapidx_hash(key);
+    slot = mapidx_slot(h, seeds[mapidx_mix(h) % ph->nbuckets], ph->nslots);
+    return (int64_t)slots[slot] - 1;
+}
+
+/*
+ * Number of the first section called name, -1 if none
+ */
+int mapidx_find_section(const struct mapidx* idx, const char* name)
+{
+    int64_t n;
+    const struct mapidx_section* sec;
+    if (!idx->hdr || !name)
+        return -1;
+    n = mapidx_phash_find(idx, &idx->hdr->section_hash, name);
+    if (n < 0 || !(sec = mapidx_section(idx, (uint32_t)n)))
+        return -1;
+    return strcmp(mapidx_str(idx, sec->name), name) == 0 ? (int)n : -1;
+}
+
+/*
+ * Postings of a "from" name, NULL if no section maps it
+ */
+const struct mapidx_from* mapidx_from(const struct mapidx* idx, const char* from)
+{
+    const struct mapidx_from* f;
+    const char* name;
+    int64_t n;
+    if (!idx->hdr || !from)
+        return NULL;
+    n = mapidx_phash_find(idx, &idx->hdr->from_hash, from);
+    if (n < 0 || n >= idx->hdr->nfroms)
+        return NULL;
+    f = (const struct mapidx_from*)(idx->base + idx->hdr->froms_off) + n;
+    name = mapidx_str(idx, f->name);
+    if (!name || strcmp(name, from) != 0
+        || f->first > idx->hdr->npostings || f->count > idx->hdr->npostings - f->first)
+        return NULL;
+    return f;
+}
+
+static const struct mapidx_posting* mapidx_postings(const struct mapidx* idx, const struct mapidx_from* f)
+{
+    return (const struct mapidx_posting*)(idx->base + idx->hdr->postings_off) + f->first;
+}
+
+/*
+ * Mapped ("to") name of from in a section, NULL if not mapped there
+ */
+const char* mapidx_lookup(const struct mapidx* idx, uint32_t section, const char* from)
+{
+    const struct mapidx_from* f = mapidx_from(idx, from);
+    const struct mapidx_posting* p;
+    uint32_t i;
+    if (!f)
+        return NULL;
+    p = mapidx_postings(idx, f);
+    for (i = 0; i < f->count; i++)
+        if (p[i].section == section)
+            return mapidx_str(idx, p[i].to);
+    return NULL;
+}
+
+/*
+ * The filter of "from" and excluded names, compiled in; b is not owned
+ */
+void mapidx_bloom(const struct mapidx* idx, struct bloom* b)
+{
+    memset(b, 0, sizeof *b);
+    if (!idx->hdr || !idx->hdr->bloom_words)
+        return;
+    b->words = (const uint32_t*)(idx->base + idx->hdr->bloom_off);
+    b->nwords = idx->hdr->bloom_words;
+}
+
+/*
+ * True if exactly one mapping of all sections maps from; its section and
+ * mapped name are returned then.
+ */
+bool mapidx_unique(const struct mapidx* idx, const char* from, uint32_t* section, const char** to)
+{
+    const struct mapidx_from* f = mapidx_from(idx, from);
+    const struct mapidx_posting* p;
+    if (!f || f->count != 1)
+        return false;
+    p = mapidx_postings(idx, f);
+    if (p->section >= idx->hdr->nsections || !(*to = mapidx_str(idx, p->to)))
+        return false;
+    *section = p->section;
+    return true;
+}
+
+/* ------------------------------------------------------------------------ */
+/* compilation, used by pam_nss_compile                                      */
+
+struct mapidx_pair {
+    const char* from;
+    const char* to;
+    uint32_t section;
+    uint32_t seq;       /* configuration order within equal names */
+};
+
+static int mapidx_pair_cmp(const void* a, const void* b)
+{
+    const struct mapidx_pair* x = (const struct mapidx_pair*)a;
+    const struct mapidx_pair* y = (const struct mapidx_pair*)b;
+    int c = strcmp(x->from, y->from);
+    if (c)
+        return c;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+struct mapidx_bucket {
+    uint32_t bucket;
+    uint32_t count;
+};
+
+static int mapidx_bucket_cmp(const void* a, const void* b)
+{
+    const struct mapidx_bucket* x = (const struct mapidx_bucket*)a;
+    const struct mapidx_bucket* y = (const struct mapidx_bucket*)b;
+    if (x->count != y->count)
+        return x->count > y->count ? -1 : 1;
+    return x->bucket < y->bucket ? -1 : x->bucket > y->bucket;
+}
+
+/*
+ * Hash-and-displace: keys are spread over buckets, then the buckets,
+ * largest first, each get the first displacement that sends all their
+ * keys to free slots.  keys have to be distinct.
+ */
+static int mapidx_phash_build(const char** keys, uint32_t n, uint32_t* nbuckets, uint32_t* nslots,
+                              uint32_t** seeds, uint32_t** slots)
+{
+    uint64_t* hashes = NULL;
+    uint32_t *start = NULL, *members = NULL, *tmp = NULL;
+    struct mapidx_bucket* order = NULL;
+    unsigned char* used = NULL;
+    uint32_t nb = n / 4 + 1, ns = n + n / 8 + 1, i, b, k, attempt;
+    int ret = -1;
+
+    hashes = (uint64_t*)malloc(sizeof(uint64_t) * (n + 1));
+    start = (uint32_t*)calloc(nb + 1, sizeof(uint32_t));
+    members = (uint32_t*)malloc(sizeof(uint32_t) * (n + 1));
+    order = (struct mapidx_bucket*)malloc(sizeof(struct mapidx_bucket) * nb);
+    tmp = (uint32_t*)malloc(sizeof(uint32_t) * (n + 1));
+    if (!hashes || !start || !members || !order || !tmp)
+        goto out;
+    /* bucket members, counting sort */
+    for (i = 0; i < n; i++) {
+        hashes[i] = mapidx_hash(keys[i]);
+        start[mapidx_mix(hashes[i]) % nb + 1]++;
+    }
+    for (b = 0; b < nb; b++) {
+        order[b].bucket = b;
+        order[b].count = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    memcpy(tmp, start, sizeof(uint32_t) * nb);
+    for (i = 0; i < n; i++)
+        members[tmp[mapidx_mix(hashes[i]) % nb]++] = i;
+    qsort(order, nb, sizeof *order, mapidx_bucket_cmp);
+
+    for (attempt = 0; attempt < MAPIDX_ATTEMPTS; attempt++, ns += n / 8 + 1) {
+        bool placed = true;
+        *seeds = (uint32_t*)calloc(nb, sizeof(uint32_t));
+        *slots = (uint32_t*)calloc(ns, sizeof(uint32_t));
+        used = (unsigned char*)calloc(ns, 1);
+        if (!*seeds || !*slots || !used)
+            break;
+        for (b = 0; b < nb && placed && order[b].count; b++) {
+            const uint32_t* keys_of = members + start[order[b].bucket];
+            uint32_t seed;
+            placed = false;
+            for (seed = 1; seed < MAPIDX_MAX_SEED && !placed; seed++) {
+                placed = true;
+                for (k = 0; k < order[b].count && placed; k++) {
+                    uint32_t j;
+                    tmp[k] = mapidx_slot(hashes[keys_of[k]], seed, ns);
+                    if (used[tmp[k]])
+                        placed = false;
+                    for (j = 0; j < k && placed; j++)
+                        if (tmp[j] == tmp[k])
+                            placed = false;
+                }
+                if (placed) {
+                    (*seeds)[order[b].bucket] = seed;
+                    for (k = 0; k < order[b].count; k++) {
+                        used[tmp[k]] = 1;
+                        (*slots)[tmp[k]] = keys_of[k] + 1;
+                    }
+                }
+            }
+        }
+        free(used);
+        used = NULL;
+        if (placed) {
+            *nbuckets = nb;
+            *nslots = ns;
+            ret = 0;
+            break;
+        }
+        free(*seeds);
+        free(*slots);
+        *seeds = *slots = NULL;
+    }
+out:
+    if (ret) {
+        free(*seeds);
+        free(*slots);
+        *seeds = *slots = NULL;
+    }
+    free(used);
+    free(hashes);
+    free(start);
+    free(members);
+    free(order);
+    free(tmp);
+    return ret;
+}
+
+/* strings area being built; offsets are from the start of the file */
+struct mapidx_strings {
+    char* data;
+    size_t len;
+    size_t cap;
+    size_t base;
+};
+
+static uint32_t mapidx_str_add(struct mapidx_strings* s, const char* str)
+{
+    size_t len;
+    if (!str)
+        return 0;
+    len = strlen(str) + 1;
+    if (s->len + len > s->cap) {
+        size_t cap = (s->cap ? s->cap * 2 : 4096) + len;
+        char* data = (char*)realloc(s->data, cap);
+        if (!data)
+            return 0;
+        s->data = data;
+        s->cap = cap;
+    }
+    memcpy(s->data + s->len, str, len);
+    s->len += len;
+    return (uint32_t)(s->base + s->len - len);
+}
+
+/* the urls of item other than item->url, one per line; 0 if none */
+static uint32_t mapidx_urls_add(struct mapidx_strings* s, const struct mapitem* item)
+{
+    size_t len = 0;
+    uint32_t off;
+    char* urls;
+    int i;
+    for (i = 0; i < item->nurls; i++)
+        if (item->urls[i] != item->url)
+            len += strlen(item->urls[i]) + 1;
+    if (!len || !(urls = (char*)malloc(len)))
+        return 0;
+    for (len = 0, i = 0; i < item->nurls; i++) {
+        if (item->urls[i] == item->url)
+            continue;
+        len += sprintf(urls + len, "%s", item->urls[i]);
+        urls[len++] = '\n';
+    }
+    urls[len - 1] = '\0';
+    off = mapidx_str_add(s, urls);
+    free(urls);
+    return off;
+}
+
+static bool mapidx_write_all(int fd, const void* data, size_t len)
+{
+    const char* p = (const char*)data;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/*
+ * Compile the parsed configuration into an index file at path, replaced
+ * atomically.  src is the stat of the configuration file before it was
+ * parsed.
+ * Returns 0 on success, -1 on error (errno set).
+ */
+int mapidx_write(const char* path, const struct map* map, const struct list* excluded,
+                 const struct map_settings* settings, int debug, const struct stat* src)
+{
+    struct mapidx_header hdr;
+    struct mapidx_section* sections = NULL;
+    struct mapidx_from* froms = NULL;
+    struct mapidx_posting* postings = NULL;
+    struct mapidx_pair* pairs = NULL;
+    uint32_t* excl = NULL;
+    const char** keys = NULL;
+    uint32_t *sec_keys = NULL, *sec_seeds = NULL, *sec_slots = NULL, *from_seeds = NULL, *from_slots = NULL;
+    struct mapidx_strings strings = { NULL, 0, 0, 0 };
+    struct bloom bloom = { NULL, 0, NULL };
+    uint32_t nsections = map ? map->size : 0, nexcluded = excluded ? excluded->size : 0;
+    uint32_t npairs = 0, nfroms = 0, nkeys = 0, i, j;
+    uint64_t off;
+    char tmppath[4096];
+    int fd = -1, ret = -1;
+
+    memset(&hdr, 0, sizeof hdr);
+    for (i = 0; i < nsections; i++)
+        npairs += (map->items + i)->users ? (map->items + i)->users->size : 0;
+    sections = (struct mapidx_section*)calloc(nsections + 1, sizeof *sections);
+    pairs = (struct mapidx_pair*)calloc(npairs + 1, sizeof *pairs);
+    postings = (struct mapidx_posting*)calloc(npairs + 1, sizeof *postings);
+    froms = (struct mapidx_from*)calloc(npairs + 1, sizeof *froms);
+    keys = (const char**)calloc((npairs > nsections ? npairs : nsections) + 1, sizeof *keys);
+    sec_keys = (uint32_t*)calloc(nsections + 1, sizeof *sec_keys);
+    excl = (uint32_t*)calloc(nexcluded + 1, sizeof *excl);
+    if (!sections || !pairs || !postings || !froms || !keys || !sec_keys || !excl)
+        goto out;
+
+    /* group the mappings by "from" name, keeping configuration order */
+    npairs = 0;
+    for (i = 0; i < nsections; i++) {
+        const struct user* users = (map->items + i)->users;
+        for (j = 0; users && j < users->size; j++, npairs++) {
+            pairs[npairs].from = (users->items + j)->from;
+            pairs[npairs].to = (users->items + j)->to;
+            pairs[npairs].section = i;
+            pairs[npairs].seq = npairs;
+        }
+    }
+    qsort(pairs, npairs, sizeof *pairs, mapidx_pair_cmp);
+    for (i = 0; i < npairs; i++) {
+        if (!nfroms || strcmp(pairs[i].from, keys[nfroms - 1])) {
+            froms[nfroms].first = i;
+            keys[nfroms++] = pairs[i].from;
+        }
+        froms[nfroms - 1].count++;
+    }
+    if (mapidx_phash_build(keys, nfroms, &hdr.from_hash.nbuckets, &hdr.from_hash.nslots,
+                           &from_seeds, &from_slots))
+        goto out;
+
+    if (bloom_init(&bloom, nfroms + nexcluded))
+        goto out;
+    for (i = 0; i < nfroms; i++)
+        bloom_add(&bloom, keys[i], strlen(keys[i]));
+    for (i = 0; i < nexcluded; i++)
+        bloom_add(&bloom, (excluded->items + i)->data, strlen((excluded->items + i)->data));
+
+    /* only the first of equally named sections is reachable by name */
+    for (i = 0; i < nsections; i++) {
+        for (j = 0; j < nkeys; j++)
+            if (strcmp((map->items + sec_keys[j])->name, (map->items + i)->name) == 0)
+                break;
+        if (j == nkeys)
+            sec_keys[nkeys++] = i;
+    }
+    for (j = 0; j < nkeys; j++)
+        keys[j] = (map->items + sec_keys[j])->name;
+    if (mapidx_phash_build(keys, nkeys, &hdr.section_hash.nbuckets, &hdr.section_hash.nslots,
+                           &sec_seeds, &sec_slots))
+        goto out;
+    /* section slots hold key numbers, make them section numbers */
+    for (j = 0; j < hdr.section_hash.nslots; j++)
+        if (sec_slots[j])
+            sec_slots[j] = sec_keys[sec_slots[j] - 1] + 1;
+
+    /* layout: header, tables, strings */
+    off = sizeof hdr;
+    hdr.sections_off = off;
+    off += (uint64_t)nsections * sizeof *sections;
+    hdr.froms_off = off;
+    off += (uint64_t)nfroms * sizeof *froms;
+    hdr.postings_off = off;
+    off += (uint64_t)npairs * sizeof *postings;
+    hdr.excluded_off = off;
+    off += (uint64_t)nexcluded * sizeof *excl;
+    hdr.bloom_words = bloom.nwords;
+    hdr.bloom_off = off;
+    off += (uint64_t)bloom.nwords * sizeof(uint32_t);
+    hdr.section_hash.seeds_off = off;
+    off += (uint64_t)hdr.section_hash.nbuckets * sizeof(uint32_t);
+    hdr.section_hash.slots_off = off;
+    off += (uint64_t)hdr.section_hash.nslots * sizeof(uint32_t);
+    hdr.from_hash.seeds_off = off;
+    off += (uint64_t)hdr.from_hash.nbuckets * sizeof(uint32_t);
+    hdr.from_hash.slots_off = off;
+    off += (uint64_t)hdr.from_hash.nslots * sizeof(uint32_t);
+    hdr.strings_off = off;
+    strings.base = off;
+    mapidx_str_add(&strings, "");   /* offset 0 of the area is never used */
+
+    for (i = 0; i < nsections; i++) {
+        const struct mapitem* item = map->items + i;
+        sections[i].name = mapidx_str_add(&strings, item->name);
+        sections[i].url = mapidx_str_add(&strings, item->url);
+        sections[i].jwks_url = mapidx_str_add(&strings, item->jwks_url);
+        sections[i].issuer = mapidx_str_add(&strings, item->issuer);
+        sections[i].audience = mapidx_str_add(&strings, item->audience);
+        sections[i].jwks_refresh = item->jwks_refresh;
+        sections[i].timeout = item->timeout;
+        sections[i].urls = mapidx_urls_add(&strings, item);
+    }
+    for (i = 0; i < nfroms; i++)
+        froms[i].name = mapidx_str_add(&strings, pairs[froms[i].first].from);
+    for (i = 0; i < npairs; i++) {
+        postings[i].section = pairs[i].section;
+        postings[i].to = mapidx_str_add(&strings, pairs[i].to);
+    }
+    for (i = 0; i < nexcluded; i++)
+        excl[i] = mapidx_str_add(&strings, (excluded->items + i)->data);
+    hdr.broker_socket = mapidx_str_add(&strings, settings->broker_socket);
+    if (!strings.data || off + strings.len > UINT32_MAX) {
+        errno = EFBIG;
+        goto out;
+    }
+
+    hdr.magic = MAPIDX_MAGIC;
+    hdr.version = MAPIDX_VERSION;
+    hdr.size = off + strings.len;
+    hdr.nsections = nsections;
+    hdr.nfroms = nfroms;
+    hdr.npostings = npairs;
+    hdr.nexcluded = nexcluded;
+    hdr.debug = debug;
+    hdr.cache_ttl = settings->cache_ttl;
+    hdr.max_response = settings->max_response;
+    hdr.flags = (settings->watch_config ? MAPIDX_F_WATCH : 0)
+        | (settings->warmup ? MAPIDX_F_WARMUP : 0)
+        | (settings->tls_sessions ? MAPIDX_F_TLS_SESSIONS : 0)
+        | (settings->parallel_auth ? MAPIDX_F_PARALLEL_AUTH : 0)
+        | (settings->prewarm ? 0 : MAPIDX_F_NO_PREWARM);
+    hdr.src_dev = src->st_dev;
+    hdr.src_ino = src->st_ino;
+    hdr.src_size = src->st_size;
+    hdr.src_mtime_sec = src->st_mtim.tv_sec;
+    hdr.src_mtime_nsec = src->st_mtim.tv_nsec;
+
+    if (snprintf(tmppath, sizeof tmppath, "%s.tmp-XXXXXX", path) >= (int)sizeof tmppath) {
+        errno = ENAMETOOLONG;
+        goto out;
+    }
+    fd = mkstemp(tmppath);
+    if (fd < 0)
+        goto out;
+    if (mapidx_write_all(fd, &hdr, sizeof hdr)
+        && mapidx_write_all(fd, sections, (size_t)nsections * sizeof *sections)
+        && mapidx_write_all(fd, froms, (size_t)nfroms * sizeof *froms)
+        && mapidx_write_all(fd, postings, (size_t)npairs * sizeof *postings)
+        && mapidx_write_all(fd, excl, (size_t)nexcluded * sizeof *excl)
+        && mapidx_write_all(fd, bloom.words, (size_t)bloom.nwords * sizeof(uint32_t))
+        && mapidx_write_all(fd, sec_seeds, (size_t)hdr.section_hash.nbuckets * sizeof(uint32_t))
+        && mapidx_write_all(fd, sec_slots, (size_t)hdr.section_hash.nslots * sizeof(uint32_t))
+        && mapidx_write_all(fd, from_seeds, (size_t)hdr.from_hash.nbuckets * sizeof(uint32_t))
+        && mapidx_write_all(fd, from_slots, (size_t)hdr.from_hash.nslots * sizeof(uint32_t))
+        && mapidx_write_all(fd, strings.data, strings.len)
+        && fchmod(fd, 0644) == 0 && fsync(fd) == 0)
+        ret = 0;
+    if (close(fd) || (ret == 0 && rename(tmppath, path)))
+        ret = -1;
+    if (ret)
+        unlink(tmppath);
+out:
+    free(sections);
+    free(froms);
+    free(postings);
+    free(pairs);
+    free(excl);
+    free(keys);
+    free(sec_keys);
+    free(sec_seeds);
+    free(sec_slots);
+    free(from_seeds);
+    free(from_slots);
+    free(strings.data);
+    bloom_free(&bloom);
+    return ret;
+}
@@ -0,0 +1,109 @@
+#ifndef MAPIDX_H
+#define MAPIDX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+/*
+ * Compiled form of pam_nss.conf, written by pam_nss_compile and mmap'ed
+ * read-only by libnss_mapiamname and pam_ssh.  Sections and "from" names
+ * are found through hash-and-displace perfect hashes; every offset is
+ * relative to the start of the file and 0 stands for "not set".
+ * The index records the identity of the configuration file it was built
+ * from and is ignored as soon as that file changes.
+ */
+
+#define MAPIDX_FILE "/etc/pam_nss.idx"
+/* same format, published by the first root process parsing a new configuration */
+#define MAPIDX_SHM "/dev/shm/mapiamname.idx"
+#define MAPIDX_MAGIC 0x3158494d    /* "MIX1" */
+#define MAPIDX_VERSION 5
+
+#define MAPIDX_F_WATCH 0x1     /* watch_config */
+#define MAPIDX_F_WARMUP 0x2    /* warmup */
+#define MAPIDX_F_TLS_SESSIONS 0x4  /* tls_sessions */
+#define MAPIDX_F_PARALLEL_AUTH 0x8 /* parallel_auth */
+#define MAPIDX_F_NO_PREWARM 0x10   /* prewarm = false */
+
+struct mapidx_phash {
+    uint32_t nbuckets;
+    uint32_t nslots;
+    uint32_t seeds_off;     /* uint32_t[nbuckets], displacement of each bucket */
+    uint32_t slots_off;     /* uint32_t[nslots], key number + 1, 0 if empty */
+};
+
+struct mapidx_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;          /* of the whole file */
+    uint32_t strings_off;   /* NUL terminated strings up to the end of file */
+    uint32_t nsections, sections_off;   /* struct mapidx_section[] */
+    uint32_t nfroms, froms_off;         /* struct mapidx_from[] */
+    uint32_t npostings, postings_off;   /* struct mapidx_posting[] */
+    uint32_t nexcluded, excluded_off;   /* uint32_t[] string offsets */
+    uint32_t bloom_words, bloom_off;    /* uint32_t[], filter of froms and excluded */
+    struct mapidx_phash section_hash;
+    struct mapidx_phash from_hash;
+    /* top level settings */
+    int32_t debug;
+    int32_t cache_ttl;
+    int32_t max_response;
+    uint32_t broker_socket;
+    uint32_t flags;         /* MAPIDX_F_* */
+    /* configuration file the index was compiled from */
+    uint64_t src_dev;
+    uint64_t src_ino;
+    uint64_t src_size;
+    int64_t src_mtime_sec;
+    int64_t src_mtime_nsec;
+};
+
+struct mapidx_section {
+    uint32_t name;
+    uint32_t url;
+    uint32_t jwks_url;
+    uint32_t issuer;
+    uint32_t audience;
+    int32_t jwks_refresh;
+    int32_t timeout;
+    uint32_t urls;          /* more urls after url, one per line */
+};
+
+/* every section mapping a "from" name, in configuration order */
+struct mapidx_from {
+    uint32_t name;
+    uint32_t first;         /* into postings */
+    uint32_t count;
+};
+
+struct mapidx_posting {
+    uint32_t section;
+    uint32_t to;
+};
+
+struct mapidx {
+    const unsigned char* base;
+    size_t size;
+    const struct mapidx_header* hdr;
+};
+
+struct map;
+struct list;
+struct map_settings;
+struct bloom;
+
+extern int mapidx_open(const char* path, const struct stat* src, struct mapidx* idx);
+extern void mapidx_close(struct mapidx* idx);
+extern const char* mapidx_str(const struct mapidx* idx, uint32_t off);
+extern const struct mapidx_section* mapidx_section(const struct mapidx* idx, uint32_t n);
+extern int mapidx_find_section(const struct mapidx* idx, const char* name);
+extern const struct mapidx_from* mapidx_from(const struct mapidx* idx, const char* from);
+extern const char* mapidx_lookup(const struct mapidx* idx, uint32_t section, const char* from);
+extern void mapidx_bloom(const struct mapidx* idx, struct bloom* b);
+extern bool mapidx_unique(const struct mapidx* idx, const char* from, uint32_t* section, const char** to);
+extern int mapidx_write(const char* path, const struct map* map, const struct list* excluded,
+                        const struct map_settings* settings, int debug, const struct stat* src);
+
+#endif
@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pwd.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include "common.h"
+#include "pwcache.h"
+#include "rcu.h"
+
+/* a passwd entry as returned for a mapped user, strings packed in data */
+struct pwrec {
+    unsigned int hash;
+    bool found;             /* false: no such account, only pw_name is set */
+    uid_t uid;
+    gid_t gid;
+    unsigned int len;       /* of data; pw_name is at offset 0 */
+    unsigned int passwd, shell, gecos, dir;
+    char data[];
+};
+
+/*
+ * The "to" accounts looked up since the configuration was loaded or
+ * /etc/passwd last changed.  Records are added in place under
+ * pwcache_lock; a table that fills up is replaced by a larger one.
+ */
+struct pwtable {
+    struct stat st;         /* of /etc/passwd when the table was started */
+    unsigned int mask;
+    unsigned int count;
+    struct pwrec* recs[];
+};
+
+#define PWCACHE_UNKNOWN 3       /* not looked up yet, internal to this file */
+#define PWCACHE_SIZE 16         /* first number of slots of a table */
+#define PWCACHE_BUFFER_MAX (1024 * 1024)    /* largest getpwnam_r() buffer tried */
+
+/* readers look up under rcu_read_lock(), pwcache_lock serializes the writers */
+static struct pwtable* pwcurrent;
+static pthread_mutex_t pwcache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* set while this thread asks the other NSS backends, see pwcache_resolving() */
+static __thread bool pwcache_busy;
+
+static void pwtable_free(struct pwtable* table)
+{
+    unsigned int i;
+    if (!table)
+        return;
+    for (i = 0; i <= table->mask; i++)
+        free(table->recs[i]);
+    free(table);
+}
+
+/*
+ * Replace the current table and free the old one once no reader uses it;
+ * with moved its records live on in table and only the slots go.
+ */
+static void pwcache_publish(struct pwtable* table, bool moved)
+{
+    struct pwtable* old = __atomic_exchange_n(&pwcurrent, table, __ATOMIC_SEQ_CST);
+    rcu_synchronize();
+    if (moved)
+        free(old);
+    else
+        pwtable_free(old);
+}
+
+/* around fork(), see map_atfork_prepare() */
+void pwcache_atfork_prepare(void)
+{
+    pthread_mutex_lock(&pwcache_lock);
+}
+
+void pwcache_atfork_parent(void)
+{
+    pthread_mutex_unlock(&pwcache_lock);
+}
+
+void pwcache_atfork_child(void)
+{
+    pthread_mutex_init(&pwcache_lock, NULL);
+    pwcache_busy = false;
+}
+
+void pwcache_reset(void)
+{
+    pthread_mutex_lock(&pwcache_lock);
+    pwcache_publish(NULL, false);
+    pthread_mutex_unlock(&pwcache_lock);
+}
+
+bool pwcache_resolving(void)
+{
+    return pwcache_busy;
+}
+
+static bool pwcache_fresh(const struct pwtable* table, const struct stat* st)
+{
+    return table && st->st_dev == table->st.st_dev
+        && st->st_ino == table->st.st_ino
+        && st->st_size == table->st.st_size
+        && st->st_mtim.tv_sec == table->st.st_mtim.tv_sec
+        && st->st_mtim.tv_nsec == table->st.st_mtim.tv_nsec;
+}
+
+/*
+ * Record with the same content pwcopy() produces: password "x", gecos
+ * "<name> mapped user" and the last part of the home directory set to
+ * the user name.
+ */
+static struct pwrec* pwrec_new(const struct passwd* src)
+{
+    const char* dir = src->pw_dir ? src->pw_dir : "";
+    const char* slash = strrchr(dir, '/');
+    size_t name_len = strlen(src->pw_name);
+    size_t dir_len = slash ? (size_t)(slash + 1 - dir) + name_len : strlen(dir);
+    size_t shell_len = src->pw_shell ? strlen(src->pw_shell) : 0;
+    size_t gecos_len = name_len + strlen(" mapped user");
+    size_t len = name_len + 1 + 2 + shell_len + 1 + gecos_len + 1 + dir_len + 1;
+    struct pwrec* rec = (struct pwrec*)malloc(sizeof(struct pwrec) + len);
+    char* p;
+    if (!rec)
+        return NULL;
+    rec->hash = map_hash(src->pw_name);
+    rec->found = true;
+    rec->uid = src->pw_uid;
+    rec->gid = src->pw_gid;
+    rec->len = len;
+    p = rec->data;
+    memcpy(p, src->pw_name, name_len + 1);
+    p += name_len + 1;
+    rec->passwd = p - rec->data;
+    memcpy(p, "x", 2);
+    p += 2;
+    rec->shell = p - rec->data;
+    memcpy(p, src->pw_shell ? src->pw_shell : "", shell_len + 1);
+    p += shell_len + 1;
+    rec->gecos = p - rec->data;
+    p += sprintf(p, "%s mapped user", src->pw_name) + 1;
+    rec->dir = p - rec->data;
+    if (slash) {
+        memcpy(p, dir, slash + 1 - dir);
+        memcpy(p + (slash + 1 - dir), src->pw_name, name_len + 1);
+    } else
+        memcpy(p, dir, dir_len + 1);
+    return rec;
+}
+
+/* record of an account no backend knows, so it is not asked for again */
+static struct pwrec* pwrec_missing(const char* name)
+{
+    size_t len = strlen(name) + 1;
+    struct pwrec* rec = (struct pwrec*)calloc(1, sizeof(struct pwrec) + len);
+    if (!rec)
+        return NULL;
+    rec->hash = map_hash(name);
+    rec->len = len;
+    memcpy(rec->data, name, len);
+    return rec;
+}
+
+/*
+ * Ask the NSS backends before this one for name; NULL if out of memory
+ * or a backend failed, which is not remembered.  An entry with another
+ * spelling of the name does not count, as with the exact match of a scan.
+ */
+static struct pwrec* pwrec_resolve(const char* name)
+{
+    struct passwd pwd, *result = NULL;
+    struct pwrec* rec = NULL;
+    long max = sysconf(_SC_GETPW_R_SIZE_MAX);
+    size_t size = max > 0 ? (size_t)max : 1024;
+    char *buf = NULL, *grown;
+    int err = ENOMEM;
+
+    /* _nss_mapiamname_getpwnam_r() answers nothing while this is set */
+    pwcache_busy = true;
+    while ((grown = (char*)realloc(buf, size)) != NULL) {
+        buf = grown;
+        err = getpwnam_r(name, &pwd, buf, size, &result);
+        if (err != ERANGE || size >= PWCACHE_BUFFER_MAX)
+            break;
+        size *= 2;
+    }
+    pwcache_busy = false;
+    /* the errors getpwnam_r(3) lists for a name that is not there */
+    if (!err || err == ENOENT || err == ESRCH || err == EBADF || err == EPERM)
+        rec = result && strcmp(result->pw_name, name) == 0 ? pwrec_new(result)
+                                                           : pwrec_missing(name);
+    else if (map_debug)
+        sys_log(LOG_WARNING, "pwcache: getpwnam_r(%s) failed: %s", name, strerror(err));
+    free(buf);
+    return rec;
+}
+
+/* the records of table in one twice as large; NULL if out of memory */
+static struct pwtable* pwtable_grow(const struct pwtable* table)
+{
+    unsigned int size = (table->mask + 1) * 2, i, h;
+    struct pwtable* grown = (struct pwtable*)calloc(1, sizeof(struct pwtable) + size * sizeof(struct pwrec*));
+    if (!grown)
+        return NULL;
+    grown->st = table->st;
+    grown->mask = size - 1;
+    grown->count = table->count;
+    for (i = 0; i <= table->mask; i++) {
+        if (!table->recs[i])
+            continue;
+        for (h = table->recs[i]->hash & grown->mask; grown->recs[h]; h = (h + 1) & grown->mask)
+            ;
+        grown->recs[h] = table->recs[i];
+    }
+    return grown;
+}
+
+/* slot of name in table, empty if it was not looked up yet */
+static unsigned int pwtable_probe(const struct pwtable* table, const char* name, unsigned int hash)
+{
+    const struct pwrec* rec;
+    unsigned int h;
+    for (h = hash & table->mask; (rec = __atomic_load_n(&table->recs[h], __ATOMIC_ACQUIRE)); h = (h + 1) & table->mask)
+        if (rec->hash == hash && strcmp(rec->data, name) == 0)
+            break;
+    return h;
+}
+
+/*
+ * Look name up once for the current table: a table of an older
+ * /etc/passwd is started afresh, a full one replaced by a larger one.
+ * Returns 0 if name has a record now, -1 if not.
+ */
+static int pwcache_add(const char* name, unsigned int hash, const struct stat* st)
+{
+    struct pwtable *table, *grown;
+    struct pwrec* rec;
+    unsigned int h;
+    int ret = -1;
+
+    pthread_mutex_lock(&pwcache_lock);
+    table = pwcurrent;
+    if (!pwcache_fresh(table, st)) {
+        table = (struct pwtable*)calloc(1, sizeof(struct pwtable) + PWCACHE_SIZE * sizeof(struct pwrec*));
+        if (!table)
+            goto out;
+        table->st = *st;
+        table->mask = PWCACHE_SIZE - 1;
+        pwcache_publish(table, false);
+    }
+    /* looked up by another thread meanwhile? */
+    if (table->recs[pwtable_probe(table, name, hash)]) {
+        ret = 0;
+        goto out;
+    }
+    if ((table->count + 1) * 2 > table->mask) {
+        if (!(grown = pwtable_grow(table)))
+            goto out;
+        pwcache_publish(grown, true);
+        table = grown;
+    }
+    if (!(rec = pwrec_resolve(name)))
+        goto out;
+    h = pwtable_probe(table, name, hash);
+    table->count++;
+    __atomic_store_n(&table->recs[h], rec, __ATOMIC_RELEASE);
+    ret = 0;
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "pwcache_add: %s %s, %u accounts", name,
+                rec->found ? "found" : "unknown", table->count);
+out:
+    pthread_mutex_unlock(&pwcache_lock);
+    return ret;
+}
+
+/* copy the record of name, if table has one, into the caller's passwd buffer */
+static int pwcache_copy(const char* name, unsigned int hash, const struct stat* st, struct pwbuf* pb)
+{
+    unsigned int token = rcu_read_lock();
+    const struct pwtable* table = __atomic_load_n(&pwcurrent, __ATOMIC_ACQUIRE);
+    const struct pwrec* rec = NULL;
+    int ret = PWCACHE_FOUND;
+
+    if (pwcache_fresh(table, st))
+        rec = __atomic_load_n(&table->recs[pwtable_probe(table, name, hash)], __ATOMIC_ACQUIRE);
+    if (!rec)
+        ret = PWCACHE_UNKNOWN;
+    else if (!rec->found)
+        ret = PWCACHE_NOTFOUND;
+    else if (rec->len > pb->buflen) {
+        *pb->errnop = ERANGE;
+        ret = PWCACHE_ERANGE;
+    } else {
+        memcpy(pb->buf, rec->data, rec->len);
+        pb->pw->pw_name = pb->buf;
+        pb->pw->pw_passwd = pb->buf + rec->passwd;
+        pb->pw->pw_uid = rec->uid;
+        pb->pw->pw_gid = rec->gid;
+        pb->pw->pw_gecos = pb->buf + rec->gecos;
+        pb->pw->pw_dir = pb->buf + rec->dir;
+        pb->pw->pw_shell = pb->buf + rec->shell;
+    }
+    rcu_read_unlock(token);
+    return ret;
+}
+
+/*
+ * Copy the record of name into the caller's passwd buffer, asking the
+ * other backends the first time name is looked up
+ */
+int pwcache_get(const char* name, struct pwbuf* pb)
+{
+    unsigned int hash = map_hash(name);
+    struct stat st;
+    int ret;
+
+    /* a local account added or removed since a name was looked up */
+    if (stat(PWCACHE_FILE, &st))
+        memset(&st, 0, sizeof st);
+    ret = pwcache_copy(name, hash, &st, pb);
+    if (ret == PWCACHE_UNKNOWN && pwcache_add(name, hash, &st) == 0)
+        ret = pwcache_copy(name, hash, &st, pb);
+    /* out of memory, a failing backend or reset by a reload meanwhile */
+    return ret == PWCACHE_UNKNOWN ? PWCACHE_UNAVAIL : ret;
+}
@@ -0,0 +1,28 @@
+#ifndef PWCACHE_H
+#define PWCACHE_H
+
+/*
+ * Ready-made passwd records of the accounts users are mapped to, so that
+ * a mapped lookup is one hash probe and a memcpy into the caller's
+ * buffer.  Each name is resolved with getpwnam_r() the first time it is
+ * asked for, and an unknown one is remembered as such.  Dropped when the
+ * configuration is reloaded or /etc/passwd changes.
+ */
+
+#define PWCACHE_FILE "/etc/passwd"   /* stat()ed to notice local account changes */
+
+#define PWCACHE_FOUND 0         /* copied into the caller's buffer */
+#define PWCACHE_ERANGE 1        /* buffer too small, errnop set */
+#define PWCACHE_NOTFOUND 2      /* no backend knows the account */
+#define PWCACHE_UNAVAIL -1      /* out of memory or a backend failed */
+
+struct pwbuf;
+
+extern int pwcache_get(const char* name, struct pwbuf* pb);
+extern void pwcache_reset(void);
+extern bool pwcache_resolving(void);
+extern void pwcache_atfork_prepare(void);
+extern void pwcache_atfork_parent(void);
+extern void pwcache_atfork_child(void);
+
+#endif
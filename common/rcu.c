@@ -0,0 +1,91 @@
+#include <sched.h>
+#include <pthread.h>
+#include "rcu.h"
+
+/*
+ * Readers count themselves in the half of their shard selected by the
+ * epoch parity; rcu_synchronize() advances the epoch and waits until the
+ * previous half drained.  Shards keep concurrent readers off each
+ * other's cache lines.
+ */
+struct rcu_shard {
+    unsigned int readers[2];
+} __attribute__((aligned(64)));
+
+static unsigned int rcu_epoch;
+static struct rcu_shard rcu_shards[RCU_SHARDS];
+static pthread_mutex_t rcu_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int rcu_next_shard;
+static __thread unsigned int rcu_thread_shard;     /* shard + 1, 0 until assigned */
+static __thread unsigned int rcu_thread_readers[2]; /* read sections of this thread */
+
+static unsigned int rcu_shard_of_thread(void)
+{
+    if (!rcu_thread_shard)
+        rcu_thread_shard = __atomic_fetch_add(&rcu_next_shard, 1, __ATOMIC_RELAXED)
+            % RCU_SHARDS + 1;
+    return rcu_thread_shard - 1;
+}
+
+/*
+ * Enter a read section, returns the token for rcu_read_unlock()
+ */
+unsigned int rcu_read_lock(void)
+{
+    unsigned int shard = rcu_shard_of_thread(), epoch;
+    for (;;) {
+        epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&rcu_shards[shard].readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        /* registered before a concurrent rcu_synchronize() flipped the epoch? */
+        if (__atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST) == epoch) {
+            rcu_thread_readers[epoch & 1]++;
+            return (epoch & 1) << 8 | shard;
+        }
+        __atomic_sub_fetch(&rcu_shards[shard].readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void rcu_read_unlock(unsigned int token)
+{
+    rcu_thread_readers[(token >> 8) & 1]--;
+    __atomic_sub_fetch(&rcu_shards[token & 0xff].readers[(token >> 8) & 1], 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait until every read section that may have seen a pointer replaced
+ * before this call has ended
+ */
+void rcu_synchronize(void)
+{
+    unsigned int epoch, i;
+    pthread_mutex_lock(&rcu_sync_lock);
+    epoch = __atomic_fetch_add(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < RCU_SHARDS; i++)
+        while (__atomic_load_n(&rcu_shards[i].readers[epoch & 1], __ATOMIC_ACQUIRE))
+            sched_yield();
+    pthread_mutex_unlock(&rcu_sync_lock);
+}
+
+/* around fork(), see map_atfork_prepare() */
+void rcu_atfork_prepare(void)
+{
+    pthread_mutex_lock(&rcu_sync_lock);
+}
+
+void rcu_atfork_parent(void)
+{
+    pthread_mutex_unlock(&rcu_sync_lock);
+}
+
+/* the readers of the other threads did not come along, only ours count */
+void rcu_atfork_child(void)
+{
+    unsigned int i;
+    for (i = 0; i < RCU_SHARDS; i++)
+        rcu_shards[i].readers[0] = rcu_shards[i].readers[1] = 0;
+    if (rcu_thread_shard) {
+        rcu_shards[rcu_thread_shard - 1].readers[0] = rcu_thread_readers[0];
+        rcu_shards[rcu_thread_shard - 1].readers[1] = rcu_thread_readers[1];
+    }
+    pthread_mutex_init(&rcu_sync_lock, NULL);
+}
@@ -0,0 +1,22 @@
+#ifndef RCU_H
+#define RCU_H
+
+/*
+ * Minimal epoch based read-copy-update for the configuration snapshots:
+ * readers never block nor write shared data beyond their own counter
+ * shard, writers publish a new pointer, call rcu_synchronize() and then
+ * free what the old pointer referenced.
+ * A read section must not call anything that may publish (map_init_common,
+ * pwcache reloads), or rcu_synchronize() would wait for itself.
+ */
+
+#define RCU_SHARDS 16
+
+extern unsigned int rcu_read_lock(void);
+extern void rcu_read_unlock(unsigned int token);
+extern void rcu_synchronize(void);
+extern void rcu_atfork_prepare(void);
+extern void rcu_atfork_parent(void);
+extern void rcu_atfork_child(void);
+
+#endif
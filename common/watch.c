@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "common.h"
+#include "watch.h"
+
+/*
+ * The directory is watched rather than the file: editors and
+ * pam_nss_compile-like tools replace files by rename(), which a watch
+ * on the old inode would not see.
+ */
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE \
+                    | IN_DELETE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static bool watch_started;  /* a watcher thread exists (or is starting) */
+static bool watch_on;       /* ... and has seen every change since the current snapshot */
+
+bool map_watching(void)
+{
+    return __atomic_load_n(&watch_on, __ATOMIC_ACQUIRE);
+}
+
+/* the thread is not copied into a forked child, which has to poll */
+void map_watch_atfork_child(void)
+{
+    watch_on = false;
+    watch_started = false;
+}
+
+/*
+ * Scan a batch of events; *changed is set by events about the
+ * configuration file, *gone when the directory watch ended
+ */
+static void watch_events(const char *buf, ssize_t len, const char *name,
+                         bool *changed, bool *gone)
+{
+    const char *p = buf;
+    while (p + sizeof(struct inotify_event) <= buf + len) {
+        const struct inotify_event *ev = (const struct inotify_event*)p;
+        if (ev->mask & IN_Q_OVERFLOW)
+            *changed = true;
+        if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT))
+            *gone = true;
+        if (ev->len && strcmp(ev->name, name) == 0)
+            *changed = true;
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+}
+
+static void* watch_thread(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *name = strrchr(MAP_CONFIG_FILE, '/') + 1;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    bool changed, gone = false;
+    ssize_t n;
+
+    /* catch up with changes made before the watch was added */
+    map_config_reload();
+    __atomic_store_n(&watch_on, true, __ATOMIC_RELEASE);
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "watching %s", MAP_CONFIG_FILE);
+    while (!gone) {
+        n = read(fd, buf, sizeof buf);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        changed = false;
+        watch_events(buf, n, name, &changed, &gone);
+        if (!changed)
+            continue;
+        /* let an editor finish its write, rename, chmod sequence */
+        while (!gone && poll(&pfd, 1, MAP_WATCH_SETTLE) > 0
+               && (n = read(fd, buf, sizeof buf)) > 0)
+            watch_events(buf, n, name, &changed, &gone);
+        if (map_debug > 1)
+            sys_log(LOG_DEBUG, "%s changed, reloading", MAP_CONFIG_FILE);
+        map_config_reload();
+    }
+    /* back to polling; a later reload may start a new watcher */
+    __atomic_store_n(&watch_on, false, __ATOMIC_RELEASE);
+    close(fd);
+    __atomic_store_n(&watch_started, false, __ATOMIC_RELEASE);
+    if (map_debug)
+        sys_log(LOG_NOTICE, "stopped watching %s, polling it instead", MAP_CONFIG_FILE);
+    return NULL;
+}
+
+/*
+ * Start the watcher thread unless it runs already; return 0 on success,
+ * -1 if inotify is unavailable (the configuration is polled then)
+ */
+int map_watch_start(void)
+{
+    char dir[PATH_MAX];
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    int fd, err;
+
+    if (__atomic_exchange_n(&watch_started, true, __ATOMIC_ACQ_REL))
+        return 0;
+    snprintf(dir, sizeof dir, "%.*s",
+             (int)(strrchr(MAP_CONFIG_FILE, '/') - MAP_CONFIG_FILE), MAP_CONFIG_FILE);
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, WATCH_MASK) < 0) {
+        if (map_debug)
+            sys_log(LOG_NOTICE, "cannot watch %s (%m), polling it instead", dir);
+        if (fd >= 0)
+            close(fd);
+        __atomic_store_n(&watch_started, false, __ATOMIC_RELEASE);
+        return -1;
+    }
+    /* signals are for the threads of the process we are loaded into */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&thread, &attr, watch_thread, (void*)(intptr_t)fd);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        close(fd);
+        __atomic_store_n(&watch_started, false, __ATOMIC_RELEASE);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+
+/*
+ * Optional inotify watcher of the configuration file for long-lived
+ * processes: a thread re-reads MAP_CONFIG_FILE as soon as it changes,
+ * so nss_mapiamuser_config() does not need to stat() it at all.
+ * Started by the first reload when the configuration sets watch_config
+ * (never in pam_ssh.so, which libpam unloads at pam_end()), and by
+ * pam_ssh_broker.  Without inotify (or after the watcher stopped)
+ * the file is polled instead.
+ */
+
+#define MAP_WATCH_SETTLE 20     /* ms without events before reloading */
+
+extern int map_watch_start(void);
+extern bool map_watching(void);
+extern void map_watch_atfork_child(void);
+
+#endif
@@ -0,0 +1,70 @@
+/*
+ * pam_nss_compile: compiles /etc/pam_nss.conf into the binary index
+ * /etc/pam_nss.idx, which libnss_mapiamname and pam_ssh mmap instead of
+ * parsing the configuration file.  Run it again after every change of
+ * the configuration; until then the modules see a stale index and fall
+ * back to parsing the file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../common/common.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-o index]\n", prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *out = MAPIDX_FILE;
+    struct stat before, after;
+    struct map_snapshot *snap;
+    int opt, errnop = 0, users = 0, i;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+        case 'o':
+            out = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+
+    map_use_index = false;
+    if (map_config_stat(&before)) {
+        perror("pam_nss.conf");
+        return 1;
+    }
+    if (nss_mapiamuser_config(&errnop, "pam_nss_compile") != 0) {
+        fprintf(stderr, "%s: no mappings compiled, see syslog for parse errors\n", argv[0]);
+        return 1;
+    }
+    /* the index records the file it was built from, so it must not move */
+    if (map_config_stat(&after) || after.st_ino != before.st_ino
+        || after.st_size != before.st_size
+        || after.st_mtim.tv_sec != before.st_mtim.tv_sec
+        || after.st_mtim.tv_nsec != before.st_mtim.tv_nsec) {
+        fprintf(stderr, "%s: configuration changed while compiling, try again\n", argv[0]);
+        return 1;
+    }
+    snap = map_acquire();
+    if (mapidx_write(out, snap->users, snap->excluded, &snap->settings, map_debug, &before)) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], out, strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < snap->users->size; i++)
+        users += (snap->users->items + i)->users->size;
+    printf("%s: %d sections, %d mappings\n", out, snap->users->size, users);
+    map_release(snap);
+    return 0;
+}
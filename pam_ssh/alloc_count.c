@@ -0,0 +1,251 @@
+/*******************************************************************************
+ * file:        alloc_count.c
+ * description: counts the heap allocations of pam_ssh's own code during a
+ *              login against a single-url section, which should be none
+ * notes:       make alloccount; ./alloc_count [logins]
+ *              pam_sm_authenticate() is called as sshd would, with stand-ins
+ *              for the libpam calls, on the default settings (prewarm on,
+ *              no broker listening) read from ./alloc_count.conf.
+ *              malloc, calloc, realloc, strdup and strndup are wrapped at
+ *              link time (-Wl,--wrap), so only calls from the objects
+ *              linked here count, in any thread.  Not counted: what
+ *              libcurl and OpenSSL allocate for the transfer, and the stack
+ *              glibc maps for the prewarm thread pthread_create() starts.
+ *              The IAM is a loopback HTTP server in a thread; run as root
+ *              for the token cache in dbdir to be used as well.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <security/pam_modules.h>
+#include "../common/common.h"
+#include "pam_ssh_common.h"
+#include "cache.h"
+
+#define ENTITLEMENTS 256
+#define USERNAME "someusername"
+#define SECTION "alloc_count"
+#define TOKEN "alloc-count-token"
+
+static bool counting;              /* during the counted logins, in any thread */
+static unsigned long allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* p, size_t size);
+char* __real_strdup(const char* s);
+char* __real_strndup(const char* s, size_t n);
+
+void* __wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&allocations, counting, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&allocations, counting, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void* __wrap_realloc(void* p, size_t size)
+{
+    __atomic_add_fetch(&allocations, counting, __ATOMIC_RELAXED);
+    return __real_realloc(p, size);
+}
+
+char* __wrap_strdup(const char* s)
+{
+    __atomic_add_fetch(&allocations, counting, __ATOMIC_RELAXED);
+    return __real_strdup(s);
+}
+
+char* __wrap_strndup(const char* s, size_t n)
+{
+    __atomic_add_fetch(&allocations, counting, __ATOMIC_RELAXED);
+    return __real_strndup(s, n);
+}
+
+/* the response of the IAM: a userinfo of some 20KB, as in json_bench */
+static char* make_response(size_t* len)
+{
+    size_t size = 64 * 1024, body_len = 0;
+    char *body = malloc(size), *response = malloc(size + 256);
+    int i;
+    if (!body || !response) {
+        free(body);
+        free(response);
+        return NULL;
+    }
+    body_len += snprintf(body + body_len, size - body_len,
+                         "{\"sub\": \"38bf61bb-d1db-45e6-a36d-670e63aed301\", "
+                         "\"name\": \"FirstName LastName\", \"email\": \"some@email.com\", "
+                         "\"email_verified\": true, \"eduperson_entitlement\": [");
+    for (i = 0; i < ENTITLEMENTS; i++)
+        body_len += snprintf(body + body_len, size - body_len,
+                             "%s\"urn:mace:egi.eu:group:vo.example.org:role=member#aai.egi.eu:%d\"",
+                             i ? ", " : "", i);
+    body_len += snprintf(body + body_len, size - body_len,
+                         "], \"groups\": [\"users\", \"admins\"], "
+                         "\"preferred_username\": \"" USERNAME "\"}");
+    *len = snprintf(response, size + 256, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                    "Content-Length: %zu\r\nConnection: close\r\n\r\n%s", body_len, body);
+    free(body);
+    return response;
+}
+
+struct iam {
+    int fd;
+    const char* response;
+    size_t len;
+};
+
+static void* iam_thread(void* arg)
+{
+    struct iam* iam = arg;
+    char request[8192];
+    size_t got;
+    ssize_t n;
+    int fd;
+
+    while ((fd = accept(iam->fd, NULL, NULL)) >= 0) {
+        for (got = 0; got < sizeof request - 1; got += n) {
+            n = read(fd, request + got, sizeof request - 1 - got);
+            if (n <= 0)
+                break;
+            request[got + n] = '\0';
+            if (strstr(request, "\r\n\r\n"))
+                break;
+        }
+        if (write(fd, iam->response, iam->len) < 0)
+            perror("write");
+        close(fd);
+    }
+    return NULL;
+}
+
+/* what sshd's PAM stack hands pam_ssh; pam_ssh.so is not loaded through libpam here */
+struct pam_handle {
+    const char* user;
+    struct pam_conv conv;
+};
+
+int pam_get_item(const pam_handle_t* pamh, int item_type, const void** item)
+{
+    if (item_type == PAM_USER)
+        *item = pamh->user;
+    else if (item_type == PAM_CONV)
+        *item = &pamh->conv;
+    else
+        return PAM_BAD_ITEM;
+    return PAM_SUCCESS;
+}
+
+int pam_get_user(pam_handle_t* pamh, const char** user, const char* prompt)
+{
+    *user = pamh->user;
+    return PAM_SUCCESS;
+}
+
+const char* pam_strerror(pam_handle_t* pamh, int errnum)
+{
+    return "alloc_count";
+}
+
+/* the user types the token; what the application allocates is not counted */
+static int conversation(int n, const struct pam_message** msg, struct pam_response** resp,
+                        void* token)
+{
+    struct pam_response* r = __real_calloc(n, sizeof *r);
+    if (!r || !(r->resp = __real_strdup(token))) {
+        free(r);
+        return PAM_CONV_ERR;
+    }
+    *resp = r;
+    return PAM_SUCCESS;
+}
+
+/* the configuration pam_ssh reads, replaced at once as an editor would */
+static bool write_config(const char* url, int ttl)
+{
+    FILE* f = fopen(MAP_CONFIG_FILE ".new", "w");
+    if (!f)
+        return false;
+    fprintf(f, "debug=0\n"
+               "broker_socket=\"/nonexistent/alloc_count.sock\"\n"
+               "cache_ttl=%d\n"
+               "mappings=({ name=\"" SECTION "\"; url=\"%s\";\n"
+               "            users=({ from=\"" USERNAME "\"; to=\"" USERNAME "\"; }); })\n",
+            ttl, url);
+    return fclose(f) == 0 && rename(MAP_CONFIG_FILE ".new", MAP_CONFIG_FILE) == 0;
+}
+
+/* pam_sm_authenticate() for USERNAME@SECTION as sshd calls it, true if accepted */
+static bool login(void)
+{
+    struct pam_handle pamh = { USERNAME "@" SECTION, { conversation, TOKEN } };
+    const char* argv[] = { CONF_VAR_NAME MAP_CONFIG_FILE };
+    return pam_sm_authenticate(&pamh, 0, 1, argv) == PAM_SUCCESS;
+}
+
+/* allocations per login of n logins, after one uncounted that (re)reads the configuration */
+static bool count(const char* what, const char* url, int ttl, int n)
+{
+    int i, accepted = 0;
+    if (!write_config(url, ttl)) {
+        perror(MAP_CONFIG_FILE);
+        return false;
+    }
+    usleep((MAP_POLL_INTERVAL + 100) * 1000);
+    if (!login()) {
+        fprintf(stderr, "%s: login failed\n", what);
+        return false;
+    }
+    allocations = 0;
+    counting = true;
+    for (i = 0; i < n; i++)
+        accepted += login();
+    counting = false;
+    printf("%-24s %d/%d accepted, %.2f allocations per login\n", what, accepted, n,
+           (double)allocations / n);
+    return accepted == n && allocations == 0;
+}
+
+int main(int argc, char** argv)
+{
+    int logins = argc > 1 ? atoi(argv[1]) : 100;
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addrlen = sizeof addr;
+    struct iam iam;
+    pthread_t thread;
+    char url[64];
+    bool ok;
+
+    if (logins <= 0)
+        return 1;
+    /* neither /etc/pam_nss.idx nor the shared copy in /dev/shm is this configuration's */
+    map_use_index = false;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    iam.fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (iam.fd < 0 || bind(iam.fd, (struct sockaddr*)&addr, sizeof addr) < 0
+        || listen(iam.fd, 16) < 0 || getsockname(iam.fd, (struct sockaddr*)&addr, &addrlen) < 0
+        || !(iam.response = make_response(&iam.len))
+        || pthread_create(&thread, NULL, iam_thread, &iam)) {
+        perror("loopback IAM");
+        return 1;
+    }
+    snprintf(url, sizeof url, "http://127.0.0.1:%d/userinfo", ntohs(addr.sin_port));
+
+    ok = count("userinfo request", url, 0, logins);
+    if (cache_dir())
+        ok = count("token cache hit", url, 60, logins) && ok;
+    else
+        printf("%-24s skipped, %s is not usable\n", "token cache hit", dbdir);
+    unlink(MAP_CONFIG_FILE);
+    return ok ? 0 : 1;
+}
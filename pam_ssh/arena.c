@@ -0,0 +1,122 @@
+/*******************************************************************************
+ * file:        arena.c
+ * description: bump allocator for the data of one authentication
+ * notes:       blocks are only ever appended to; a block that cannot take
+ *              an allocation is left with its tail unused
+*******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "arena.h"
+
+/* what any type needs, as malloc() */
+union arena_max_align {
+    long double ld;
+    long long ll;
+    void* p;
+    void (*f)(void);
+};
+
+#define ARENA_ALIGNMENT __alignof__(union arena_max_align)
+#define ARENA_ALIGN(n) (((n) + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1))
+
+struct arena_block {
+    struct arena_block* prev;
+    size_t size, used;
+    bool borrowed;      /* memory of the caller, see arena_init() */
+    char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+void arena_init(struct arena* a, void* buf, size_t size)
+{
+    size_t skip = ARENA_ALIGN((uintptr_t)buf) - (uintptr_t)buf;
+    struct arena_block* b = (struct arena_block*)((char*)buf + skip);
+
+    a->block = NULL;
+    if (!buf || size < skip + sizeof *b + ARENA_ALIGNMENT)
+        return;
+    b->prev = NULL;
+    b->size = (size - skip - sizeof *b) & ~(ARENA_ALIGNMENT - 1);
+    b->used = 0;
+    b->borrowed = true;
+    a->block = b;
+}
+
+void* arena_alloc(struct arena* a, size_t size)
+{
+    struct arena_block* b = a->block;
+    /* the address is aligned, whatever the offset of data */
+    size_t start = b ? (size_t)(ARENA_ALIGN((uintptr_t)(b->data + b->used)) - (uintptr_t)b->data) : 0;
+
+    if (!b || start > b->size || size > b->size - start) {
+        size_t bsize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        if (bsize > SIZE_MAX - sizeof *b - ARENA_ALIGNMENT)
+            return NULL;
+        b = malloc(sizeof *b + ARENA_ALIGN(bsize));
+        if (!b)
+            return NULL;
+        b->prev = a->block;
+        b->size = ARENA_ALIGN(bsize);
+        b->borrowed = false;
+        a->block = b;
+        start = 0;
+    }
+    b->used = start + size;
+    return b->data + start;
+}
+
+char* arena_strdup(struct arena* a, const char* s)
+{
+    size_t len = strlen(s) + 1;
+    char* copy = arena_alloc(a, len);
+    if (copy)
+        memcpy(copy, s, len);
+    return copy;
+}
+
+char* arena_strndup(struct arena* a, const char* s, size_t len)
+{
+    char* copy = len < SIZE_MAX ? arena_alloc(a, len + 1) : NULL;
+    if (copy) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+void* arena_extend(struct arena* a, void* p, size_t size, size_t more)
+{
+    struct arena_block* b = a->block;
+    void* q;
+
+    if (more > SIZE_MAX - size)
+        return NULL;
+    if (p && b && (char*)p + size == b->data + b->used && more <= b->size - b->used) {
+        b->used += more;
+        return p;
+    }
+    q = arena_alloc(a, size + more);
+    if (q && size)
+        memcpy(q, p, size);
+    return q;
+}
+
+void arena_trim(struct arena* a, void* p, size_t size)
+{
+    struct arena_block* b = a->block;
+    if (b && (char*)p >= b->data && (char*)p + size <= b->data + b->used)
+        b->used = (size_t)((char*)p - b->data) + size;
+}
+
+void arena_free(struct arena* a)
+{
+    struct arena_block* b = a->block;
+    while (b) {
+        struct arena_block* prev = b->prev;
+        if (!b->borrowed)
+            free(b);
+        b = prev;
+    }
+    a->block = NULL;
+}
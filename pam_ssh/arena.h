@@ -0,0 +1,37 @@
+#ifndef PAM_SSH_ARENA_H
+#define PAM_SSH_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for what one authentication reads (userinfo claims,
+ * group lists): allocations are never freed one by one, arena_free()
+ * drops them all.  Blocks are ARENA_BLOCK bytes unless an allocation
+ * needs more; started on a buffer of the caller, an arena does not
+ * allocate at all as long as that buffer is large enough.
+ */
+
+#define ARENA_BLOCK 4096
+
+struct arena_block;
+
+struct arena {
+    struct arena_block* block;  /* the one allocated from, chained to the earlier ones */
+};
+
+#define ARENA_INIT { NULL }
+
+/* the first size bytes of buf become the first block of a */
+extern void arena_init(struct arena* a, void* buf, size_t size);
+extern void* arena_alloc(struct arena* a, size_t size);
+extern char* arena_strdup(struct arena* a, const char* s);
+/* the first len chars of s, NUL terminated */
+extern char* arena_strndup(struct arena* a, const char* s, size_t len);
+/* p, size bytes from the arena, made size + more bytes long; moved unless it is the last allocation */
+extern void* arena_extend(struct arena* a, void* p, size_t size, size_t more);
+/* the last allocation p cut to size bytes */
+extern void arena_trim(struct arena* a, void* p, size_t size);
+/* everything allocated from a, which is empty afterwards */
+extern void arena_free(struct arena* a);
+
+#endif
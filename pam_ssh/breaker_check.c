@@ -0,0 +1,164 @@
+/*******************************************************************************
+ * file:        breaker_check.c
+ * description: checks how the circuit breaker of http.c treats an endpoint
+ *              which was fast and then either slows down or is blackholed
+ * notes:       make breakercheck; takes about ten seconds
+ *              Both IAMs are loopback HTTP servers in a thread.  A slow
+ *              one keeps being asked with longer deadlines, a blackholed
+ *              one (its accept queue full, so connections never complete)
+ *              fails fast after HTTP_BREAKER_FAILURES attempts.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "http.h"
+
+#define HEALTHY 20      /* fast answers building up the latency estimate */
+#define SLOW 2500       /* ms the slow IAM takes afterwards, over the cut deadline */
+#define TOKEN "breaker-check-token"
+#define RESPONSE "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n" \
+    "Content-Length: 2\r\nConnection: close\r\n\r\n{}"
+
+struct iam {
+    int fd;
+    int delay;      /* ms of the answers after HEALTHY ones, -1: stop accepting */
+    char url[64];
+    pthread_t thread;
+};
+
+static void* iam_thread(void* arg)
+{
+    struct iam* iam = arg;
+    char request[8192];
+    size_t got;
+    ssize_t n;
+    int fd, i;
+
+    for (i = 0; iam->delay >= 0 || i < HEALTHY; i++) {
+        if ((fd = accept(iam->fd, NULL, NULL)) < 0)
+            break;
+        for (got = 0; got < sizeof request - 1; got += n) {
+            n = read(fd, request + got, sizeof request - 1 - got);
+            if (n <= 0)
+                break;
+            request[got + n] = '\0';
+            if (strstr(request, "\r\n\r\n"))
+                break;
+        }
+        if (i >= HEALTHY)
+            usleep(iam->delay * 1000);
+        /* the client may have given up already */
+        send(fd, RESPONSE, sizeof RESPONSE - 1, MSG_NOSIGNAL);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* a listening IAM; a blackholed one has an accept queue of one connection */
+static bool iam_start(struct iam* iam, int delay)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    socklen_t addrlen = sizeof addr;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    iam->delay = delay;
+    iam->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (iam->fd < 0 || bind(iam->fd, (struct sockaddr*)&addr, sizeof addr) < 0
+        || listen(iam->fd, delay < 0 ? 0 : 16) < 0 || getsockname(iam->fd, (struct sockaddr*)&addr, &addrlen) < 0
+        || pthread_create(&iam->thread, NULL, iam_thread, iam)) {
+        perror("loopback IAM");
+        return false;
+    }
+    snprintf(iam->url, sizeof iam->url, "http://127.0.0.1:%d/userinfo", ntohs(addr.sin_port));
+    return true;
+}
+
+/* fill the accept queue of an IAM no longer accepting: SYNs are dropped from now on */
+static void iam_blackhole(struct iam* iam)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof addr;
+    int i, fd;
+
+    pthread_join(iam->thread, NULL);
+    getsockname(iam->fd, (struct sockaddr*)&addr, &addrlen);
+    for (i = 0; i < 4; i++) {
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd >= 0)
+            connect(fd, (struct sockaddr*)&addr, sizeof addr);
+    }
+    usleep(100 * 1000);
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* one request to iam, its HTTP code; *ms: how long it took */
+static long ask(struct iam* iam, long long* ms)
+{
+    struct http_buffer response = { NULL, 0, 0, 0 };
+    char* urls[1] = { iam->url };
+    char error[CURL_ERROR_SIZE] = "";
+    long long start = now_ms();
+    long http_code = http_auth(TOKEN, urls, 1, 0, &response, error);
+    *ms = now_ms() - start;
+    http_buffer_free(&response);
+    return http_code;
+}
+
+/* HEALTHY fast answers, then what follows; true if it went as expected */
+static bool check(const char* what, struct iam* iam, bool opens)
+{
+    long long ms;
+    long http_code;
+    int i;
+
+    for (i = 0; i < HEALTHY; i++)
+        if ((http_code = ask(iam, &ms)) != 200) {
+            fprintf(stderr, "%s: healthy request %d failed: %ld\n", what, i, http_code);
+            return false;
+        }
+    if (iam->delay < 0)
+        iam_blackhole(iam);
+    for (i = 0; i < HTTP_BREAKER_FAILURES; i++) {
+        http_code = ask(iam, &ms);
+        printf("%-12s attempt %d: %ld after %lld ms\n", what, i + 1, http_code, ms);
+        if (http_code == 503) {
+            fprintf(stderr, "%s: circuit open after %d attempts\n", what, i);
+            return false;
+        }
+    }
+    http_code = ask(iam, &ms);
+    printf("%-12s attempt %d: %ld after %lld ms\n", what, i + 1, http_code, ms);
+    if (opens != (http_code == 503)) {
+        fprintf(stderr, "%s: circuit %s after %d attempts\n", what,
+                opens ? "still closed" : "open", i);
+        return false;
+    }
+    return true;
+}
+
+int main(void)
+{
+    struct iam slow, blackholed;
+    bool ok;
+
+    if (!iam_start(&slow, SLOW) || !iam_start(&blackholed, -1))
+        return 1;
+    ok = check("slow", &slow, false);
+    ok = check("blackholed", &blackholed, true) && ok;
+    printf("%s\n", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+/*******************************************************************************
+ * file:        broker.c
+ * description: client side of the pam_ssh_broker protocol (see broker.h)
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "broker.h"
+#include "http.h"
+#include "../common/common.h"
+
+/* read exactly len bytes, returns len or -1 */
+ssize_t broker_read_full(int fd, void* buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*)buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return done;
+}
+
+/* write exactly len bytes, returns len or -1 */
+ssize_t broker_write_full(int fd, const void* buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = send(fd, (const char*)buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * True if a broker seems to listen on socket_path; only its socket is
+ * looked at, broker_auth() still falls back if it does not answer
+ */
+bool broker_present(const char* socket_path)
+{
+    struct stat st;
+    return socket_path && *socket_path && stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+/*
+ * Validate token through the broker
+ * socket_path: broker unix socket
+ * section: mapping section whose url is used
+ * token: access token
+ * response: output response, reused; fed instead if it has a feed
+ * Returns the HTTP code of the IAM call, or -1 when the broker is not
+ * available or could not ask the IAM (e.g. it does not know the section
+ * yet) and the caller should fall back to http_auth(); the feed may have
+ * seen part of a body then.
+ */
+long broker_auth(const char* socket_path, const char* section, const char* token,
+                 struct http_buffer* response)
+{
+    struct sockaddr_un addr;
+    struct timeval tv = { BROKER_TIMEOUT, 0 };
+    struct broker_request req;
+    struct broker_reply rep;
+    int fd;
+
+    if (!socket_path || !*socket_path || !section || !token)
+        return -1;
+    if (strlen(socket_path) >= sizeof addr.sun_path)
+        return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", socket_path);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+        if (map_debug > 1)
+            sys_log(LOG_DEBUG, "broker not available at %s: %m", socket_path);
+        close(fd);
+        return -1;
+    }
+
+    req.magic = BROKER_MAGIC;
+    req.section_len = strlen(section);
+    req.token_len = strlen(token);
+    if (broker_write_full(fd, &req, sizeof req) < 0
+        || broker_write_full(fd, section, req.section_len) < 0
+        || broker_write_full(fd, token, req.token_len) < 0
+        || broker_read_full(fd, &rep, sizeof rep) < 0
+        || rep.magic != BROKER_MAGIC || rep.body_len > BROKER_MAX_BODY) {
+        sys_log(LOG_ERR, "broker request on %s failed", socket_path);
+        close(fd);
+        return -1;
+    }
+    response->len = 0;
+    response->fed = response->stopped = false;
+    if (response->feed) {
+        /* handed over as it is read, like the body of http_auth() */
+        char chunk[HTTP_BUFFER_SIZE];
+        response->fed = true;
+        while (response->len < rep.body_len && !response->stopped) {
+            size_t n = rep.body_len - response->len < sizeof chunk
+                ? rep.body_len - response->len : sizeof chunk;
+            if (broker_read_full(fd, chunk, n) < 0) {
+                close(fd);
+                return -1;
+            }
+            response->len += n;
+            response->stopped = !response->feed(response->feed_arg, chunk, n);
+        }
+    } else if (!http_buffer_reserve(response, rep.body_len)
+               || broker_read_full(fd, response->data, rep.body_len) < 0) {
+        if (response->data)
+            response->data[0] = '\0';
+        close(fd);
+        return -1;
+    } else {
+        response->len = rep.body_len;
+        response->data[rep.body_len] = '\0';
+    }
+    close(fd);
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "broker reply: %d", rep.http_code);
+    return rep.http_code ? rep.http_code : -1;
+}
@@ -0,0 +1,43 @@
+#ifndef PAM_SSH_BROKER_H
+#define PAM_SSH_BROKER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Wire format between pam_ssh.so and the pam_ssh_broker daemon.
+ * The module sends a request header followed by the mapping section name
+ * and the token; the broker answers with a reply header followed by the
+ * userinfo body.  The broker looks the URL up in its own copy of
+ * pam_nss.conf, so a client can only reach the configured IAM endpoints.
+ */
+
+#define BROKER_SOCKET "/run/mapiamuser/broker.sock"
+#define BROKER_MAGIC 0x31425350    /* "PSB1" */
+#define BROKER_TIMEOUT 30          /* seconds to wait for the broker */
+#define BROKER_MAX_SECTION 256
+#define BROKER_MAX_TOKEN 65536
+#define BROKER_MAX_BODY (1024 * 1024)
+
+struct http_buffer;
+
+struct broker_request {
+    uint32_t magic;
+    uint32_t section_len;
+    uint32_t token_len;
+};
+
+struct broker_reply {
+    uint32_t magic;
+    int32_t http_code;      /* 0: the broker could not ask the IAM */
+    uint32_t body_len;
+};
+
+extern ssize_t broker_read_full(int fd, void* buf, size_t len);
+extern ssize_t broker_write_full(int fd, const void* buf, size_t len);
+extern bool broker_present(const char* socket_path);
+extern long broker_auth(const char* socket_path, const char* section, const char* token,
+                        struct http_buffer* response);
+
+#endif
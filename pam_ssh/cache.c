@@ -0,0 +1,400 @@
+/*******************************************************************************
+ * file:        cache.c
+ * description: token validation cache shared by all sshd children
+ * notes:       one file per token in dbdir, named after SHA-256(section, token);
+ *              concurrent validations of one token are coalesced through
+ *              a locked "flight" file of the same name
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <utime.h>
+#include <syslog.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+#include "cache.h"
+#include "userinfo.h"
+#include "jwt.h"
+#include "pam_ssh_common.h"
+#include "../common/common.h"
+
+#define CACHE_MAGIC 0x32435450    /* "PTC2" */
+#define CACHE_CLAIMS_MAX (1 << 20)  /* bytes of claims in an entry */
+#define CACHE_PREFIX "token-"
+#define CACHE_TMP ".tmp-XXXXXX"
+#define CACHE_PRUNE_STAMP ".pruned"
+#define FLIGHT_PREFIX "flight-"
+#define FLIGHT_REJECTED_MAGIC 0x31525450  /* "PTR1", outcome of a rejected token */
+#define FLIGHT_POLL 10000           /* us between two looks at the leader's lock */
+
+/* a file holds the entry, then the NUL terminated string claims in the
+ * order of cache_claims and the groups */
+struct cache_entry {
+    uint32_t magic;
+    uint32_t size;      /* bytes of claims after the entry */
+    int64_t created;
+    int64_t expires;    /* token exp claim, 0 if unknown */
+    int32_t updated_at;
+    int32_t groupscount;
+    int32_t email_verified;
+    int32_t pad;
+};
+
+static const size_t cache_claims[] = {
+    offsetof(struct userinfo, sub),
+    offsetof(struct userinfo, name),
+    offsetof(struct userinfo, preferred_username),
+    offsetof(struct userinfo, given_name),
+    offsetof(struct userinfo, family_name),
+    offsetof(struct userinfo, picture),
+    offsetof(struct userinfo, email),
+    offsetof(struct userinfo, organisation_name),
+};
+
+#define NCACHE_CLAIMS (int)(sizeof cache_claims / sizeof cache_claims[0])
+#define CACHE_CLAIM(ui, i) (*(const char**)((char*)(ui) + cache_claims[i]))
+
+/*
+ * Cache file path for a section/token pair
+ */
+static bool cache_path(const char* prefix, const char* section, const char* token, char* path, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdlen = 0, i;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    char name[2 * EVP_MAX_MD_SIZE + 1];
+    bool ok;
+
+    if (!ctx)
+        return false;
+    ok = EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)
+        && EVP_DigestUpdate(ctx, section, strlen(section) + 1)
+        && EVP_DigestUpdate(ctx, token, strlen(token))
+        && EVP_DigestFinal_ex(ctx, md, &mdlen);
+    EVP_MD_CTX_free(ctx);
+    if (!ok)
+        return false;
+    for (i = 0; i < mdlen; i++) {
+        name[2 * i] = hex[md[i] >> 4];
+        name[2 * i + 1] = hex[md[i] & 0xf];
+    }
+    name[2 * mdlen] = '\0';
+    return snprintf(path, len, "%s%s%s", dbdir, prefix, name) < (int)len;
+}
+
+/*
+ * Create dbdir if needed and check nobody else can write into it
+ */
+bool cache_dir(void)
+{
+    struct stat st;
+    if (mkdir(dbdir, 0700) < 0 && errno != EEXIST)
+        return false;
+    if (lstat(dbdir, &st) < 0 || !S_ISDIR(st.st_mode)
+        || st.st_uid != geteuid() || (st.st_mode & 022)) {
+        sys_log(LOG_ERR, "%s: unsafe ownership or mode, token cache disabled", dbdir);
+        return false;
+    }
+    return true;
+}
+
+static bool cache_entry_valid(const struct cache_entry* e, time_t now, int ttl)
+{
+    return e->magic == CACHE_MAGIC && e->size <= CACHE_CLAIMS_MAX
+        && e->created + ttl > now
+        && (!e->expires || e->expires > now);
+}
+
+/*
+ * Remove expired entries, at most once per cache_ttl
+ */
+static void cache_prune(time_t now, int ttl)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    struct dirent* de;
+    DIR* dir;
+
+    snprintf(path, sizeof path, "%s%s", dbdir, CACHE_PRUNE_STAMP);
+    if (stat(path, &st) == 0 && st.st_mtime + ttl > now)
+        return;
+    close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600));
+    utime(path, NULL);
+
+    dir = opendir(dbdir);
+    if (!dir)
+        return;
+    while ((de = readdir(dir))) {
+        struct cache_entry e;
+        int fd;
+        if (strncmp(de->d_name, CACHE_PREFIX, strlen(CACHE_PREFIX)))
+            continue;
+        fd = openat(dirfd(dir), de->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (read(fd, &e, sizeof e) != sizeof e || !cache_entry_valid(&e, now, ttl))
+            unlinkat(dirfd(dir), de->d_name, 0);
+        close(fd);
+    }
+    closedir(dir);
+}
+
+/* next NUL terminated string of the claims, NULL past their end */
+static const char* cache_claim_next(const char** cp, const char* end)
+{
+    const char* s = *cp;
+    const char* nul = s < end ? memchr(s, '\0', end - s) : NULL;
+    if (!nul)
+        return NULL;
+    *cp = nul + 1;
+    return s;
+}
+
+/* userinfo of the entry read from fd, its claims read into the arena of ui;
+ * false if the entry is damaged */
+static bool cache_entry_userinfo(const struct cache_entry* e, int fd, struct userinfo* ui)
+{
+    const char *cp, *end;
+    const char** groups = NULL;
+    char* claims;
+    int i;
+
+    if (e->size > CACHE_CLAIMS_MAX || e->groupscount < 0 || (uint32_t)e->groupscount > e->size)
+        return false;
+    claims = arena_alloc(ui->arena, e->size);
+    if (!claims || pread(fd, claims, e->size, sizeof *e) != (ssize_t)e->size)
+        return false;
+    if (e->groupscount && !(groups = arena_alloc(ui->arena, e->groupscount * sizeof *groups)))
+        return false;
+    cp = claims;
+    end = claims + e->size;
+    userinfo_init(ui, ui->arena);
+    for (i = 0; i < NCACHE_CLAIMS; i++)
+        if (!(CACHE_CLAIM(ui, i) = cache_claim_next(&cp, end)))
+            goto damaged;
+    for (i = 0; i < e->groupscount; i++)
+        if (!(groups[i] = cache_claim_next(&cp, end)))
+            goto damaged;
+    ui->groups = groups;
+    ui->groupscount = e->groupscount;
+    ui->updated_at = e->updated_at;
+    ui->email_verified = e->email_verified != 0;
+    return true;
+  damaged:
+    userinfo_init(ui, ui->arena);
+    return false;
+}
+
+/*
+ * Look a token up; on a hit ui holds the userinfo of its last validation
+ */
+bool token_cache_get(const char* section, const char* token, struct userinfo* ui, int ttl)
+{
+    char path[PATH_MAX];
+    struct cache_entry e;
+    struct stat st;
+    time_t now = time(NULL);
+    int fd;
+    bool ok;
+
+    if (ttl <= 0 || !section || !token)
+        return false;
+    if (!cache_path(CACHE_PREFIX, section, token, path, sizeof path))
+        return false;
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ok = fstat(fd, &st) == 0 && st.st_uid == geteuid() && !(st.st_mode & 077)
+        && read(fd, &e, sizeof e) == sizeof e;
+    if (ok && !cache_entry_valid(&e, now, ttl)) {
+        close(fd);
+        unlink(path);
+        return false;
+    }
+    ok = ok && cache_entry_userinfo(&e, fd, ui);
+    close(fd);
+    if (!ok)
+        return false;
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "token cache hit for section %s", section);
+    return true;
+}
+
+/* entry followed by its claims as stored, in arena; NULL if too large */
+static struct cache_entry* cache_entry_make(struct arena* arena, uint32_t magic, const char* token,
+                                            const struct userinfo* ui, time_t now)
+{
+    struct cache_entry* e;
+    size_t size = 0, n;
+    char* cp;
+    int i;
+
+    for (i = 0; ui && i < NCACHE_CLAIMS; i++)
+        size += strlen(CACHE_CLAIM(ui, i)) + 1;
+    for (i = 0; ui && i < ui->groupscount; i++)
+        size += strlen(ui->groups[i]) + 1;
+    if (size > CACHE_CLAIMS_MAX || !(e = arena_alloc(arena, sizeof *e + size)))
+        return NULL;
+    memset(e, 0, sizeof *e);
+    e->magic = magic;
+    e->size = (uint32_t)size;
+    e->created = now;
+    e->expires = jwt_expiry(token);
+    if (ui) {
+        e->updated_at = ui->updated_at;
+        e->groupscount = ui->groupscount;
+        e->email_verified = ui->email_verified;
+    }
+    cp = (char*)(e + 1);
+    for (i = 0; ui && i < NCACHE_CLAIMS; i++) {
+        n = strlen(CACHE_CLAIM(ui, i)) + 1;
+        memcpy(cp, CACHE_CLAIM(ui, i), n);
+        cp += n;
+    }
+    for (i = 0; ui && i < ui->groupscount; i++) {
+        n = strlen(ui->groups[i]) + 1;
+        memcpy(cp, ui->groups[i], n);
+        cp += n;
+    }
+    return e;
+}
+
+/*
+ * Store the userinfo of a successfully validated token
+ */
+void token_cache_put(const char* section, const char* token, const struct userinfo* ui, int ttl)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct cache_entry* e;
+    size_t len;
+    time_t now = time(NULL);
+    int fd;
+    bool ok;
+
+    if (ttl <= 0 || !section || !token || !ui)
+        return;
+    if (!(e = cache_entry_make(ui->arena, CACHE_MAGIC, token, ui, now)))
+        return;
+    len = sizeof *e + e->size;
+    if ((e->expires && e->expires <= now)
+        || !cache_dir() || !cache_path(CACHE_PREFIX, section, token, path, sizeof path))
+        return;
+
+    snprintf(tmp, sizeof tmp, "%s%s", dbdir, CACHE_TMP);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+    ok = write(fd, e, len) == (ssize_t)len;
+    if (close(fd) < 0)
+        ok = false;
+    if (!ok || rename(tmp, path) < 0) {
+        sys_log(LOG_ERR, "token cache: cannot store %s: %m", path);
+        unlink(tmp);
+        return;
+    }
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "token cached for section %s", section);
+    cache_prune(now, ttl);
+}
+
+/*
+ * Coalesce concurrent validations of a token (e.g. parallel-ssh opening
+ * many sessions at once).  The first process locks the flight file of
+ * the token and asks the IAM; the others wait for the lock and take the
+ * outcome the leader wrote into the file.  The leader removes the file
+ * before unlocking it, so later logins do not see a stale outcome.  When
+ * the leader dies or cannot decide, the next waiting process leads.
+ * Returns FLIGHT_LEAD with *flight set (-1 if coalescing is not
+ * possible): validate and call token_flight_done().  Otherwise the
+ * outcome of the leader, with ui filled for FLIGHT_VALID.
+ */
+int token_flight_join(const char* section, const char* token, struct userinfo* ui, int* flight)
+{
+    char path[PATH_MAX];
+    struct cache_entry e;
+    struct stat st;
+    time_t now, deadline = time(NULL) + FLIGHT_WAIT;
+    int fd, err = 0, outcome = FLIGHT_LEAD;
+    bool locked;
+
+    *flight = -1;
+    if (!section || !token || !cache_dir()
+        || !cache_path(FLIGHT_PREFIX, section, token, path, sizeof path))
+        return FLIGHT_LEAD;
+    fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return FLIGHT_LEAD;
+    if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & 077)) {
+        close(fd);
+        return FLIGHT_LEAD;
+    }
+    locked = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    if (!locked && map_debug > 1)
+        sys_log(LOG_DEBUG, "token of section %s is being validated, waiting", section);
+    while (!locked && ((err = errno) == EWOULDBLOCK || err == EINTR) && time(NULL) < deadline) {
+        usleep(FLIGHT_POLL);
+        locked = flock(fd, LOCK_EX | LOCK_NB) == 0;
+    }
+    if (!locked) {
+        close(fd);
+        return FLIGHT_LEAD;
+    }
+    now = time(NULL);
+    if (pread(fd, &e, sizeof e, 0) == sizeof e
+        && e.created + FLIGHT_WAIT > now && (!e.expires || e.expires > now)) {
+        if (e.magic == CACHE_MAGIC && cache_entry_userinfo(&e, fd, ui))
+            outcome = FLIGHT_VALID;
+        else if (e.magic == FLIGHT_REJECTED_MAGIC)
+            outcome = FLIGHT_REJECTED;
+    }
+    if (outcome != FLIGHT_LEAD) {
+        if (map_debug > 1)
+            sys_log(LOG_DEBUG, "token of section %s %s meanwhile", section,
+                    outcome == FLIGHT_VALID ? "validated" : "rejected");
+        close(fd);
+        return outcome;
+    }
+    /* nobody decided: validate, processes still waiting on this file get our outcome */
+    if (ftruncate(fd, 0) < 0) {
+        close(fd);
+        return FLIGHT_LEAD;
+    }
+    *flight = fd;
+    return FLIGHT_LEAD;
+}
+
+/*
+ * Hand the outcome of a validation to the processes waiting for it:
+ * FLIGHT_VALID with ui, FLIGHT_REJECTED when the IAM refused the token,
+ * FLIGHT_LEAD if undecided (they validate on their own then); the entry
+ * is made in the arena of ui either way
+ */
+void token_flight_done(int flight, const char* section, const char* token, int outcome,
+                       const struct userinfo* ui)
+{
+    char path[PATH_MAX];
+    struct cache_entry* e;
+    if (flight < 0)
+        return;
+    if (outcome != FLIGHT_LEAD && ui) {
+        e = cache_entry_make(ui->arena, outcome == FLIGHT_VALID ? CACHE_MAGIC : FLIGHT_REJECTED_MAGIC,
+                             token, outcome == FLIGHT_VALID ? ui : NULL, time(NULL));
+        if (!e || pwrite(flight, e, sizeof *e + e->size, 0) != (ssize_t)(sizeof *e + e->size))
+            ftruncate(flight, 0);
+    }
+    if (cache_path(FLIGHT_PREFIX, section, token, path, sizeof path))
+        unlink(path);
+    close(flight);
+}
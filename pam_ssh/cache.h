@@ -0,0 +1,29 @@
+#ifndef PAM_SSH_CACHE_H
+#define PAM_SSH_CACHE_H
+
+#include <stdbool.h>
+#include "pam_ssh_common.h"
+
+/*
+ * Cache of successful token validations, shared by all sshd children
+ * through files in dbdir (/run/mapiamuser/).  Entries are keyed by a
+ * SHA-256 of the mapping section and the token, and never outlive
+ * cache_ttl nor the token's own expiry.
+ */
+
+extern bool cache_dir(void);
+/* ttl is the cache_ttl of the configuration in use, <= 0 disables the cache */
+extern bool token_cache_get(const char* section, const char* token, struct userinfo* ui, int ttl);
+extern void token_cache_put(const char* section, const char* token, const struct userinfo* ui, int ttl);
+
+/* outcomes of token_flight_join(), see cache.c */
+#define FLIGHT_LEAD 0       /* validate the token, then token_flight_done() */
+#define FLIGHT_VALID 1      /* another process validated it, ui is filled */
+#define FLIGHT_REJECTED 2   /* ... the IAM refused it */
+#define FLIGHT_WAIT 15      /* max seconds to wait for another process */
+
+extern int token_flight_join(const char* section, const char* token, struct userinfo* ui, int* flight);
+extern void token_flight_done(int flight, const char* section, const char* token, int outcome,
+                              const struct userinfo* ui);
+
+#endif
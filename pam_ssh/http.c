@@ -0,0 +1,1215 @@
+/*******************************************************************************
+ * file:        http.c
+ * description: HTTP calls to the IAM userinfo endpoint
+ * notes:       split out of pam_ssh.c so pam_ssh_broker can reuse it
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <curl/curl.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include "http.h"
+#include "pam_ssh_common.h"
+#include "../common/common.h"
+
+/*
+* note: libcurl has to be compiled & build with --with-ssl version enabled!
+*/
+
+/*
+ * Process wide TLS state, set up once by http_init(): the parsed CA
+ * certificates and a share holding TLS sessions, DNS and connections, so
+ * a process authenticating more than once gets abbreviated handshakes.
+ */
+static pthread_once_t http_once = PTHREAD_ONCE_INIT;
+static X509_STORE* http_ca_store;   /* NULL if curl loads its own */
+#if CURL_AT_LEAST_VERSION(7, 77, 0)
+static struct curl_blob http_ca_blob;   /* bundle file contents, other TLS backends */
+#endif
+static CURLSH* http_share;
+static pthread_mutex_t http_share_locks[CURL_LOCK_DATA_LAST];
+
+static void http_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp)
+{
+    pthread_mutex_lock(&http_share_locks[data]);
+}
+
+static void http_share_unlock(CURL *handle, curl_lock_data data, void *userp)
+{
+    pthread_mutex_unlock(&http_share_locks[data]);
+}
+
+static CURLcode http_ssl_ctx(CURL* curl, void* sslctx, void* userp)
+{
+    (void)curl;
+    (void)userp;
+    SSL_CTX_set1_cert_store((SSL_CTX*)sslctx, http_ca_store);
+    return CURLE_OK;
+}
+
+#if CURL_AT_LEAST_VERSION(7, 77, 0)
+/* keep the CA bundle in memory for TLS backends without an X509_STORE */
+static void http_load_ca_blob(const char* cainfo)
+{
+    FILE* f;
+    long size;
+    if (!cainfo || !(f = fopen(cainfo, "re")))
+        return;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0
+        && size <= HTTP_MAX_DOCUMENT && fseek(f, 0, SEEK_SET) == 0
+        && (http_ca_blob.data = malloc(size))) {
+        if (fread(http_ca_blob.data, 1, size, f) == (size_t)size) {
+            http_ca_blob.len = size;
+            http_ca_blob.flags = CURL_BLOB_NOCOPY;
+        } else {
+            free(http_ca_blob.data);
+            http_ca_blob.data = NULL;
+        }
+    }
+    fclose(f);
+}
+#endif
+
+/* parse curl's CA bundle once; only the OpenSSL backend takes an X509_STORE */
+static void http_load_ca(void)
+{
+    const curl_version_info_data* info = curl_version_info(CURLVERSION_NOW);
+    const char *cainfo = NULL, *capath = NULL;
+    X509_STORE* store;
+    CURL* curl;
+    curl = curl_easy_init();
+    if (!curl)
+        return;
+#if CURL_AT_LEAST_VERSION(7, 84, 0)
+    curl_easy_getinfo(curl, CURLINFO_CAINFO, &cainfo);
+    curl_easy_getinfo(curl, CURLINFO_CAPATH, &capath);
+#endif
+    if (!info->ssl_version || strncmp(info->ssl_version, "OpenSSL/", 8)) {
+#if CURL_AT_LEAST_VERSION(7, 77, 0)
+        http_load_ca_blob(cainfo);
+#endif
+        curl_easy_cleanup(curl);
+        return;
+    }
+    store = X509_STORE_new();
+    if (store && ((cainfo || capath) ? X509_STORE_load_locations(store, cainfo, capath)
+                                     : X509_STORE_set_default_paths(store)) == 1)
+        http_ca_store = store;
+    else if (store)
+        X509_STORE_free(store);
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "CA store %s: %s", cainfo ? cainfo : "(default)",
+                http_ca_store ? "loaded" : "not loaded");
+    curl_easy_cleanup(curl);
+}
+
+/* path of a state file in dbdir, false unless nobody else can write there */
+static bool http_state_path(const char* name, char* path, size_t len)
+{
+    struct stat st;
+    if (mkdir(dbdir, 0700) < 0 && errno != EEXIST)
+        return false;
+    if (lstat(dbdir, &st) < 0 || !S_ISDIR(st.st_mode)
+        || st.st_uid != geteuid() || (st.st_mode & 022))
+        return false;
+    return snprintf(path, len, "%s%s", dbdir, name) < (int)len;
+}
+
+/*
+ * Health of the IAM endpoints, shared by all processes through an mmap'ed
+ * file in dbdir (a private table if that is not possible).  Fields are
+ * updated one at a time without a lock; a lost update only shifts a
+ * timeout or the opening of a circuit by one request.
+ */
+struct http_endpoint {
+    uint64_t key;           /* hash of the url, 0 for a free slot */
+    uint32_t failures;      /* consecutive failed requests */
+    uint32_t latency;       /* EWMA of successful requests, ms, 0 if unknown */
+    int64_t open_until;     /* circuit open: fail fast until then (seconds) */
+};
+
+static pthread_once_t http_endpoints_once = PTHREAD_ONCE_INIT;
+static struct http_endpoint* http_endpoints;
+static struct http_endpoint http_endpoints_private[HTTP_ENDPOINTS];
+
+static void http_endpoints_open(void)
+{
+    const size_t size = sizeof(struct http_endpoint) * HTTP_ENDPOINTS;
+    char path[PATH_MAX];
+    struct stat st;
+    void* p;
+    int fd;
+
+    http_endpoints = http_endpoints_private;
+    if (!http_state_path(HTTP_ENDPOINTS_FILE, path, sizeof path))
+        return;
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid()
+        && !(st.st_mode & 077) && (st.st_size == (off_t)size || ftruncate(fd, size) == 0)) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+            http_endpoints = (struct http_endpoint*)p;
+    }
+    close(fd);
+}
+
+/* slot of url, claimed if new; NULL if the table is full */
+static struct http_endpoint* http_endpoint(const char* url)
+{
+    uint64_t key = 14695981039346656037ULL, seen;
+    uint32_t i, n;
+    pthread_once(&http_endpoints_once, http_endpoints_open);
+    for (; *url; url++)
+        key = (key ^ (unsigned char)*url) * 1099511628211ULL;
+    key |= 1;
+    for (n = 0, i = key % HTTP_ENDPOINTS; n < HTTP_ENDPOINTS; n++, i = (i + 1) % HTTP_ENDPOINTS) {
+        seen = __atomic_load_n(&http_endpoints[i].key, __ATOMIC_ACQUIRE);
+        if (!seen && __atomic_compare_exchange_n(&http_endpoints[i].key, &seen, key, false,
+                                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return http_endpoints + i;
+        if (seen == key)
+            return http_endpoints + i;
+    }
+    return NULL;
+}
+
+/* true while requests to e fail fast */
+static bool http_circuit_open(const struct http_endpoint* e)
+{
+    return e && __atomic_load_n(&e->failures, __ATOMIC_RELAXED) >= HTTP_BREAKER_FAILURES
+        && time(NULL) < __atomic_load_n(&e->open_until, __ATOMIC_RELAXED);
+}
+
+/*
+ * May a request go to e?  After the cool-down one request is let through
+ * to probe the endpoint, the others keep failing fast until it answers.
+ */
+static bool http_circuit_allow(struct http_endpoint* e)
+{
+    int64_t until, now = time(NULL);
+    if (!e || __atomic_load_n(&e->failures, __ATOMIC_RELAXED) < HTTP_BREAKER_FAILURES)
+        return true;
+    until = __atomic_load_n(&e->open_until, __ATOMIC_RELAXED);
+    return now >= until
+        && __atomic_compare_exchange_n(&e->open_until, &until, now + HTTP_BREAKER_COOLDOWN,
+                                       false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * Deadline of a request to e: budget ms (the section's timeout), cut to
+ * a multiple of the usual latency so a sick endpoint is given up early.
+ * Returns true if it was cut, for http_endpoint_done().
+ */
+static bool http_deadline(CURL* curl, const struct http_endpoint* e, int budget)
+{
+    long timeout = budget > 0 ? budget : HTTP_TIMEOUT;
+    long latency = e ? __atomic_load_n(&e->latency, __ATOMIC_RELAXED) : 0;
+    bool cut = false;
+    if (latency && latency * HTTP_TIMEOUT_FACTOR < timeout) {
+        timeout = latency * HTTP_TIMEOUT_FACTOR > HTTP_TIMEOUT_MIN
+            ? latency * HTTP_TIMEOUT_FACTOR : HTTP_TIMEOUT_MIN;
+        cut = true;
+    }
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                     timeout < HTTP_CONNECT_TIMEOUT ? timeout : (long)HTTP_CONNECT_TIMEOUT);
+    return cut;
+}
+
+/* did a request get a connection, or even part of an answer? */
+static bool http_connected(CURL* curl)
+{
+    curl_off_t connect = 0, received = 0;
+    long header = 0;
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+    curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &header);
+    return connect > 0 || received > 0 || header > 0;
+}
+
+/*
+ * Did the IAM decide on the token: accept it (2xx) or refuse it (401,
+ * 403)?  Other codes, e.g. 404 from a replica with a wrong path, 429 or
+ * 5xx, are no answer.
+ */
+static bool http_decided(long http_code)
+{
+    return (http_code >= 200 && http_code < 300) || http_code == 401 || http_code == 403;
+}
+
+/*
+ * Account a finished request to e.  An IAM deciding on the token, even
+ * refusing it, is healthy; anything else is a failure.  A timeout
+ * of a deadline cut by http_deadline() on an open connection is not:
+ * the endpoint may just have become slower, so the time waited is taken
+ * as a latency sample and the next deadline is longer.  A host that
+ * cannot even be connected to (e.g. blackholed) fails as usual.
+ * cut: what http_deadline() returned for the request
+ */
+static void http_endpoint_done(struct http_endpoint* e, CURL* curl, CURLcode res, long http_code,
+                               bool cut)
+{
+    curl_off_t total = 0;
+    uint32_t latency, sample;
+    if (!e)
+        return;
+    if (res == CURLE_OPERATION_TIMEDOUT && !http_code && cut && http_connected(curl)) {
+        if (map_debug > 1)
+            sys_log(LOG_DEBUG, "IAM endpoint slower than usual, deadline raised");
+    } else if (!http_decided(http_code)) {
+        if (__atomic_add_fetch(&e->failures, 1, __ATOMIC_RELAXED) >= HTTP_BREAKER_FAILURES) {
+            __atomic_store_n(&e->open_until, (int64_t)time(NULL) + HTTP_BREAKER_COOLDOWN,
+                             __ATOMIC_RELAXED);
+            if (map_debug)
+                sys_log(LOG_NOTICE, "IAM endpoint failing, circuit open for %d s",
+                        HTTP_BREAKER_COOLDOWN);
+        }
+        return;
+    } else {
+        __atomic_store_n(&e->failures, 0, __ATOMIC_RELAXED);
+    }
+    if (curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total) != CURLE_OK || total <= 0)
+        return;
+    sample = total / 1000 ? total / 1000 : 1;
+    latency = __atomic_load_n(&e->latency, __ATOMIC_RELAXED);
+    latency = latency ? latency - latency / 8 + sample / 8 : sample;
+    __atomic_store_n(&e->latency, latency ? latency : 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Usable endpoints of urls, best first: known latency ascending, then
+ * the ones not measured yet in configuration order; open circuits are
+ * left out.  Returns how many indexes were stored in order.
+ */
+static int http_endpoint_rank(char* const* urls, int n, int* order, struct http_endpoint** endpoints)
+{
+    uint32_t latency[n];
+    int i, j, k = 0;
+    for (i = 0; i < n; i++) {
+        endpoints[i] = http_endpoint(urls[i]);
+        if (http_circuit_open(endpoints[i]))
+            continue;
+        latency[i] = endpoints[i] ? __atomic_load_n(&endpoints[i]->latency, __ATOMIC_RELAXED) : 0;
+        if (!latency[i])
+            latency[i] = UINT32_MAX;
+        for (j = k++; j > 0 && latency[order[j - 1]] > latency[i]; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    return k;
+}
+
+/* best of equivalent urls, urls[0] if all of them are failing */
+const char* http_endpoint_pick(char* const* urls, int n)
+{
+    int order[n > 0 ? n : 1];
+    struct http_endpoint* endpoints[n > 0 ? n : 1];
+    if (n <= 1)
+        return n ? urls[0] : NULL;
+    return http_endpoint_rank(urls, n, order, endpoints) ? urls[order[0]] : urls[0];
+}
+
+/*
+ * TLS sessions can be kept in dbdir, so the next sshd child resumes
+ * the session of the previous one (tls_sessions = true).  libcurl 8.12
+ * and later export and import them; the file holds resumption secrets,
+ * so it is only used when nobody else can read or replace it.
+ */
+#if CURL_AT_LEAST_VERSION(8, 12, 0)
+#define HTTP_SESSIONS "tls-sessions"
+#define HTTP_SESSIONS_MAGIC 0x31534c54  /* "TLS1" */
+#define HTTP_SESSIONS_MAX 32            /* records written */
+#define HTTP_SESSION_MAX (16 * 1024)    /* bytes of one record's data */
+
+struct http_session {
+    uint32_t magic;
+    uint32_t key_len;       /* 0 if only the salted hash is known */
+    uint32_t shmac_len;
+    uint32_t sdata_len;
+    int64_t valid_until;
+};
+
+struct http_export {
+    FILE* f;
+    int count;
+};
+
+static bool http_sessions_enabled(void)
+{
+    struct map_snapshot* snap = map_acquire();
+    bool on = snap && snap->settings.tls_sessions;
+    map_release(snap);
+    return on;
+}
+
+static void http_sessions_load(void)
+{
+    char path[PATH_MAX];
+    struct http_session rec;
+    struct stat st;
+    unsigned char *shmac = NULL, *sdata = NULL;
+    char* key = NULL;
+    int n = 0, fd;
+    FILE* f;
+    CURL* curl;
+
+    if (!http_sessions_enabled() || !http_state_path(HTTP_SESSIONS, path, sizeof path))
+        return;
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
+        return;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+        || st.st_uid != geteuid() || (st.st_mode & 077) || !(f = fdopen(fd, "r"))) {
+        close(fd);
+        return;
+    }
+    curl = curl_easy_init();
+    if (curl)
+        curl_easy_setopt(curl, CURLOPT_SHARE, http_share);
+    while (curl && fread(&rec, sizeof rec, 1, f) == 1 && rec.magic == HTTP_SESSIONS_MAGIC
+           && rec.key_len < PATH_MAX && rec.shmac_len <= HTTP_SESSION_MAX
+           && rec.sdata_len && rec.sdata_len <= HTTP_SESSION_MAX) {
+        key = malloc(rec.key_len + 1);
+        shmac = malloc(rec.shmac_len + 1);
+        sdata = malloc(rec.sdata_len);
+        if (!key || !shmac || !sdata
+            || fread(key, 1, rec.key_len, f) != rec.key_len
+            || fread(shmac, 1, rec.shmac_len, f) != rec.shmac_len
+            || fread(sdata, 1, rec.sdata_len, f) != rec.sdata_len)
+            break;
+        key[rec.key_len] = '\0';
+        if (rec.valid_until > time(NULL)
+            && curl_easy_ssls_import(curl, rec.key_len ? key : NULL, shmac, rec.shmac_len,
+                                     sdata, rec.sdata_len) == CURLE_OK)
+            n++;
+        free(key);
+        free(shmac);
+        free(sdata);
+        key = NULL;
+        shmac = sdata = NULL;
+    }
+    free(key);
+    free(shmac);
+    free(sdata);
+    fclose(f);
+    if (curl)
+        curl_easy_cleanup(curl);
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "%s: %d TLS sessions imported", path, n);
+}
+
+static CURLcode http_session_write(CURL* curl, void* userp, const char* session_key,
+                                   const unsigned char* shmac, size_t shmac_len,
+                                   const unsigned char* sdata, size_t sdata_len,
+                                   curl_off_t valid_until, int ietf_tls_id,
+                                   const char* alpn, size_t earlydata_max)
+{
+    struct http_export* exp = (struct http_export*)userp;
+    struct http_session rec;
+    (void)curl;
+    (void)ietf_tls_id;
+    (void)alpn;
+    (void)earlydata_max;
+    if (exp->count >= HTTP_SESSIONS_MAX || valid_until <= time(NULL)
+        || !sdata_len || sdata_len > HTTP_SESSION_MAX || shmac_len > HTTP_SESSION_MAX)
+        return CURLE_OK;
+    rec.magic = HTTP_SESSIONS_MAGIC;
+    rec.key_len = session_key ? strlen(session_key) : 0;
+    rec.shmac_len = shmac_len;
+    rec.sdata_len = sdata_len;
+    rec.valid_until = valid_until;
+    if (rec.key_len >= PATH_MAX)
+        return CURLE_OK;
+    if (fwrite(&rec, sizeof rec, 1, exp->f) != 1
+        || fwrite(session_key, 1, rec.key_len, exp->f) != rec.key_len
+        || fwrite(shmac, 1, shmac_len, exp->f) != shmac_len
+        || fwrite(sdata, 1, sdata_len, exp->f) != sdata_len)
+        return CURLE_WRITE_ERROR;
+    exp->count++;
+    return CURLE_OK;
+}
+
+/* replace the session file with the sessions curl holds now */
+static void http_sessions_save(CURL* curl)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    struct http_export exp = { NULL, 0 };
+    CURLcode res;
+    int fd;
+
+    if (!http_sessions_enabled() || !http_state_path(HTTP_SESSIONS, path, sizeof path)
+        || snprintf(tmp, sizeof tmp, "%s.%d", path, (int)getpid()) >= (int)sizeof tmp)
+        return;
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0)
+        return;
+    if (!(exp.f = fdopen(fd, "w"))) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    res = curl_easy_ssls_export(curl, http_session_write, &exp);
+    if (fclose(exp.f) == 0 && res == CURLE_OK && exp.count && rename(tmp, path) == 0) {
+        if (map_debug > 1)
+            sys_log(LOG_DEBUG, "%s: %d TLS sessions exported", path, exp.count);
+        return;
+    }
+    unlink(tmp);
+}
+#else
+static void http_sessions_load(void) {}
+static void http_sessions_save(CURL* curl) { (void)curl; }
+#endif
+
+/*
+ * Once per process: curl_global_init(), the CA bundle and the share.
+ * Connections are shared as well, which libcurl only supports for one
+ * thread at a time: a login finishes its prewarm (http_prewarm_finish())
+ * before any other request, JWKS downloads included, and its one-shot
+ * handles are used one after the other.
+ */
+static void http_init(void)
+{
+    int i;
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+        return;
+    http_load_ca();
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&http_share_locks[i], NULL);
+    http_share = curl_share_init();
+    if (!http_share)
+        return;
+    curl_share_setopt(http_share, CURLSHOPT_LOCKFUNC, http_share_lock);
+    curl_share_setopt(http_share, CURLSHOPT_UNLOCKFUNC, http_share_unlock);
+    curl_share_setopt(http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    http_sessions_load();
+}
+
+/* hand the process wide TLS state to a new handle */
+static void http_setup(CURL* curl)
+{
+    pthread_once(&http_once, http_init);
+    if (http_share)
+        curl_easy_setopt(curl, CURLOPT_SHARE, http_share);
+    if (http_ca_store) {
+        if (curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, http_ssl_ctx) == CURLE_OK) {
+            /* nothing left for curl to parse itself */
+            curl_easy_setopt(curl, CURLOPT_CAINFO, NULL);
+            curl_easy_setopt(curl, CURLOPT_CAPATH, NULL);
+        }
+    }
+#if CURL_AT_LEAST_VERSION(7, 77, 0)
+    else if (http_ca_blob.data)
+        curl_easy_setopt(curl, CURLOPT_CAINFO_BLOB, &http_ca_blob);
+#endif
+}
+
+/* resolve the host of url, priming the resolver libraries and caches */
+static void http_resolve(const struct mapurl* url)
+{
+    struct addrinfo hints, *res = NULL;
+    char port[8];
+    if (!url->host)
+        return;
+    snprintf(port, sizeof port, "%d", url->port);
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(url->host, url->port ? port : NULL, &hints, &res) == 0)
+        freeaddrinfo(res);
+    else if (map_debug)
+        sys_log(LOG_DEBUG, "cannot resolve %s", url->host);
+}
+
+/*
+ * Work every login would repeat, done once in a process which forks the
+ * logins afterwards: http_init() and a first resolution of the host of
+ * every endpoint, as parsed with the configuration.  Addresses are not
+ * pinned, later requests resolve again and follow DNS changes.
+ */
+void http_warmup(const struct map_snapshot* snap)
+{
+    int i, j;
+    pthread_once(&http_once, http_init);
+    for (i = 0; snap && snap->users && i < snap->users->size; i++)
+        for (j = 0; j < (snap->users->items + i)->nurls; j++)
+            http_resolve((snap->users->items + i)->parsed + j);
+}
+
+/* the Authorization header of token: AUTH_BEARER with only token appended */
+static const char* http_bearer(char* header, const char* token)
+{
+    memcpy(header, AUTH_BEARER, sizeof AUTH_BEARER - 1);
+    strcpy(header + sizeof AUTH_BEARER - 1, token);
+    return header;
+}
+
+/* cap of a userinfo response in the current configuration */
+static size_t http_response_max(void)
+{
+    struct map_snapshot* snap = map_acquire();
+    size_t max = snap && snap->settings.max_response > 0
+        ? (size_t)snap->settings.max_response : HTTP_MAX_RESPONSE;
+    map_release(snap);
+    return max;
+}
+
+/* grow b to hold len bytes and the terminating NUL */
+bool http_buffer_reserve(struct http_buffer* b, size_t len)
+{
+    size_t size = b->size ? b->size : HTTP_BUFFER_SIZE;
+    char* data;
+    if (len < b->size)
+        return true;
+    while (size <= len)
+        size *= 2;
+    data = (char*)realloc(b->data, size);
+    if (!data)
+        return false;
+    b->data = data;
+    b->size = size;
+    return true;
+}
+
+void http_buffer_free(struct http_buffer* b)
+{
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+/* the function to invoke as the data is received, in place of callback_func() */
+static size_t http_buffer_write(void *buffer, size_t size, size_t nmemb, void *userp)
+{
+    struct http_buffer* b = (struct http_buffer*)userp;
+    size_t len = size * nmemb;
+    /* too large: the transfer fails with CURLE_WRITE_ERROR */
+    if (len > b->max - b->len)
+        return 0;
+    /* what the feed reads is only counted */
+    if (!b->fed) {
+        if (!http_buffer_reserve(b, b->len + len))
+            return 0;
+        memcpy(b->data + b->len, buffer, len);
+        b->data[b->len + len] = '\0';
+    }
+    b->len += len;
+    if (b->fed && !b->feed(b->feed_arg, buffer, len)) {
+        b->stopped = true;
+        return 0;
+    }
+    return len;
+}
+
+/* have the body of the next transfer of curl replace the contents of b */
+static void http_buffer_attach(CURL* curl, struct http_buffer* b, size_t max)
+{
+    b->len = 0;
+    b->max = max;
+    b->fed = b->feed != NULL;
+    b->stopped = false;
+    if (b->fed ? b->data != NULL : http_buffer_reserve(b, 0))
+        b->data[0] = '\0';
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_buffer_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, b);
+    /* refused before any download when the server announces the length */
+    curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t)max);
+}
+
+/* exchange the bodies of two buffers, e.g. to hand over the winner of a race */
+static void http_buffer_swap(struct http_buffer* a, struct http_buffer* b)
+{
+    struct http_buffer t = *a;
+    a->data = b->data;
+    a->len = b->len;
+    a->size = b->size;
+    b->data = t.data;
+    b->len = t.len;
+    b->size = t.size;
+    /* the feed of a has not seen this body */
+    a->fed = a->stopped = false;
+}
+
+
+static
+int my_trace(CURL *handle, curl_infotype type,
+             char *data, size_t size,
+             void *userp) {
+    const char *text;
+    (void)handle; /* prevent compiler warning */
+    (void)userp;
+
+
+    switch (type) {
+        case CURLINFO_TEXT:
+            sys_log(LOG_DEBUG, "== Info: %s", data);
+        default: /* in case a new one is introduced to shock us */
+            return 0;
+
+        case CURLINFO_HEADER_OUT:
+            text = "=> Send header";
+            break;
+        case CURLINFO_DATA_OUT:
+            text = "=> Send data";
+            break;
+        case CURLINFO_SSL_DATA_OUT:
+            text = "=> Send SSL data";
+            break;
+        case CURLINFO_HEADER_IN:
+            text = "<= Recv header";
+            break;
+        case CURLINFO_DATA_IN:
+            text = "<= Recv data";
+            break;
+        case CURLINFO_SSL_DATA_IN:
+            text = "<= Recv SSL data";
+            break;
+    }
+  return 0;
+}
+
+
+/*
+ * Authenticate with user token to IAM using an existing curl handle.
+ * The handle is left usable for another request so that callers keeping
+ * a pool of handles (pam_ssh_broker) reuse its live connection.
+ * input: input token
+ * host_endpoint: where to authenticate
+ * timeout: ms budget of the section, 0 for HTTP_TIMEOUT
+ * response: output response, reused; a body over max_response fails with 502
+ * err: CURL_ERROR_SIZE bytes for the error if occures, or NULL
+ * Fails fast with 503 while the circuit of host_endpoint is open; 0 when
+ * no HTTP answer arrived at all.
+ */
+
+long http_auth_handle(CURL* curl, const char* input, const char* host_endpoint, int timeout,
+                      struct http_buffer* response, char* err){
+    struct http_endpoint* endpoint = http_endpoint(host_endpoint);
+    struct curl_slist *headers = NULL;
+    CURLcode res = CURLE_COULDNT_CONNECT;
+    char error[CURL_ERROR_SIZE];
+    long http_code = 0;
+    if (!curl)
+        return http_code;
+    char auth_bearer[sizeof AUTH_BEARER + strlen(input)];
+    headers = curl_slist_append(headers, http_bearer(auth_bearer, input));
+    curl_easy_setopt(curl, CURLOPT_URL, host_endpoint) ;
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L );
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, true);
+    curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, my_trace);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error);
+    http_buffer_attach(curl, response, http_response_max());
+    error[0] = 0;
+    if (http_circuit_allow(endpoint)) {
+        bool cut = http_deadline(curl, endpoint, timeout);
+        res = curl_easy_perform(curl);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        /* the feed has read what it needed */
+        if (res == CURLE_WRITE_ERROR && response->stopped)
+            res = CURLE_OK;
+        http_endpoint_done(endpoint, curl, res, http_code, cut);
+    } else {
+        snprintf(error, sizeof error, "%s is failing, not retried for up to %d s",
+                 host_endpoint, HTTP_BREAKER_COOLDOWN);
+        http_code = 503;
+    }
+    /* do not leave pointers to our stack/heap in a reusable handle */
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+    curl_slist_free_all(headers);
+    if (res == CURLE_WRITE_ERROR || res == CURLE_FILESIZE_EXCEEDED)
+        snprintf(error, sizeof error, "response larger than %zu bytes", response->max);
+    else if (res != CURLE_OK && !error[0])
+        snprintf(error, sizeof error, "%s", curl_easy_strerror(res));
+    /* a 2xx whose body did not arrive in full is no answer */
+    if (res != CURLE_OK && http_code >= 200 && http_code < 300)
+        http_code = 502;
+    if (res != CURLE_OK) {
+        response->len = 0;
+        if (response->data)
+            response->data[0] = '\0';
+    }
+    if (err)
+        snprintf(err, CURL_ERROR_SIZE, "%s", error);
+    if (map_debug > 1 && !response->fed)
+        sys_log(LOG_DEBUG, "response: %s", response->data ? response->data : "");
+    if (err)
+        sys_log(LOG_DEBUG, "err: %s", err);
+    return http_code;
+}
+
+static long http_auth_hedged(const char* input, char* const* urls, int n, int timeout,
+                             struct http_buffer* response, char* err);
+
+/*
+ * Authenticate with user token to IAM on a one-shot connection
+ * urls, nurls: equivalent endpoints of the section, see http_auth_hedged()
+ */
+
+long http_auth(const char* input, char* const* urls, int nurls, int timeout,
+               struct http_buffer* response, char* err){
+    const char* host_endpoint = urls[0];
+    long http_code = 0;
+    CURL *curl;
+    if (nurls > 1)
+        return http_auth_hedged(input, urls, nurls, timeout, response, err);
+    curl = curl_easy_init() ;
+    if (curl) {
+        http_setup(curl);
+        http_code = http_auth_handle(curl, input, host_endpoint, timeout, response, err);
+        if (http_code >= 200 && http_code < 300)
+            http_sessions_save(curl);
+        curl_easy_cleanup(curl);
+    }
+    return http_code;
+}
+
+/* validators of the downloaded document */
+struct validators {
+    char* etag;
+    char* last_modified;
+};
+
+static void header_value(const char* line, size_t len, const char* name, char* value)
+{
+    size_t nlen = strlen(name), vlen;
+    if (len <= nlen || strncasecmp(line, name, nlen))
+        return;
+    line += nlen;
+    len -= nlen;
+    while (len && isspace((unsigned char)*line)) {
+        line++;
+        len--;
+    }
+    while (len && isspace((unsigned char)line[len - 1]))
+        len--;
+    vlen = len < HTTP_VALIDATOR_SIZE - 1 ? len : HTTP_VALIDATOR_SIZE - 1;
+    memcpy(value, line, vlen);
+    value[vlen] = '\0';
+}
+
+static size_t header_func(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    struct validators* v = (struct validators*)userp;
+    header_value(buffer, size * nitems, "ETag:", v->etag);
+    header_value(buffer, size * nitems, "Last-Modified:", v->last_modified);
+    return size * nitems;
+}
+
+/*
+ * Conditional GET of a document (e.g. a JWKS)
+ * url: document to fetch
+ * etag, last_modified: validators of the copy we have ("" if none),
+ *   HTTP_VALIDATOR_SIZE buffers updated from the response headers
+ * body: output document on 200
+ * Returns the HTTP code, 304 if our copy is still current.
+ */
+long http_get_conditional(const char* url, char* etag, char* last_modified, char** body)
+{
+    struct curl_slist *headers = NULL;
+    struct http_buffer doc = { NULL, 0, 0, 0 };
+    char sent_etag[HTTP_VALIDATOR_SIZE], sent_lm[HTTP_VALIDATOR_SIZE];
+    struct validators v = { etag, last_modified };
+    char header[HTTP_VALIDATOR_SIZE + 32];
+    long http_code = 404;
+    CURLcode res;
+    CURL *curl = curl_easy_init();
+
+    if (!curl)
+        return http_code;
+    http_setup(curl);
+    snprintf(sent_etag, sizeof sent_etag, "%s", etag);
+    snprintf(sent_lm, sizeof sent_lm, "%s", last_modified);
+    if (*sent_etag) {
+        snprintf(header, sizeof header, "If-None-Match: %s", sent_etag);
+        headers = curl_slist_append(headers, header);
+    }
+    if (*sent_lm) {
+        snprintf(header, sizeof header, "If-Modified-Since: %s", sent_lm);
+        headers = curl_slist_append(headers, header);
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, true);
+    http_buffer_attach(curl, &doc, HTTP_MAX_DOCUMENT);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_func);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &v);
+    res = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_cleanup(curl);
+    if (headers)
+        curl_slist_free_all(headers);
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "GET %s: %ld (%s)", url, http_code, curl_easy_strerror(res));
+    if (res == CURLE_OK && http_code == 200 && doc.data) {
+        *body = doc.data;
+        return http_code;
+    }
+    http_buffer_free(&doc);
+    if (http_code != 304) {
+        /* keep the validators of the copy we still have */
+        snprintf(etag, HTTP_VALIDATOR_SIZE, "%s", sent_etag);
+        snprintf(last_modified, HTTP_VALIDATOR_SIZE, "%s", sent_lm);
+        if (res != CURLE_OK && http_code == 200)
+            http_code = 404;
+    }
+    return http_code;
+}
+
+/*
+ * Authenticate with user token to several IAM urls at once
+ * input: input token
+ * urls, n: userinfo endpoints of the candidate sections
+ * timeouts: ms budget of each, 0 for HTTP_TIMEOUT
+ * accept: called with each 2xx response, true if it is the user's
+ * response: output response of the accepted endpoint, reused
+ * Returns the index of the accepted url, -1 if none.  The transfers
+ * still running when one is accepted are aborted, urls whose circuit
+ * is open are skipped.
+ */
+int http_auth_any(const char* input, const char* const* urls, const int* timeouts, int n,
+                  bool (*accept)(const char* response, void* arg), void* arg,
+                  struct http_buffer* response)
+{
+    struct curl_slist *headers = NULL;
+    struct http_buffer docs[n];
+    struct http_endpoint* endpoints[n];
+    CURL* handles[n];
+    bool cut[n];
+    CURLM* multi;
+    CURLMsg* msg;
+    char auth_bearer[sizeof AUTH_BEARER + strlen(input)];
+    int i, running = 0, left, winner = -1;
+    size_t max = http_response_max();
+    long http_code;
+
+    if (n <= 0 || !(multi = curl_multi_init()))
+        return -1;
+    headers = curl_slist_append(headers, http_bearer(auth_bearer, input));
+    memset(docs, 0, sizeof docs);
+    for (i = 0; i < n; i++) {
+        endpoints[i] = http_endpoint(urls[i]);
+        handles[i] = http_circuit_allow(endpoints[i]) ? curl_easy_init() : NULL;
+        if (!handles[i])
+            continue;
+        http_setup(handles[i]);
+        cut[i] = http_deadline(handles[i], endpoints[i], timeouts[i]);
+        curl_easy_setopt(handles[i], CURLOPT_URL, urls[i]);
+        curl_easy_setopt(handles[i], CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(handles[i], CURLOPT_FAILONERROR, true);
+        curl_easy_setopt(handles[i], CURLOPT_NOSIGNAL, 1L);
+        http_buffer_attach(handles[i], &docs[i], max);
+        curl_multi_add_handle(multi, handles[i]);
+    }
+    do {
+        if (curl_multi_perform(multi, &running) != CURLM_OK)
+            break;
+        while (winner < 0 && (msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            for (i = 0; i < n && handles[i] != msg->easy_handle; i++)
+                ;
+            if (i == n)
+                continue;
+            http_code = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &http_code);
+            http_endpoint_done(endpoints[i], msg->easy_handle, msg->data.result, http_code, cut[i]);
+            if (map_debug > 1)
+                sys_log(LOG_DEBUG, "%s: %ld (%s)", urls[i], http_code,
+                        curl_easy_strerror(msg->data.result));
+            if (msg->data.result == CURLE_OK && http_code >= 200 && http_code < 300
+                && docs[i].data && accept(docs[i].data, arg))
+                winner = i;
+        }
+#if CURL_AT_LEAST_VERSION(7, 66, 0)
+        if (winner < 0 && running
+            && curl_multi_poll(multi, NULL, 0, 1000, NULL) != CURLM_OK)
+            break;
+#else
+        if (winner < 0 && running
+            && curl_multi_wait(multi, NULL, 0, 1000, NULL) != CURLM_OK)
+            break;
+#endif
+    } while (winner < 0 && running);
+    for (i = 0; i < n; i++) {
+        if (!handles[i])
+            continue;
+        curl_multi_remove_handle(multi, handles[i]);
+        if (i == winner)
+            http_sessions_save(handles[i]);
+        curl_easy_cleanup(handles[i]);
+        if (i == winner)
+            http_buffer_swap(response, &docs[i]);
+        http_buffer_free(&docs[i]);
+    }
+    curl_multi_cleanup(multi);
+    curl_slist_free_all(headers);
+    return winner;
+}
+
+/* connections being opened by http_prewarm_start() */
+struct http_prewarm {
+    pthread_t thread;
+    CURLM* multi;
+    bool cancel;
+    bool busy;      /* started and not finished yet */
+    int n;
+    const char* urls[HTTP_PREWARM_URLS];
+};
+
+/* a login prewarms one set of urls at a time, so a handle per thread is enough */
+static __thread struct http_prewarm http_prewarm_slot;
+
+static void* http_prewarm_thread(void* arg)
+{
+    struct http_prewarm* p = (struct http_prewarm*)arg;
+    CURL* handles[p->n];
+    int i, running = 0;
+
+    for (i = 0; i < p->n; i++) {
+        handles[i] = http_circuit_open(http_endpoint(p->urls[i])) ? NULL : curl_easy_init();
+        if (!handles[i])
+            continue;
+        http_setup(handles[i]);
+        curl_easy_setopt(handles[i], CURLOPT_URL, p->urls[i]);
+        curl_easy_setopt(handles[i], CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(handles[i], CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(handles[i], CURLOPT_TIMEOUT, (long)HTTP_PREWARM_TIMEOUT);
+        curl_multi_add_handle(p->multi, handles[i]);
+    }
+    do {
+        if (curl_multi_perform(p->multi, &running) != CURLM_OK)
+            break;
+#if CURL_AT_LEAST_VERSION(7, 68, 0)
+        if (running && !__atomic_load_n(&p->cancel, __ATOMIC_ACQUIRE)
+            && curl_multi_poll(p->multi, NULL, 0, 1000, NULL) != CURLM_OK)
+            break;
+#else
+        if (running && !__atomic_load_n(&p->cancel, __ATOMIC_ACQUIRE)
+            && curl_multi_wait(p->multi, NULL, 0, 100, NULL) != CURLM_OK)
+            break;
+#endif
+    } while (running && !__atomic_load_n(&p->cancel, __ATOMIC_ACQUIRE));
+    /* finished connections stay in the shared cache for the real request */
+    for (i = 0; i < p->n; i++) {
+        if (!handles[i])
+            continue;
+        curl_multi_remove_handle(p->multi, handles[i]);
+        curl_easy_cleanup(handles[i]);
+    }
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "prewarm of %d IAM connections %s", p->n,
+                running ? "cancelled" : "done");
+    return NULL;
+}
+
+/*
+ * Open connections to urls in the background, e.g. while the user types
+ * the token: an unauthenticated HEAD request leaves a resolved, TLS
+ * established keep-alive connection in the process wide cache, which the
+ * next http_auth() or http_auth_any() to the same host picks up.
+ * urls must stay valid until http_prewarm_finish(), e.g. those of a
+ * snapshot still held; only the first HTTP_PREWARM_URLS are opened.
+ * The handle is the calling thread's, nothing is allocated for it.
+ * Returns NULL if no thread was started; pass the result to
+ * http_prewarm_finish() in any case.
+ */
+struct http_prewarm* http_prewarm_start(const char* const* urls, int n)
+{
+    struct http_prewarm* p = &http_prewarm_slot;
+    sigset_t all, old;
+    int i, err = -1;
+
+    if (n <= 0 || p->busy)
+        return NULL;
+    p->n = n < HTTP_PREWARM_URLS ? n : HTTP_PREWARM_URLS;
+    for (i = 0; i < p->n; i++)
+        p->urls[i] = urls[i];
+    p->cancel = false;
+    pthread_once(&http_once, http_init);
+    p->multi = curl_multi_init();
+    if (p->multi) {
+        /* signals are for the threads of the process we are loaded into */
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        err = pthread_create(&p->thread, NULL, http_prewarm_thread, p);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    if (err) {
+        if (p->multi)
+            curl_multi_cleanup(p->multi);
+        return NULL;
+    }
+    p->busy = true;
+    return p;
+}
+
+/*
+ * Wait for the connections of http_prewarm_start().  A handshake still
+ * running is finished rather than started again by the next request,
+ * unless cancel says no request follows.
+ */
+void http_prewarm_finish(struct http_prewarm* p, bool cancel)
+{
+    if (!p)
+        return;
+    if (cancel) {
+        __atomic_store_n(&p->cancel, true, __ATOMIC_RELEASE);
+#if CURL_AT_LEAST_VERSION(7, 68, 0)
+        curl_multi_wakeup(p->multi);
+#endif
+    }
+    pthread_join(p->thread, NULL);
+    curl_multi_cleanup(p->multi);
+    p->multi = NULL;
+    p->busy = false;
+}
+
+static long long http_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* how long the best endpoint may take before the next one is asked too */
+static long http_hedge_delay(const struct http_endpoint* e)
+{
+    long latency = e ? __atomic_load_n(&e->latency, __ATOMIC_RELAXED) : 0;
+    if (!latency)
+        return HTTP_HEDGE_DELAY;
+    return latency * HTTP_HEDGE_FACTOR > HTTP_HEDGE_MIN ? latency * HTTP_HEDGE_FACTOR : HTTP_HEDGE_MIN;
+}
+
+/*
+ * Authenticate with user token against equivalent endpoints of a
+ * section: the fastest one first, then the next one as well when it
+ * has not answered within twice its usual latency, or at once when it
+ * failed.  The first endpoint accepting or refusing the token (2xx,
+ * 401, 403) decides; any other code moves on to the next endpoint as a
+ * failure does, 503 if none decides.
+ */
+static long http_auth_hedged(const char* input, char* const* urls, int n, int timeout,
+                             struct http_buffer* response, char* err)
+{
+    struct curl_slist *headers = NULL;
+    struct http_endpoint* endpoints[n];
+    struct http_buffer docs[n];
+    CURL* handles[n];
+    bool cut[n];
+    int order[n];
+    char auth_bearer[sizeof AUTH_BEARER + strlen(input)];
+    char error[CURL_ERROR_SIZE] = "";
+    long http_code = 0, code, wait;
+    long long hedge_at;
+    int i, usable, started = 0, running = 0, left, winner = -1;
+    size_t max = http_response_max();
+    CURLM* multi;
+    CURLMsg* msg;
+
+    usable = http_endpoint_rank(urls, n, order, endpoints);
+    if (!usable)
+        return http_auth(input, urls, 1, timeout, response, err);
+    if (!(multi = curl_multi_init()))
+        return 0;
+    headers = curl_slist_append(headers, http_bearer(auth_bearer, input));
+    memset(docs, 0, sizeof docs);
+    memset(handles, 0, sizeof handles);
+    hedge_at = http_now_ms();
+    do {
+        /* start the next endpoint when it is due */
+        if (started < usable && (started == 0 || http_now_ms() >= hedge_at)) {
+            i = order[started++];
+            /* after a cool-down only one request probes an endpoint */
+            if (!http_circuit_allow(endpoints[i])) {
+                hedge_at = http_now_ms();
+                continue;
+            }
+            if ((handles[i] = curl_easy_init())) {
+                http_setup(handles[i]);
+                cut[i] = http_deadline(handles[i], endpoints[i], timeout);
+                curl_easy_setopt(handles[i], CURLOPT_URL, urls[i]);
+                curl_easy_setopt(handles[i], CURLOPT_HTTPHEADER, headers);
+                curl_easy_setopt(handles[i], CURLOPT_FAILONERROR, true);
+                curl_easy_setopt(handles[i], CURLOPT_NOSIGNAL, 1L);
+                http_buffer_attach(handles[i], &docs[i], max);
+                curl_multi_add_handle(multi, handles[i]);
+            }
+            hedge_at = http_now_ms() + http_hedge_delay(endpoints[i]);
+            if (started > 1 && map_debug > 1)
+                sys_log(LOG_DEBUG, "also asking %s", urls[i]);
+        }
+        if (curl_multi_perform(multi, &running) != CURLM_OK)
+            break;
+        while (winner < 0 && (msg = curl_multi_info_read(multi, &left))) {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            for (i = 0; i < n && handles[i] != msg->easy_handle; i++)
+                ;
+            if (i == n)
+                continue;
+            code = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+            http_endpoint_done(endpoints[i], msg->easy_handle, msg->data.result, code, cut[i]);
+            /* e.g. a body over max_response */
+            if (msg->data.result != CURLE_OK && code >= 200 && code < 300)
+                code = 502;
+            if (http_decided(code)) {
+                winner = i;
+                http_code = code;
+            } else {
+                snprintf(error, sizeof error, "%s: %ld (%s)", urls[i], code,
+                         curl_easy_strerror(msg->data.result));
+                hedge_at = http_now_ms();   /* failed, try the next one now */
+            }
+        }
+        if (winner >= 0 || (!running && started == usable))
+            break;
+        wait = started < usable ? (long)(hedge_at - http_now_ms()) : 1000;
+        if (wait <= 0)
+            continue;
+#if CURL_AT_LEAST_VERSION(7, 66, 0)
+        if (curl_multi_poll(multi, NULL, 0, wait < 1000 ? wait : 1000, NULL) != CURLM_OK)
+            break;
+#else
+        if (curl_multi_wait(multi, NULL, 0, wait < 1000 ? wait : 1000, NULL) != CURLM_OK)
+            break;
+#endif
+    } while (1);
+    for (i = 0; i < n; i++) {
+        if (!handles[i])
+            continue;
+        curl_multi_remove_handle(multi, handles[i]);
+        if (i == winner && http_code < 300)
+            http_sessions_save(handles[i]);
+        curl_easy_cleanup(handles[i]);
+        if (i == winner)
+            http_buffer_swap(response, &docs[i]);
+        http_buffer_free(&docs[i]);
+    }
+    curl_multi_cleanup(multi);
+    curl_slist_free_all(headers);
+    if (err && winner < 0)
+        snprintf(err, CURL_ERROR_SIZE, "%s", error);
+    /* no endpoint answered for the IAM */
+    return winner < 0 ? 503 : http_code;
+}
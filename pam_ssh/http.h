@@ -0,0 +1,67 @@
+#ifndef PAM_SSH_HTTP_H
+#define PAM_SSH_HTTP_H
+
+#include <stdbool.h>
+#include <curl/curl.h>
+
+/*
+ * HTTP calls to the IAM userinfo endpoint; shared by pam_ssh.so and
+ * the pam_ssh_broker daemon.
+ */
+
+#define HTTP_VALIDATOR_SIZE 256   /* ETag / Last-Modified buffers */
+#define HTTP_MAX_DOCUMENT (1024 * 1024)
+#define HTTP_MAX_RESPONSE (64 * 1024)   /* default cap of a userinfo response */
+#define HTTP_BUFFER_SIZE 4096     /* first allocation of a response buffer */
+#define HTTP_PREWARM_TIMEOUT 10   /* seconds for a background connection */
+#define HTTP_PREWARM_URLS 16      /* endpoints one prewarm opens connections to */
+#define HTTP_TIMEOUT 10000        /* default ms budget of a userinfo request */
+#define HTTP_TIMEOUT_MIN 1000     /* ... never cut below */
+#define HTTP_TIMEOUT_FACTOR 4     /* ... otherwise cut to this times the usual latency */
+#define HTTP_CONNECT_TIMEOUT 3000 /* ms for TCP and TLS handshake */
+#define HTTP_BREAKER_FAILURES 3   /* consecutive failures opening the circuit */
+#define HTTP_BREAKER_COOLDOWN 30  /* seconds an open circuit fails fast */
+#define HTTP_HEDGE_DELAY 500      /* ms before asking the next endpoint of a section too */
+#define HTTP_HEDGE_FACTOR 2       /* ... or this times the usual latency of the first */
+#define HTTP_HEDGE_MIN 50         /* ... but not earlier */
+#define HTTP_ENDPOINTS 64         /* endpoints whose health is tracked */
+#define HTTP_ENDPOINTS_FILE "endpoints"   /* in dbdir, shared by all processes */
+
+struct map_snapshot;
+struct http_prewarm;
+
+/*
+ * Growable body of a response, NUL terminated.  A buffer passed to
+ * several requests keeps its allocation; each request overwrites it and
+ * fails once the body would exceed max.  With feed set, a single
+ * transfer hands every chunk to it as it arrives instead, and is ended
+ * early, as complete, when feed wants no more; len then only counts
+ * the bytes and nothing is allocated.
+ */
+struct http_buffer {
+    char* data;
+    size_t len;
+    size_t size;    /* allocated, > len */
+    size_t max;     /* set by the request */
+    bool (*feed)(void* arg, const char* data, size_t len);  /* false: enough read */
+    void* feed_arg;
+    bool fed;       /* feed has seen the body from its start */
+    bool stopped;   /* ... and ended the transfer */
+};
+
+extern void http_warmup(const struct map_snapshot* snap);
+extern const char* http_endpoint_pick(char* const* urls, int n);
+extern bool http_buffer_reserve(struct http_buffer* b, size_t len);
+extern void http_buffer_free(struct http_buffer* b);
+extern long http_auth(const char* input, char* const* urls, int nurls, int timeout,
+                      struct http_buffer* response, char* err);
+extern long http_auth_handle(CURL* curl, const char* input, const char* host_endpoint, int timeout,
+                             struct http_buffer* response, char* err);
+extern int http_auth_any(const char* input, const char* const* urls, const int* timeouts, int n,
+                         bool (*accept)(const char* response, void* arg), void* arg,
+                         struct http_buffer* response);
+extern struct http_prewarm* http_prewarm_start(const char* const* urls, int n);
+extern void http_prewarm_finish(struct http_prewarm* p, bool cancel);
+extern long http_get_conditional(const char* url, char* etag, char* last_modified, char** body);
+
+#endif
@@ -0,0 +1,169 @@
+/*******************************************************************************
+ * file:        json_bench.c
+ * description: times the userinfo reader of pam_ssh on a large document
+ *              with each jsonscan implementation the CPU has, against
+ *              json_read_object() of mjson as it was used before
+ * notes:       make bench; ./json_bench [iterations]
+ *              The document is fed in chunks of CURL_MAX_WRITE_SIZE, as
+ *              the curl write callback hands it over.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <curl/curl.h>
+#include "mjson.h"
+#include "jsonscan.h"
+#include "userinfo.h"
+#include "arena.h"
+#include "pam_ssh_common.h"
+
+#define ENTITLEMENTS 256
+
+#define CLAIM_SIZE 64
+#define MAX_GROUPS 8
+
+static const char *isa_names[] = { "scalar", "sse2", "avx2" };
+
+/* the claims of struct userinfo in the fixed buffers mjson used to read into */
+struct claims {
+    char sub[CLAIM_SIZE];
+    char name[CLAIM_SIZE];
+    char preferred_username[CLAIM_SIZE];
+    char given_name[CLAIM_SIZE];
+    char family_name[CLAIM_SIZE];
+    int updated_at;
+    char email[CLAIM_SIZE];
+    bool email_verified;
+    char *groupsptrs[MAX_GROUPS];
+    char groupsstore[CLAIM_SIZE * MAX_GROUPS];
+    int groupscount;
+    char organisation_name[CLAIM_SIZE];
+};
+
+static int claims_read(const char *buf, struct claims *c)
+{
+    const struct json_attr_t attrs[] = {
+        {"sub", t_string, .addr.string = c->sub, .len = sizeof(c->sub)},
+        {"name", t_string, .addr.string = c->name, .len = sizeof(c->name)},
+        {"preferred_username", t_string, .addr.string = c->preferred_username, .len = sizeof(c->preferred_username)},
+        {"given_name", t_string, .addr.string = c->given_name, .len = sizeof(c->given_name)},
+        {"family_name", t_string, .addr.string = c->family_name, .len = sizeof(c->family_name)},
+        {"updated_at", t_integer, .addr.integer = &c->updated_at},
+        {"email", t_string, .addr.string = c->email, .len = sizeof(c->email)},
+        {"email_verified", t_boolean, .addr.boolean = &c->email_verified},
+        {"groups", t_array, .addr.array.element_type = t_string,
+                            .addr.array.arr.strings.ptrs = c->groupsptrs,
+                            .addr.array.arr.strings.store = c->groupsstore,
+                            .addr.array.arr.strings.storelen = sizeof(c->groupsstore),
+                            .addr.array.count = &c->groupscount,
+                            .addr.array.maxlen = MAX_GROUPS},
+        {"organisation_name", t_string, .addr.string = c->organisation_name, .len = sizeof(c->organisation_name)},
+        {NULL},
+    };
+    return json_read_object(buf, attrs, NULL);
+}
+
+/* a userinfo of some 20KB, most of it a claim nobody maps */
+static char *make_document(void)
+{
+    size_t size = 64 * 1024, len = 0;
+    char *doc = malloc(size);
+    int i;
+    if (!doc)
+        return NULL;
+    len += snprintf(doc + len, size - len,
+                    "{\"sub\": \"38bf61bb-d1db-45e6-a36d-670e63aed301\", "
+                    "\"name\": \"FirstName LastName\", "
+                    "\"given_name\": \"FirstName\", \"family_name\": \"LastName\", "
+                    "\"updated_at\": 1538809161, \"email\": \"some@email.com\", "
+                    "\"email_verified\": true, \"eduperson_entitlement\": [");
+    for (i = 0; i < ENTITLEMENTS; i++)
+        len += snprintf(doc + len, size - len,
+                        "%s\"urn:mace:egi.eu:group:vo.example.org:role=member#aai.egi.eu:%d\"",
+                        i ? ", " : "", i);
+    len += snprintf(doc + len, size - len,
+                    "], \"groups\": [\"users\", \"admins\", \"ops\", \"dev\"], "
+                    "\"organisation_name\": \"deep-hdc\", "
+                    "\"preferred_username\": \"someusername\"}");
+    return doc;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* bytes of the chunk at off */
+static size_t chunk(size_t len, size_t off)
+{
+    return len - off < CURL_MAX_WRITE_SIZE ? len - off : CURL_MAX_WRITE_SIZE;
+}
+
+static void report(const char *what, double seconds, int iterations, size_t len)
+{
+    printf("%-24s %8.2f us/doc %8.1f MB/s\n", what, seconds / iterations * 1e6,
+           (double)len * iterations / seconds / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+    char *doc = make_document();
+    size_t len, off;
+    struct claims c;
+    struct arena arena = ARENA_INIT;
+    struct userinfo ui;
+    struct userinfo_stream s;
+    char what[32];
+    double start;
+    int isa, i;
+
+    if (!doc || iterations <= 0)
+        return 1;
+    len = strlen(doc);
+    printf("document: %zu bytes, %d iterations\n", len, iterations);
+
+    /* the baseline: mjson reading the whole document into fixed buffers */
+    json_scan_use(JSON_SCAN_SCALAR);
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        memset(&c, 0, sizeof(c));
+        if (claims_read(doc, &c) != 0) {
+            fprintf(stderr, "json_read_object failed\n");
+            return 1;
+        }
+    }
+    report("json_read_object", now() - start, iterations, len);
+    if (strcmp(c.preferred_username, "someusername") != 0 || c.groupscount != 4) {
+        fprintf(stderr, "unexpected userinfo\n");
+        return 1;
+    }
+
+    /* the reader pam_ssh uses, as in pam_sm_authenticate() */
+    for (isa = JSON_SCAN_SCALAR; isa <= JSON_SCAN_AVX2; isa++) {
+        if (!json_scan_use(isa))
+            continue;
+        start = now();
+        for (i = 0; i < iterations; i++) {
+            userinfo_init(&ui, &arena);
+            userinfo_stream_init(&s, &ui, USERINFO_USERNAME);
+            for (off = 0; off < len && userinfo_stream_feed(&s, doc + off, chunk(len, off));
+                 off += chunk(len, off))
+                ;
+            if (!userinfo_stream_done(&s) || strcmp(ui.preferred_username, "someusername") != 0
+                || ui.groupscount != 4) {
+                fprintf(stderr, "userinfo stream failed\n");
+                return 1;
+            }
+            arena_free(&arena);
+        }
+        snprintf(what, sizeof(what), "userinfo stream %s", isa_names[isa]);
+        report(what, now() - start, iterations, len);
+    }
+
+    free(doc);
+    return 0;
+}
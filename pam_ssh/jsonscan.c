@@ -0,0 +1,207 @@
+/*******************************************************************************
+ * file:        jsonscan.c
+ * description: SSE2/AVX2 scanning of JSON text for mjson and the
+ *              userinfo reader
+ * notes:       the vector versions load aligned blocks, which never cross
+ *              a page, so they may look at bytes around the string but
+ *              never fault; the bytes before cp (and from end on) are
+ *              masked out
+*******************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include "jsonscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define JSON_SCAN_X86
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#define JSON_SCAN_WHOLE_BLOCKS __attribute__((no_sanitize_address))
+#else
+#define JSON_SCAN_WHOLE_BLOCKS
+#endif
+
+static const char *scan_string_scalar(const char *cp)
+{
+    while (*cp != '"' && *cp != '\\' && *cp != '\0')
+        cp++;
+    return cp;
+}
+
+static const char *scan_structural_scalar(const char *cp)
+{
+    /* '[' and ']' are '{' and '}' with bit 5 cleared */
+    while (*cp != '"' && (*cp | 0x20) != '{' && (*cp | 0x20) != '}' && *cp != '\0')
+        cp++;
+    return cp;
+}
+
+static const char *scan_string_scalar_n(const char *cp, const char *end)
+{
+    while (cp < end && *cp != '"' && *cp != '\\' && *cp != '\0')
+        cp++;
+    return cp;
+}
+
+static const char *scan_structural_scalar_n(const char *cp, const char *end)
+{
+    while (cp < end && *cp != '"' && (*cp | 0x20) != '{' && (*cp | 0x20) != '}' && *cp != '\0')
+        cp++;
+    return cp;
+}
+
+#ifdef JSON_SCAN_X86
+__attribute__((target("sse2")))
+static inline unsigned string_mask_sse2(__m128i v)
+{
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                                       _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                                          _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+}
+
+__attribute__((target("sse2")))
+static inline unsigned structural_mask_sse2(__m128i v)
+{
+    __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    return _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                                                       _mm_cmpeq_epi8(v, _mm_setzero_si128())),
+                                          _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                                                       _mm_cmpeq_epi8(folded, _mm_set1_epi8('}')))));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned string_mask_avx2(__m256i v)
+{
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                                                          _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+                                                          _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned structural_mask_avx2(__m256i v)
+{
+    __m256i folded = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                                                          _mm256_cmpeq_epi8(v, _mm256_setzero_si256())),
+                                                          _mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')),
+                                                                          _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}')))));
+}
+
+/*
+ * The scanners of one instruction set: name(cp) up to the first byte
+ * mask_of() flags, name_n(cp, end) the same in [cp, end), end if none.
+ */
+#define SCANNER(name, isa, vec, width, load, mask_of)                           \
+__attribute__((target(isa))) JSON_SCAN_WHOLE_BLOCKS                             \
+static const char *name(const char *cp)                                         \
+{                                                                               \
+    unsigned off = (uintptr_t)cp & (width - 1);                                 \
+    const vec *p = (const vec *)(cp - off);                                     \
+    unsigned mask = mask_of(load(p)) >> off << off;                             \
+    while (!mask)                                                               \
+        mask = mask_of(load(++p));                                              \
+    return (const char *)p + __builtin_ctz(mask);                               \
+}                                                                               \
+                                                                                \
+__attribute__((target(isa))) JSON_SCAN_WHOLE_BLOCKS                             \
+static const char *name##_n(const char *cp, const char *end)                    \
+{                                                                               \
+    unsigned off = (uintptr_t)cp & (width - 1);                                 \
+    const vec *p = (const vec *)(cp - off);                                     \
+    unsigned mask;                                                              \
+    if (cp >= end)                                                              \
+        return end;                                                             \
+    for (mask = mask_of(load(p)) >> off << off;; mask = mask_of(load(++p))) {   \
+        /* the block holding end - 1 is the last one read */                    \
+        if ((const char *)p + width >= end) {                                   \
+            mask &= ~0u >> (32 - (end - (const char *)p));                      \
+            return mask ? (const char *)p + __builtin_ctz(mask) : end;          \
+        }                                                                       \
+        if (mask)                                                               \
+            return (const char *)p + __builtin_ctz(mask);                       \
+    }                                                                           \
+}
+
+SCANNER(scan_string_sse2, "sse2", __m128i, 16, _mm_load_si128, string_mask_sse2)
+SCANNER(scan_structural_sse2, "sse2", __m128i, 16, _mm_load_si128, structural_mask_sse2)
+SCANNER(scan_string_avx2, "avx2", __m256i, 32, _mm256_load_si256, string_mask_avx2)
+SCANNER(scan_structural_avx2, "avx2", __m256i, 32, _mm256_load_si256, structural_mask_avx2)
+#endif /* JSON_SCAN_X86 */
+
+static const struct json_scanner {
+    const char *(*string)(const char *);
+    const char *(*structural)(const char *);
+    const char *(*string_n)(const char *, const char *);
+    const char *(*structural_n)(const char *, const char *);
+} scanners[] = {
+    [JSON_SCAN_SCALAR] = { scan_string_scalar, scan_structural_scalar,
+                           scan_string_scalar_n, scan_structural_scalar_n },
+#ifdef JSON_SCAN_X86
+    [JSON_SCAN_SSE2] = { scan_string_sse2, scan_structural_sse2,
+                         scan_string_sse2_n, scan_structural_sse2_n },
+    [JSON_SCAN_AVX2] = { scan_string_avx2, scan_structural_avx2,
+                         scan_string_avx2_n, scan_structural_avx2_n },
+#endif
+};
+
+static const struct json_scanner *scanner;
+
+static bool json_scan_supported(int isa)
+{
+#ifdef JSON_SCAN_X86
+    __builtin_cpu_init();
+    if (isa == JSON_SCAN_AVX2)
+        return __builtin_cpu_supports("avx2");
+    if (isa == JSON_SCAN_SSE2)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return isa == JSON_SCAN_SCALAR;
+}
+
+/* the best implementation for this CPU; racing threads pick the same */
+static const struct json_scanner *json_scan_pick(void)
+{
+    const struct json_scanner *s = __atomic_load_n(&scanner, __ATOMIC_ACQUIRE);
+    int isa;
+    if (s)
+        return s;
+    for (isa = JSON_SCAN_AVX2; !json_scan_supported(isa); isa--)
+        ;
+    s = &scanners[isa];
+    __atomic_store_n(&scanner, s, __ATOMIC_RELEASE);
+    return s;
+}
+
+const char *json_scan_string(const char *cp)
+{
+    return json_scan_pick()->string(cp);
+}
+
+const char *json_scan_structural(const char *cp)
+{
+    return json_scan_pick()->structural(cp);
+}
+
+const char *json_scan_string_n(const char *cp, const char *end)
+{
+    return json_scan_pick()->string_n(cp, end);
+}
+
+const char *json_scan_structural_n(const char *cp, const char *end)
+{
+    return json_scan_pick()->structural_n(cp, end);
+}
+
+int json_scan_isa(void)
+{
+    return (int)(json_scan_pick() - scanners);
+}
+
+bool json_scan_use(int isa)
+{
+    if (isa < JSON_SCAN_SCALAR || isa > JSON_SCAN_AVX2 || !json_scan_supported(isa))
+        return false;
+    __atomic_store_n(&scanner, &scanners[isa], __ATOMIC_RELEASE);
+    return true;
+}
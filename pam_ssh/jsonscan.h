@@ -0,0 +1,31 @@
+#ifndef PAM_SSH_JSONSCAN_H
+#define PAM_SSH_JSONSCAN_H
+
+#include <stdbool.h>
+
+/*
+ * Vectorised scanning for the JSON readers: the hot loops of mjson and
+ * of the userinfo stream look for the end of a string or for the next
+ * structural character, which SSE2 and AVX2 find 16 or 32 bytes at a
+ * time.  The implementation is chosen from the CPU at first use.  The
+ * input must be NUL terminated, or bounded by end for the _n versions
+ * (a chunk of a response as it arrives).
+ */
+
+#define JSON_SCAN_SCALAR 0
+#define JSON_SCAN_SSE2 1
+#define JSON_SCAN_AVX2 2
+
+/* the first '"', '\\' or NUL at or after cp */
+extern const char *json_scan_string(const char *cp);
+/* the first '"', '{', '}', '[', ']' or NUL at or after cp */
+extern const char *json_scan_structural(const char *cp);
+/* the same within [cp, end), end if there is none */
+extern const char *json_scan_string_n(const char *cp, const char *end);
+extern const char *json_scan_structural_n(const char *cp, const char *end);
+/* implementation in use, JSON_SCAN_* */
+extern int json_scan_isa(void);
+/* for json_bench: use another implementation, false if the CPU lacks it */
+extern bool json_scan_use(int isa);
+
+#endif
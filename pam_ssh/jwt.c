@@ -0,0 +1,490 @@
+/*******************************************************************************
+ * file:        jwt.c
+ * description: offline verification of JWT access tokens with a cached JWKS
+ * notes:       RS256/RS384/RS512 only; anything else is left to the IAM
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+#endif
+#include "mjson.h"
+#include "http.h"
+#include "cache.h"
+#include "userinfo.h"
+#include "jwt.h"
+#include "pam_ssh_common.h"
+#include "../common/common.h"
+
+#define JWKS_MAGIC 0x314b574a    /* "JWK1" */
+#define JWKS_PREFIX "jwks-"
+
+/* on disk copy of a section's JWKS: this header followed by the document */
+struct jwks_meta {
+    uint32_t magic;
+    uint32_t len;
+    int64_t checked;    /* last time we asked the IAM */
+    char etag[HTTP_VALIDATOR_SIZE];
+    char last_modified[HTTP_VALIDATOR_SIZE];
+};
+
+struct jwk {
+    char kty[8];
+    char kid[128];
+    char alg[16];
+    char use[8];
+    char n[JSON_VAL_MAX];
+    char e[16];
+};
+
+struct jwt_header {
+    char alg[16];
+    char kid[128];
+};
+
+struct jwt_claims {
+    char iss[256];
+    char sub[256];
+    char *audptrs[8];
+    char audstore[1024];
+    int audcount;
+    char aud[256];
+    double exp;
+    double nbf;
+    char preferred_username[256];
+    char name[256];
+    char email[256];
+};
+
+static int base64url_value(char c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '-') return 62;
+    if (c == '_') return 63;
+    return -1;
+}
+
+/*
+ * Decode len chars of unpadded base64url into out (len * 3 / 4 + 1 bytes)
+ * Returns decoded length or -1.
+ */
+int base64url_decode(const char* in, size_t len, unsigned char* out)
+{
+    uint32_t acc = 0;
+    int bits = 0, n = 0;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        int v = base64url_value(in[i]);
+        if (v < 0)
+            return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = (acc >> bits) & 0xff;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/* decoded copy of a base64url segment, to be freed */
+static char* segment_decode(const char* in, size_t len, int* outlen)
+{
+    char* out = (char*)malloc(len * 3 / 4 + 2);
+    int n;
+    if (!out)
+        return NULL;
+    n = base64url_decode(in, len, (unsigned char*)out);
+    if (n < 0) {
+        free(out);
+        return NULL;
+    }
+    if (outlen)
+        *outlen = n;
+    return out;
+}
+
+static int claims_read(const char* json, struct jwt_claims* c)
+{
+    const struct json_attr_t claims_attrs[] = {
+        {"iss", t_string, .addr.string = c->iss, .len = sizeof(c->iss)},
+        {"sub", t_string, .addr.string = c->sub, .len = sizeof(c->sub)},
+        /* aud is either an array or a single string */
+        {"aud", t_array, .addr.array.element_type = t_string,
+                         .addr.array.arr.strings.ptrs = c->audptrs,
+                         .addr.array.arr.strings.store = c->audstore,
+                         .addr.array.arr.strings.storelen = sizeof(c->audstore),
+                         .addr.array.count = &c->audcount,
+                         .addr.array.maxlen = sizeof(c->audptrs)/sizeof(c->audptrs[0])},
+        {"aud", t_string, .addr.string = c->aud, .len = sizeof(c->aud)},
+        {"exp", t_real, .addr.real = &c->exp},
+        {"nbf", t_real, .addr.real = &c->nbf},
+        {"preferred_username", t_string, .addr.string = c->preferred_username, .len = sizeof(c->preferred_username)},
+        {"name", t_string, .addr.string = c->name, .len = sizeof(c->name)},
+        {"email", t_string, .addr.string = c->email, .len = sizeof(c->email)},
+        {NULL},
+    };
+    memset(c, 0, sizeof *c);
+    return json_read_object(json, claims_attrs, NULL);
+}
+
+/*
+ * exp claim of a JWT access token, 0 for opaque tokens
+ */
+long long jwt_expiry(const char* token)
+{
+    const char* payload = strchr(token, '.');
+    const char* end;
+    char* json;
+    double exp = 0;
+    const struct json_attr_t exp_attrs[] = {
+        {"exp", t_real, .addr.real = &exp},
+        {NULL},
+    };
+    if (!payload || !(end = strchr(++payload, '.')))
+        return 0;
+    json = segment_decode(payload, end - payload, NULL);
+    if (!json)
+        return 0;
+    if (json_read_object(json, exp_attrs, NULL) != 0)
+        exp = 0;
+    free(json);
+    return (long long)exp;
+}
+
+static bool jwks_path(const struct mapitem* section, char* path, size_t len)
+{
+    char name[NAME_MAX - sizeof JWKS_PREFIX];
+    size_t i;
+    /* section names are free text, keep them out of path syntax */
+    for (i = 0; section->name[i] && i < sizeof name - 1; i++)
+        name[i] = isalnum((unsigned char)section->name[i]) ? section->name[i] : '_';
+    name[i] = '\0';
+    return snprintf(path, len, "%s%s%s", dbdir, JWKS_PREFIX, name) < (int)len;
+}
+
+static void jwks_store(const char* path, struct jwks_meta* meta, const char* body)
+{
+    char tmp[PATH_MAX];
+    bool ok;
+    int fd;
+    if (!cache_dir())
+        return;
+    meta->magic = JWKS_MAGIC;
+    meta->len = strlen(body);
+    snprintf(tmp, sizeof tmp, "%s.tmp-XXXXXX", dbdir);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+    ok = write(fd, meta, sizeof *meta) == sizeof *meta
+        && write(fd, body, meta->len) == (ssize_t)meta->len;
+    if (close(fd) < 0)
+        ok = false;
+    if (!ok || rename(tmp, path) < 0) {
+        sys_log(LOG_ERR, "jwks: cannot store %s: %m", path);
+        unlink(tmp);
+    }
+}
+
+/*
+ * JWKS of a section from dbdir, refreshed when older than jwks_refresh
+ * Returns the document (to be freed) or NULL.
+ */
+static char* jwks_get(const struct mapitem* section)
+{
+    char path[PATH_MAX];
+    struct jwks_meta meta;
+    struct stat st;
+    char* body = NULL;
+    char* fresh = NULL;
+    time_t now = time(NULL);
+    int fd;
+
+    if (!jwks_path(section, path, sizeof path))
+        return NULL;
+    memset(&meta, 0, sizeof meta);
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0) {
+        if (fstat(fd, &st) == 0 && st.st_uid == geteuid() && !(st.st_mode & 022)
+            && read(fd, &meta, sizeof meta) == sizeof meta
+            && meta.magic == JWKS_MAGIC && meta.len <= HTTP_MAX_DOCUMENT
+            && (body = (char*)malloc(meta.len + 1))) {
+            if (read(fd, body, meta.len) == (ssize_t)meta.len)
+                body[meta.len] = '\0';
+            else {
+                free(body);
+                body = NULL;
+            }
+        }
+        close(fd);
+    }
+    if (!body)
+        memset(&meta, 0, sizeof meta);
+    meta.etag[HTTP_VALIDATOR_SIZE - 1] = '\0';
+    meta.last_modified[HTTP_VALIDATOR_SIZE - 1] = '\0';
+
+    if (now - meta.checked >= section->jwks_refresh) {
+        /* rate limited by 'checked' whatever the outcome */
+        long http_code = http_get_conditional(section->jwks_url, meta.etag, meta.last_modified, &fresh);
+        meta.checked = now;
+        if (http_code == 200 && fresh) {
+            free(body);
+            body = fresh;
+        } else if (http_code != 304)
+            sys_log(LOG_ERR, "jwks: %s returned %ld", section->jwks_url, http_code);
+        jwks_store(path, &meta, body ? body : "");
+    }
+    if (body && !*body) {
+        free(body);
+        body = NULL;
+    }
+    return body;
+}
+
+static EVP_PKEY* jwk_public_key(const struct jwk* k)
+{
+    unsigned char n[sizeof k->n], e[sizeof k->e];
+    int nlen = base64url_decode(k->n, strlen(k->n), n);
+    int elen = base64url_decode(k->e, strlen(k->e), e);
+    BIGNUM *bn_n, *bn_e;
+    EVP_PKEY* pkey = NULL;
+
+    if (nlen <= 0 || elen <= 0)
+        return NULL;
+    bn_n = BN_bin2bn(n, nlen, NULL);
+    bn_e = BN_bin2bn(e, elen, NULL);
+    if (!bn_n || !bn_e)
+        goto out;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    {
+        OSSL_PARAM_BLD* bld = OSSL_PARAM_BLD_new();
+        OSSL_PARAM* params = NULL;
+        EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL);
+        if (bld && ctx
+            && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, bn_n)
+            && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, bn_e)
+            && (params = OSSL_PARAM_BLD_to_param(bld))
+            && EVP_PKEY_fromdata_init(ctx) > 0)
+            EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params);
+        OSSL_PARAM_free(params);
+        OSSL_PARAM_BLD_free(bld);
+        EVP_PKEY_CTX_free(ctx);
+    }
+#else
+    {
+        RSA* rsa = RSA_new();
+        if (rsa && RSA_set0_key(rsa, bn_n, bn_e, NULL)) {
+            bn_n = bn_e = NULL;    /* owned by rsa now */
+            pkey = EVP_PKEY_new();
+            if (pkey && !EVP_PKEY_assign_RSA(pkey, rsa)) {
+                EVP_PKEY_free(pkey);
+                pkey = NULL;
+            }
+            if (!pkey)
+                RSA_free(rsa);
+        } else
+            RSA_free(rsa);
+    }
+#endif
+  out:
+    BN_free(bn_n);
+    BN_free(bn_e);
+    return pkey;
+}
+
+static const EVP_MD* jwt_digest(const char* alg)
+{
+    if (strcmp(alg, "RS256") == 0)
+        return EVP_sha256();
+    if (strcmp(alg, "RS384") == 0)
+        return EVP_sha384();
+    if (strcmp(alg, "RS512") == 0)
+        return EVP_sha512();
+    return NULL;
+}
+
+static bool signature_ok(EVP_PKEY* pkey, const EVP_MD* md, const char* signed_part, size_t signed_len,
+                         const unsigned char* sig, size_t sig_len)
+{
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    bool ok = ctx
+        && EVP_DigestVerifyInit(ctx, NULL, md, NULL, pkey) == 1
+        && EVP_DigestVerify(ctx, sig, sig_len, (const unsigned char*)signed_part, signed_len) == 1;
+    EVP_MD_CTX_free(ctx);
+    return ok;
+}
+
+/*
+ * Find the key the token was signed with in the section's JWKS
+ * Returns JWT_VALID with *pkey set, or JWT_UNVERIFIED.
+ */
+static int jwks_key(const struct mapitem* section, const struct jwt_header* h, EVP_PKEY** pkey)
+{
+    struct jwk* keys = (struct jwk*)calloc(JWKS_MAX_KEYS, sizeof(struct jwk));
+    int nkeys = 0, i, ret = JWT_UNVERIFIED;
+    char* jwks;
+    if (!keys)
+        return ret;
+    const struct json_attr_t jwk_attrs[] = {
+        {"kty", t_string, STRUCTOBJECT(struct jwk, kty), .len = sizeof(keys[0].kty)},
+        {"kid", t_string, STRUCTOBJECT(struct jwk, kid), .len = sizeof(keys[0].kid)},
+        {"alg", t_string, STRUCTOBJECT(struct jwk, alg), .len = sizeof(keys[0].alg)},
+        {"use", t_string, STRUCTOBJECT(struct jwk, use), .len = sizeof(keys[0].use)},
+        {"n", t_string, STRUCTOBJECT(struct jwk, n), .len = sizeof(keys[0].n)},
+        {"e", t_string, STRUCTOBJECT(struct jwk, e), .len = sizeof(keys[0].e)},
+        {NULL},
+    };
+    const struct json_attr_t jwks_attrs[] = {
+        {"keys", t_array, .addr.array.element_type = t_structobject,
+                          .addr.array.arr.objects.subtype = jwk_attrs,
+                          .addr.array.arr.objects.base = (char*)keys,
+                          .addr.array.arr.objects.stride = sizeof(struct jwk),
+                          .addr.array.count = &nkeys,
+                          .addr.array.maxlen = JWKS_MAX_KEYS},
+        {NULL},
+    };
+
+    jwks = jwks_get(section);
+    if (!jwks)
+        goto out;
+    i = json_read_object(jwks, jwks_attrs, NULL);
+    free(jwks);
+    if (i) {
+        sys_log(LOG_ERR, "jwks of %s: %s", section->name, json_error_string(i));
+        goto out;
+    }
+    for (i = 0; i < nkeys; i++) {
+        if (strcmp(keys[i].kty, "RSA") || (keys[i].use[0] && strcmp(keys[i].use, "sig")))
+            continue;
+        if (h->kid[0] ? strcmp(keys[i].kid, h->kid) == 0 : nkeys == 1) {
+            *pkey = jwk_public_key(&keys[i]);
+            if (*pkey)
+                ret = JWT_VALID;
+            break;
+        }
+    }
+  out:
+    free(keys);
+    return ret;
+}
+
+static bool audience_ok(const struct mapitem* section, const struct jwt_claims* c)
+{
+    int i;
+    if (!section->audience)
+        return true;
+    if (strcmp(c->aud, section->audience) == 0)
+        return true;
+    for (i = 0; i < c->audcount; i++)
+        if (strcmp(c->audptrs[i], section->audience) == 0)
+            return true;
+    return false;
+}
+
+/*
+ * Verify a JWT access token offline
+ * token: access token
+ * section: mapping section the user logs in through
+ * ui: userinfo filled from the claims when JWT_VALID is returned
+ */
+int jwt_verify(const char* token, const struct mapitem* section, struct userinfo* ui)
+{
+    const char *dot1, *dot2;
+    struct jwt_header h;
+    struct jwt_claims c;
+    char *header = NULL, *payload = NULL;
+    unsigned char* sig = NULL;
+    EVP_PKEY* pkey = NULL;
+    const EVP_MD* md;
+    int siglen, ret = JWT_UNVERIFIED;
+    time_t now = time(NULL);
+    const struct json_attr_t header_attrs[] = {
+        {"alg", t_string, .addr.string = h.alg, .len = sizeof(h.alg)},
+        {"kid", t_string, .addr.string = h.kid, .len = sizeof(h.kid)},
+        {NULL},
+    };
+
+    if (!token || !section || !section->jwks_url || !section->issuer)
+        return JWT_UNVERIFIED;
+    dot1 = strchr(token, '.');
+    dot2 = dot1 ? strchr(dot1 + 1, '.') : NULL;
+    if (!dot2 || strchr(dot2 + 1, '.'))
+        return JWT_UNVERIFIED;    /* opaque token */
+
+    header = segment_decode(token, dot1 - token, NULL);
+    payload = segment_decode(dot1 + 1, dot2 - dot1 - 1, NULL);
+    sig = (unsigned char*)segment_decode(dot2 + 1, strlen(dot2 + 1), &siglen);
+    if (!header || !payload || !sig)
+        goto out;
+    if (json_read_object(header, header_attrs, NULL) || claims_read(payload, &c))
+        goto out;
+    if (!(md = jwt_digest(h.alg))) {
+        if (map_debug > 1)
+            sys_log(LOG_DEBUG, "jwt: unsupported alg '%s'", h.alg);
+        if (strcmp(h.alg, "none") == 0)
+            ret = JWT_INVALID;
+        goto out;
+    }
+    if (jwks_key(section, &h, &pkey) != JWT_VALID)
+        goto out;
+
+    ret = JWT_INVALID;
+    if (!signature_ok(pkey, md, token, dot2 - token, sig, siglen)) {
+        sys_log(LOG_ERR, "jwt: bad signature for section %s", section->name);
+        goto out;
+    }
+    if (strcmp(c.iss, section->issuer)) {
+        sys_log(LOG_ERR, "jwt: issuer %s is not %s", c.iss, section->issuer);
+        goto out;
+    }
+    if (c.exp <= 0 || c.exp + JWT_LEEWAY < now || c.nbf > now + JWT_LEEWAY) {
+        sys_log(LOG_ERR, "jwt: token expired or not yet valid");
+        goto out;
+    }
+    if (!audience_ok(section, &c)) {
+        sys_log(LOG_ERR, "jwt: audience %s not granted", section->audience);
+        goto out;
+    }
+    if (!c.preferred_username[0]) {
+        /* valid, but the claim we map on is only in userinfo */
+        ret = JWT_UNVERIFIED;
+        goto out;
+    }
+    userinfo_init(ui, ui->arena);
+    if (!(ui->sub = arena_strdup(ui->arena, c.sub))
+        || !(ui->name = arena_strdup(ui->arena, c.name))
+        || !(ui->preferred_username = arena_strdup(ui->arena, c.preferred_username))
+        || !(ui->email = arena_strdup(ui->arena, c.email))) {
+        userinfo_init(ui, ui->arena);
+        ret = JWT_UNVERIFIED;
+        goto out;
+    }
+    ret = JWT_VALID;
+    if (map_debug > 1)
+        sys_log(LOG_DEBUG, "jwt: verified offline for section %s", section->name);
+  out:
+    EVP_PKEY_free(pkey);
+    free(header);
+    free(payload);
+    free(sig);
+    return ret;
+}
@@ -0,0 +1,26 @@
+#ifndef PAM_SSH_JWT_H
+#define PAM_SSH_JWT_H
+
+#include <stddef.h>
+#include "pam_ssh_common.h"
+#include "../common/common.h"
+
+/*
+ * Offline verification of JWT access tokens against the JWKS of a
+ * mapping section (jwks_url, issuer and optional audience in
+ * pam_nss.conf).  The JWKS is cached in dbdir and refreshed with a
+ * conditional request at most once per jwks_refresh seconds.
+ */
+
+#define JWT_VALID 0         /* signature and claims verified */
+#define JWT_INVALID 1       /* reject the token */
+#define JWT_UNVERIFIED 2    /* opaque token or no usable key: ask the IAM */
+
+#define JWT_LEEWAY 60       /* seconds of clock skew tolerated on exp/nbf */
+#define JWKS_MAX_KEYS 16
+
+extern int jwt_verify(const char* token, const struct mapitem* section, struct userinfo* ui);
+extern long long jwt_expiry(const char* token);
+extern int base64url_decode(const char* in, size_t len, unsigned char* out);
+
+#endif
@@ -10,7 +10,8 @@ and doesn't support polymorphism; you need to give it a set of
 template structures describing the expected shape of the incoming
 JSON, and it will error out if that shape is not matched.  When the
 parse succeeds, attribute values will be extracted into static
-locations specified in the template structures.
+locations specified in the template structures.  Attributes the
+templates do not describe are skipped, whatever their value.
 
    The "shape" of a JSON object in the type signature of its
 attributes (and attribute values, and so on recursively down through
@@ -74,6 +75,7 @@ PERMISSIONS
 #include <math.h>	/* for HUGE_VAL */
 
 #include "mjson.h"
+#include "jsonscan.h"
 
 #define str_starts_with(s, p)	(strncmp(s, p, strlen(p)) == 0)
 
@@ -169,6 +171,87 @@ static char *json_target_address(const struct json_attr_t *cursor,
     return targetaddr;
 }
 
+/* maximum value length for the attribute a cursor points at */
+static int json_value_maxlen(const struct json_attr_t *cursor, int maxlen)
+{
+    if (cursor->type == t_string)
+	return (int)cursor->len - 1;
+    else if (cursor->type == t_check)
+	return (int)strlen(cursor->dflt.check);
+    else if (cursor->type == t_time || cursor->type == t_ignore)
+	return JSON_VAL_MAX;
+    else if (cursor->map != NULL)
+	return JSON_VAL_MAX;
+    return maxlen;
+}
+
+/* skip the rest of a string, cp is past the opening quote; returns the
+ * closing quote or NULL */
+static const char *json_skip_string(const char *cp)
+{
+    for (;; cp++) {
+	cp = json_scan_string(cp);
+	if (*cp == '\\' && cp[1] != '\0')
+	    cp++;
+	else if (*cp == '"')
+	    return cp;
+	else if (*cp == '\0')
+	    return NULL;
+    }
+}
+
+/* skip any JSON value; returns the first char after it or NULL */
+static const char *json_skip_value(const char *cp)
+{
+    int depth = 0;
+
+    while (isspace((unsigned char) *cp))
+	cp++;
+    do {
+	switch (*cp) {
+	case '\0':
+	    return NULL;
+	case '"':
+	    if ((cp = json_skip_string(cp + 1)) == NULL)
+		return NULL;
+	    cp++;
+	    break;
+	case '{':
+	case '[':
+	    depth++;
+	    cp++;
+	    break;
+	case '}':
+	case ']':
+	    if (--depth < 0)
+		return NULL;
+	    cp++;
+	    break;
+	default:
+	    if (depth == 0) {
+		/* bare token: number, true, false, null */
+		while (*cp != '\0' && *cp != ',' && *cp != '}' && *cp != ']'
+		       && !isspace((unsigned char) *cp))
+		    cp++;
+	    } else
+		/* nothing but strings and brackets matter in there */
+		cp = json_scan_structural(cp);
+	    break;
+	}
+    } while (depth > 0);
+    return cp;
+}
+
+/* skip ':' and the value of an attribute we have no spec for */
+static const char *json_skip_attr_value(const char *cp)
+{
+    while (isspace((unsigned char) *cp))
+	cp++;
+    if (*cp != ':')
+	return NULL;
+    return json_skip_value(cp + 1);
+}
+
 #ifdef TIME_ENABLE
 static double iso8601_to_unix(char *isotime)
 /* ISO8601 UTC to Unix UTC */
@@ -187,6 +270,80 @@ static double iso8601_to_unix(char *isotime)
 }
 #endif /* TIME_ENABLE */
 
+/*
+ * Attribute lookup of one object: an open addressing table keyed by the
+ * length and the outer characters of the name.  Templates usually live
+ * on their caller's stack, so it is built again for each object parsed,
+ * in one pass over the template; templates too large for it are
+ * scanned instead.
+ */
+#define JSON_DISPATCH_SLOTS	64	/* power of 2, at least twice the attributes */
+
+struct json_dispatch {
+    const struct json_attr_t *attrs;
+    bool linear;			/* too many attributes for the table */
+    unsigned char slot[JSON_DISPATCH_SLOTS];	/* attribute index + 1, 0 if free */
+    unsigned char len[JSON_DISPATCH_SLOTS];	/* of its name */
+};
+
+static unsigned json_dispatch_hash(const char *name, size_t len)
+{
+    return (unsigned)(len * 7 + (unsigned char)name[0] * 3
+		      + (unsigned char)name[len - 1]) & (JSON_DISPATCH_SLOTS - 1);
+}
+
+static void json_dispatch_build(struct json_dispatch *d,
+				const struct json_attr_t *attrs)
+{
+    const struct json_attr_t *cursor;
+    unsigned h;
+    size_t len;
+
+    memset(d, 0, sizeof(*d));
+    d->attrs = attrs;
+    for (cursor = attrs; cursor->attribute != NULL; cursor++) {
+	len = strlen(cursor->attribute);
+	if (cursor - attrs >= JSON_DISPATCH_SLOTS / 2 || len == 0 || len > 255) {
+	    d->linear = true;
+	    return;
+	}
+	for (h = json_dispatch_hash(cursor->attribute, len); d->slot[h];
+	     h = (h + 1) & (JSON_DISPATCH_SLOTS - 1))
+	    if (d->len[h] == len
+		&& memcmp(attrs[d->slot[h] - 1].attribute, cursor->attribute, len) == 0)
+		break;
+	/* adjacent specs of the same name are reached from the first */
+	if (!d->slot[h]) {
+	    d->slot[h] = (unsigned char)(cursor - attrs + 1);
+	    d->len[h] = (unsigned char)len;
+	}
+    }
+}
+
+/* the first spec for the name at key, NULL if none */
+static const struct json_attr_t *json_dispatch_find(const struct json_dispatch *d,
+						    const char *key, size_t len)
+{
+    const struct json_attr_t *cursor;
+    unsigned h;
+
+    if (d->linear) {
+	for (cursor = d->attrs; cursor->attribute != NULL; cursor++)
+	    if (strncmp(cursor->attribute, key, len) == 0
+		&& cursor->attribute[len] == '\0')
+		return cursor;
+	return NULL;
+    }
+    if (len == 0 || len > 255)
+	return NULL;
+    for (h = json_dispatch_hash(key, len); d->slot[h];
+	 h = (h + 1) & (JSON_DISPATCH_SLOTS - 1))
+	if (d->len[h] == len
+	    && memcmp(d->attrs[d->slot[h] - 1].attribute, key, len) == 0)
+	    return &d->attrs[d->slot[h] - 1];
+    return NULL;
+}
+
 static int json_internal_read_object(const char *cp,
 				     const struct json_attr_t *attrs,
 				     const struct json_array_t *parent,
@@ -194,16 +351,17 @@ static int json_internal_read_object(const char *cp,
 				     const char **end)
 {
     enum
-    { init, await_attr, in_attr, await_value, in_val_string,
+    { init, await_attr, await_value, in_val_string,
 	in_escape, in_val_token, post_val, post_element
     } state = 0;
 #ifdef DEBUG_ENABLE
     char *statenames[] = {
-	"init", "await_attr", "in_attr", "await_value", "in_val_string",
+	"init", "await_attr", "await_value", "in_val_string",
 	"in_escape", "in_val_token", "post_val", "post_element",
     };
 #endif /* DEBUG_ENABLE */
-    char attrbuf[JSON_ATTR_MAX + 1], *pattr = NULL;
+    struct json_dispatch dispatch;
+    const char *key;
     char valbuf[JSON_VAL_MAX + 1], *pval = NULL;
     bool value_quoted = false;
     char uescape[5];		/* enough space for 4 hex digits and a NUL */
@@ -261,6 +419,8 @@ static int json_internal_read_object(const char *cp,
 		}
 	}
 
+    json_dispatch_build(&dispatch, attrs);
+
     json_debug_trace((1, "JSON parse of '%s' begins.\n", cp));
 
     /* parse input JSON */
@@ -285,10 +445,29 @@ static int json_internal_read_object(const char *cp,
 	    if (isspace((unsigned char) *cp))
 		continue;
 	    else if (*cp == '"') {
-		state = in_attr;
-		pattr = attrbuf;
 		if (end != NULL)
 		    *end = cp;
+		/* the name is looked up where it is, not copied */
+		key = cp + 1;
+		if ((cp = json_skip_string(key)) == NULL)
+		    return JSON_ERR_BADATTR;
+		cursor = json_dispatch_find(&dispatch, key, (size_t)(cp - key));
+		if (cursor == NULL) {
+		    json_debug_trace((1, "Unknown attribute name '%.*s',"
+				      " skipping it.\n", (int)(cp - key), key));
+		    /* providers add claims at will, they must not break us */
+		    if ((cp = json_skip_attr_value(cp + 1)) == NULL)
+			/* don't update end here, leave at attribute start */
+			return JSON_ERR_BADATTR;
+		    --cp;
+		    state = post_element;
+		    break;
+		}
+		json_debug_trace((1, "Collected attribute name %s\n",
+				  cursor->attribute));
+		state = await_value;
+		maxlen = json_value_maxlen(cursor, maxlen);
+		pval = valbuf;
 	    } else if (*cp == '}')
 		break;
 	    else {
@@ -298,49 +477,29 @@ static int json_internal_read_object(const char *cp,
 		return JSON_ERR_ATTRSTART;
 	    }
 	    break;
-	case in_attr:
-	    if (pattr == NULL)
-		/* don't update end here, leave at attribute start */
-		return JSON_ERR_NULLPTR;
-	    if (*cp == '"') {
-		*pattr++ = '\0';
-		json_debug_trace((1, "Collected attribute name %s\n",
-				  attrbuf));
-		for (cursor = attrs; cursor->attribute != NULL; cursor++) {
-		    json_debug_trace((2, "Checking against %s\n",
-				      cursor->attribute));
-		    if (strcmp(cursor->attribute, attrbuf) == 0)
-			break;
-		}
-		if (cursor->attribute == NULL) {
-		    json_debug_trace((1,
-				      "Unknown attribute name '%s'"
-                                      " (attributes begin with '%s').\n",
-				      attrbuf, attrs->attribute));
-		    /* don't update end here, leave at attribute start */
-		    return JSON_ERR_BADATTR;
-		}
-		state = await_value;
-		if (cursor->type == t_string)
-		    maxlen = (int)cursor->len - 1;
-		else if (cursor->type == t_check)
-		    maxlen = (int)strlen(cursor->dflt.check);
-		else if (cursor->type == t_time || cursor->type == t_ignore)
-		    maxlen = JSON_VAL_MAX;
-		else if (cursor->map != NULL)
-		    maxlen = (int)sizeof(valbuf) - 1;
-		pval = valbuf;
-	    } else if (pattr >= attrbuf + JSON_ATTR_MAX - 1) {
-		json_debug_trace((1, "Attribute name too long.\n"));
-		/* don't update end here, leave at attribute start */
-		return JSON_ERR_ATTRLEN;
-	    } else
-		*pattr++ = *cp;
-	    break;
 	case await_value:
 	    if (isspace((unsigned char) *cp) || *cp == ':')
 		continue;
-	    else if (*cp == '[') {
+	    /*
+	     * Adjacent specs may share a name for values of different
+	     * shape (e.g. a claim that is either a string or an array);
+	     * pick the one matching what we are looking at.
+	     */
+	    while (cursor[1].attribute != NULL
+		   && strcmp(cursor[1].attribute, cursor->attribute) == 0
+		   && ((*cp == '[') != (cursor->type == t_array)
+		       || (*cp == '{') != (cursor->type == t_object))) {
+		++cursor;
+		maxlen = json_value_maxlen(cursor, maxlen);
+	    }
+	    if (cursor->type == t_ignore) {
+		if ((cp = json_skip_value(cp)) == NULL) {
+		    json_debug_trace((1, "Bad value syntax.\n"));
+		    return JSON_ERR_BADTRAIL;
+		}
+		--cp;
+		state = post_element;
+	    } else if (*cp == '[') {
 		if (cursor->type != t_array) {
 		    json_debug_trace((1,
 				      "Saw [ when not expecting array.\n"));
@@ -397,13 +556,20 @@ static int json_internal_read_object(const char *cp,
 		*pval++ = '\0';
 		json_debug_trace((1, "Collected string value %s\n", valbuf));
 		state = post_val;
-	    } else if (pval > valbuf + JSON_VAL_MAX - 1
-		       || pval > valbuf + maxlen) {
-		json_debug_trace((1, "String value too long.\n"));
-		/* don't update end here, leave at value start */
-		return JSON_ERR_STRLONG;	/*  */
-	    } else
-		*pval++ = *cp;
+	    } else {
+		/* copy the run up to the next quote or escape at once */
+		const char *stop = json_scan_string(cp);
+		int room = (maxlen < JSON_VAL_MAX - 1 ? maxlen : JSON_VAL_MAX - 1)
+		    - (int)(pval - valbuf) + 1;
+		if (stop - cp > room) {
+		    json_debug_trace((1, "String value too long.\n"));
+		    /* don't update end here, leave at value start */
+		    return JSON_ERR_STRLONG;	/*  */
+		}
+		memcpy(pval, cp, (size_t)(stop - cp));
+		pval += stop - cp;
+		cp = stop - 1;
+	    }
 	    break;
 	case in_escape:
 	    if (pval == NULL)
@@ -493,7 +659,7 @@ static int json_internal_read_object(const char *cp,
 		}
 		if (cursor[1].attribute==NULL)	/* out of possiblities */
 		    break;
-		if (strcmp(cursor[1].attribute, attrbuf)!=0)
+		if (strcmp(cursor[1].attribute, cursor->attribute)!=0)
 		    break;
 		++cursor;
 	    }
@@ -604,7 +770,7 @@ static int json_internal_read_object(const char *cp,
 		    break;
 		}
 	    #if defined(__GNUC__) && __GNUC__ >= 7
- 			__attribute__ ((fallthrough))
+ 			__attribute__ ((fallthrough));
 		#else
  			((void)0);
 		#endif /* __GNUC__ >= 7 */
@@ -669,29 +835,32 @@ int json_read_array(const char *cp, const struct json_array_t *arr,
 	json_debug_trace((1, "Looking at %s\n", cp));
 	switch (arr->element_type) {
 	case t_string:
-	    if (isspace((unsigned char) *cp))
+	    while (isspace((unsigned char) *cp))
 		cp++;
 	    if (*cp != '"')
 		return JSON_ERR_BADSTRING;
 	    else
 		++cp;
 	    arr->arr.strings.ptrs[offset] = tp;
-	    for (; tp - arr->arr.strings.store < arr->arr.strings.storelen;
-		 tp++)
-		if (*cp == '"') {
-		    ++cp;
-		    *tp++ = '\0';
-		    goto stringend;
-		} else if (*cp == '\0') {
+	    for (;;) {
+		/* runs up to the closing quote; backslashes are kept as is */
+		const char *stop = json_scan_string(cp);
+		long run = (long)(stop - cp) + (*stop == '\\');
+		if (*stop == '\0'
+		    || run >= arr->arr.strings.storelen - (tp - arr->arr.strings.store)) {
 		    json_debug_trace((1,
 				      "Bad string syntax in string list.\n"));
 		    return JSON_ERR_BADSTRING;
-		} else {
-		    *tp = *cp++;
 		}
-	    json_debug_trace((1, "Bad string syntax in string list.\n"));
-	    return JSON_ERR_BADSTRING;
-	  stringend:
+		memcpy(tp, cp, (size_t)run);
+		tp += run;
+		cp += run;
+		if (*stop == '"') {
+		    ++cp;
+		    *tp++ = '\0';
+		    break;
+		}
+	    }
 	    break;
 	case t_object:
 	case t_structobject:
@@ -775,7 +944,7 @@ int json_read_array(const char *cp, const struct json_array_t *arr,
 	    return JSON_ERR_SUBTYPE;
 	}
 	arrcount++;
-	if (isspace((unsigned char) *cp))
+	while (isspace((unsigned char) *cp))
 	    cp++;
 	if (*cp == ']') {
 	    json_debug_trace((1, "End of array found.\n"));
@@ -19,78 +19,115 @@
 #include <errno.h>
 #include "mjson.h"
 #include "pam_ssh_common.h"
+#include "http.h"
+#include "broker.h"
+#include "cache.h"
+#include "userinfo.h"
+#include "jwt.h"
 #include "../common/common.h"
 
 #if !CURL_AT_LEAST_VERSION(7, 62, 0)
 #error "This library requires curl 7.62.0 or later"
 #endif
 
-/*
-* note: libcurl has to be compiled & build with --with-ssl version enabled!
-*/
-
 /*
  setcap or sudo needed for pam_test
 https://unix.stackexchange.com/questions/318625/how-to-grant-a-user-rights-to-change-ownership-of-files-directories-in-a-directo
 */
 
-/* the function to invoke as the data recieved */
-size_t static callback_func(void *buffer,
-                        size_t size,
-                        size_t nmemb,
-                        void *userp)
-{
-    char **resp =  (char**)userp;
-    /* assuming the response is a string */
-    *resp = strndup(buffer, (size_t)(size *nmemb));
-    return size * nmemb;
-}
 
-
-static
-int my_trace(CURL *handle, curl_infotype type,
-             char *data, size_t size,
-             void *userp) {
-    const char *text;
-    (void)handle; /* prevent compiler warning */
-    (void)userp;
-   
-
-    switch (type) {
-        case CURLINFO_TEXT:
-            sys_log(LOG_DEBUG, "== Info: %s", data);
-        default: /* in case a new one is introduced to shock us */
-            return 0;
- 
-        case CURLINFO_HEADER_OUT:
-            text = "=> Send header";
-            break;
-        case CURLINFO_DATA_OUT:
-            text = "=> Send data";
-            break;
-        case CURLINFO_SSL_DATA_OUT:
-            text = "=> Send SSL data";
-            break;
-        case CURLINFO_HEADER_IN:
-            text = "<= Recv header";
-            break;
-        case CURLINFO_DATA_IN:
-            text = "<= Recv data";
-            break;
-        case CURLINFO_SSL_DATA_IN:
-            text = "<= Recv SSL data";
-            break;
-    }
-  return 0;
+/*
+ * sshd loads the module before forking a child per connection.  With
+ * warmup = true in pam_nss.conf the configuration is read here so the
+ * children inherit it, and libcurl, the CA bundle and the resolver are
+ * prepared as well; otherwise loading the module does nothing.
+ * pam_ssh.so never starts the watcher thread, watch_config or not: it
+ * is unloaded at pam_end() while the thread would keep running its
+ * code, and a login does not live long enough to need it.
+ */
+__attribute__((constructor))
+static void pam_ssh_warmup(void)
+{
+    int errnop = 0;
+    struct map_snapshot *snap;
+    map_start_watch = false;
+    if (!map_warmup_enabled() || map_init_common(&errnop, pam_ssh))
+        return;
+    snap = map_acquire();
+    if (snap && snap->settings.warmup)
+        http_warmup(snap);
+    map_release(snap);
 }
 
-
 // expected hook
 PAM_EXTERN int pam_sm_setcred( pam_handle_t *pamh, int flags, int argc, const char **argv ) {
     return PAM_SUCCESS ;
 }
 
 
+/* what authenticate_any() looks for in the userinfo responses */
+struct any_user {
+    const char* username;
+    struct userinfo* ui;
+};
+
+static bool any_user_accept(const char* response, void* arg)
+{
+    struct any_user* u = (struct any_user*)arg;
+    struct userinfo_stream stream;
+    userinfo_stream_init(&stream, u->ui, USERINFO_USERNAME);
+    userinfo_stream_feed(&stream, response, strlen(response));
+    return userinfo_stream_done(&stream)
+        && strcmp(u->ui->preferred_username, u->username) == 0;
+}
+
+/* userinfo_stream_feed() for http_buffer */
+static bool userinfo_feed(void* stream, const char* data, size_t len)
+{
+    return userinfo_stream_feed((struct userinfo_stream*)stream, data, len);
+}
+
+/*
+ * Validate the token of an unqualified username mapped in several
+ * sections (parallel_auth): local checks first, then the userinfo
+ * endpoints of the remaining sections at once.  The first one naming
+ * the user as preferred_username wins.
+ */
+static bool authenticate_any(const struct map_snapshot* snap, struct mapitem** candidates, int n,
+                             const char* username, const char* input, struct userinfo* ui)
+{
+    const char* urls[MAX_CANDIDATES];
+    int timeouts[MAX_CANDIDATES];
+    struct mapitem* remote[MAX_CANDIDATES];
+    struct any_user u = { username, ui };
+    struct http_buffer response = { NULL, 0, 0, 0 };
+    int i, nremote = 0, winner;
+
+    for (i = 0; i < n; i++) {
+        int verdict = jwt_verify(input, candidates[i], ui);
+        if (verdict == JWT_VALID && strcmp(ui->preferred_username, username) == 0)
+            return true;
+        if (verdict != JWT_UNVERIFIED)
+            continue;
+        if (token_cache_get(candidates[i]->name, input, ui, snap->settings.cache_ttl)
+            && strcmp(ui->preferred_username, username) == 0)
+            return true;
+        // no url of the section parsed
+        if (!candidates[i]->nurls)
+            continue;
+        remote[nremote] = candidates[i];
+        timeouts[nremote] = candidates[i]->timeout;
+        urls[nremote++] = http_endpoint_pick(candidates[i]->urls, candidates[i]->nurls);
+    }
+    winner = http_auth_any(input, urls, timeouts, nremote, any_user_accept, &u, &response);
+    http_buffer_free(&response);
+    if (winner < 0)
+        return false;
+    sys_log(LOG_DEBUG, "token accepted by section %s", remote[winner]->name);
+    token_cache_put(remote[winner]->name, input, ui, snap->settings.cache_ttl);
+    return true;
+}
+
 // this function is ripped from pam_unix/support.c, it lets us do IO via PAM
 int converse( pam_handle_t *pamh, int nargs, struct pam_message **message, struct pam_response **response ) {
     int retval ;
@@ -105,89 +142,25 @@ int converse( pam_handle_t *pamh, int nargs, struct pam_message **message, struc
 }
 
 
-/*
- * Authenticate with user token to IAM
- * input: input token
- * host_endpoint: where to authenticate
- * response: output response
- * err: error if occures, NULL otherwise
- */
-
-static long http_auth(const char* input, const char* host_endpoint, char** response, char** err){
-    // HTTP request to service that will dispatch the code
-    CURL *curl ;
-    struct curl_slist *headers = NULL;
-    CURLcode res = CURLE_COULDNT_CONNECT;
-    char error[CURL_ERROR_SIZE];
-    char* resp = NULL;
-    long http_code = 404;
-    int cnt;
-    curl = curl_easy_init() ;
-    if (curl) {
-        int len = strlen(AUTH_BEARER) + strlen(input) + 1; 
-        char auth_bearer[len] ;
-        //strcpy(auth_bearer, AUTH_BEARER);
-        //strcat(auth_bearer, input) ;
-        cnt = snprintf(auth_bearer, len, "%s%s", AUTH_BEARER, input );
-        if (cnt < 1) return http_code;
-        headers = curl_slist_append( headers, auth_bearer);
-        curl_easy_setopt(curl, CURLOPT_URL, host_endpoint) ;
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L );
-        curl_easy_setopt(curl, CURLOPT_FAILONERROR, true);
-        curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, my_trace);
-        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback_func);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp);
-        error[0] = 0;
-        res = curl_easy_perform(curl);
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-        curl_easy_cleanup(curl);
-    }
-//    sys_log(LOG_DEBUG, "response: %s", resp);
-//    sys_log(LOG_DEBUG, "error: %s", error);
-    if (resp){
-            if (*response){            
-            if (strlen(resp) != strlen(*response))
-                *response = realloc(*response, sizeof(char) * (strlen(resp) + 1));
-            cnt = snprintf(*response, strlen(resp) + 1, "%s", resp);
-            if (cnt < 1) 
-                return http_code;
-        } else
-            *response = strdup(resp);
-    }
-    if (error){
-        if (*err){
-            if (CURL_ERROR_SIZE != strlen(*err))
-                *err = realloc(*err, sizeof(char) * (CURL_ERROR_SIZE + 1));                
-            cnt = snprintf(*err, CURL_ERROR_SIZE + 1, "%s", error);
-            if (cnt < 1)
-                return http_code;
-        } else
-            *err = strdup(error);
-    }
-    sys_log(LOG_DEBUG, "response: %s", *response);
-    sys_log(LOG_DEBUG, "err: %s", *err);
-    if (headers)
-        free(headers);
-    if (resp)
-        free(resp);
-    return http_code;
-}
-
 // expected hook, this is where custom stuff happens
 PAM_EXTERN int pam_sm_authenticate( pam_handle_t *pamh, int flags, int argc, const char **argv ) {
     int retval ;
     int i ;
     const char *provided_username;
-    char *user_location = NULL;
-    char *user_endpoint = NULL;
-    char *user_url = NULL;
-    char* host_endpoint = NULL;
-    char *host_url = NULL;
+    const char *user, *location;
+    size_t user_len, location_len;
+    const char* host_endpoint = NULL;
     char *username = NULL;
     int status = PAM_AUTH_ERR;
     char *input = NULL;
+    struct map_snapshot *snap = NULL;
+    struct mapitem *mapped_item = NULL;
+    struct mapitem *candidates[MAX_CANDIDATES];
+    int ncandidates = 0;
+    struct http_prewarm *prewarm = NULL;
+    // what this call parses and reads lives here, on the stack unless it is large
+    char arena_buf[ARENA_BLOCK];
+    struct arena arena;
     
     struct pam_message msg[1], *pmsg[1];
     struct pam_response *resp;
@@ -196,9 +169,10 @@ PAM_EXTERN int pam_sm_authenticate( pam_handle_t *pamh, int flags, int argc, con
     // retrieving parameters
     char pam_nss_conf[BUF_SIZE];    
 
-    char* error = (char*)calloc(CURL_ERROR_SIZE, sizeof(char));
-    char* response = NULL;//(char*)calloc(10, sizeof(char));
+    char error[CURL_ERROR_SIZE] = "";
+    struct http_buffer response = { NULL, 0, 0, 0 };
 
+    arena_init(&arena, arena_buf, sizeof arena_buf);
     
     //sys_log(LOG_DEBUG, "argc: %d", argc );
 
@@ -211,17 +185,18 @@ PAM_EXTERN int pam_sm_authenticate( pam_handle_t *pamh, int flags, int argc, con
     } else
         return PAM_AUTH_ERR;
 
-    if (!mapped_users){
-        int map_ret = map_init_common(&errnop, pam_ssh);
-        if (map_ret){        
-            if (errnop == ENOENT){
-                //reset_config();
-                //return PAM_AUTH_ERR;
-                goto error;
-            }
-        }    
-    }
-    if (!mapped_users) {
+    // the parsed configuration is kept across calls, this only re-reads a changed file
+    int map_ret = map_init_common(&errnop, pam_ssh);
+    if (map_ret){        
+        if (errnop == ENOENT){
+            //reset_config();
+            //return PAM_AUTH_ERR;
+            goto error;
+        }
+    }    
+    // the configuration stays the same for this call even if reloaded meanwhile
+    snap = map_acquire();
+    if (!snap || !snap->users) {
         goto error;
     }
     if ((retval = pam_get_item( pamh, PAM_USER, (const void **)& provided_username)) != PAM_SUCCESS) {
@@ -231,55 +206,51 @@ PAM_EXTERN int pam_sm_authenticate( pam_handle_t *pamh, int flags, int argc, con
 
     if (!provided_username)
         goto error;
-    username = strdup(provided_username);
-    user_location = strdup(provided_username);
-
-    if (traverse_username(provided_username, &username, &user_location)){
-        sys_log(LOG_DEBUG, "username: %s", username);    
-        sys_log(LOG_DEBUG, "user_location: %s", user_location);
-        if (user_location){            
-            // PAM has to fetch URL from NSS config...
-            user_endpoint = map_get_url_for_location(user_location);            
-        } else    {
-            user_endpoint = map_get_mapped_user(username, USED_IN_PAM);
-        }
-        //sys_log(LOG_DEBUG, "user_endpoint: %s", user_endpoint);
-        if (!user_endpoint) 
-            goto error;
-        user_url = strdup(user_endpoint);
-        if (!traverse_url(user_endpoint, &user_url)){
-            if (user_endpoint)
-                free(user_endpoint);
+    // user@location is looked at in place, only the parts are copied into the arena
+    if (!split_username(provided_username, &user, &user_len, &location, &location_len)
+        || !(username = arena_strndup(&arena, user, user_len)))
+        goto error;
+    sys_log(LOG_DEBUG, "username: %s", username);
+    sys_log(LOG_DEBUG, "user_location: %.*s", (int)location_len, location);
+    // location is empty for unqualified names
+    if (location_len) {
+        char *section = arena_strndup(&arena, location, location_len);
+        if (section)
+            mapped_item = (struct mapitem*)map_get_key(section, snap->users);
+    } else {
+        ncandidates = map_sections_for_user(snap, username, candidates, MAX_CANDIDATES);
+        if (ncandidates == 1)
+            mapped_item = candidates[0];
+        else if (ncandidates > MAX_CANDIDATES || (ncandidates > 1 && !snap->settings.parallel_auth)) {
+            sys_log(LOG_ERR, "%s is mapped in %d sections, log in as %s@<section>",
+                    username, ncandidates, username);
             goto error;
         }
-    } else 
-           goto error;
-
-    struct mapitem* mapped_item = (struct mapitem*)map_get_key(user_location, mapped_users);
-    if (user_location)
-           free(user_location);
-    if (!mapped_item)
-           goto error;
-       
-    host_endpoint = strdup(mapped_item->url);
-    if (!host_endpoint)
-        goto error;        
-    host_url = strdup(mapped_item->url);
-    if (!traverse_url(host_endpoint, &host_url)){
-        if (host_url){
-            free(host_endpoint);
-            free(host_url);
-        }            
-        goto error;
     }
-    if (!host_url)
+    if (!mapped_item && ncandidates < 2)
         goto error;
-    if (strcmp(user_url, host_url) != 0) 
+    if (!mapped_item)
+        goto ask_token;
+
+    // the endpoints of a section are equivalent, any of them may be used; those that
+    // did not parse were left out at load
+    if (!mapped_item->nurls) {
+        sys_log(LOG_ERR, "section %s has no usable url", mapped_item->name);
         goto error;
-    sys_log(LOG_DEBUG,"Free user_url");
-    if (user_url)
-        free(user_url);
-    sys_log(LOG_DEBUG,"user_url freed");
+    }
+    host_endpoint = http_endpoint_pick(mapped_item->urls, mapped_item->nurls);
+ask_token:
+    // connect to the IAM while the token is typed, pam_ssh_broker has its connections open
+    if (snap->settings.prewarm && !mapped_item) {
+        const char *urls[MAX_CANDIDATES];
+        int nurls = 0;
+        for (i = 0; i < ncandidates; i++)
+            if (candidates[i]->nurls)
+                urls[nurls++] = http_endpoint_pick(candidates[i]->urls, candidates[i]->nurls);
+        prewarm = http_prewarm_start(urls, nurls);
+    } else if (snap->settings.prewarm
+               && !broker_present(snap->settings.broker_socket ? snap->settings.broker_socket : BROKER_SOCKET))
+        prewarm = http_prewarm_start((const char* const*)&host_endpoint, 1);
     // setting up conversation call prompting for one-time code
     pmsg[0] = &msg[0] ;
     msg[0].msg_style = PAM_PROMPT_ECHO_ON ;
@@ -304,85 +275,104 @@ PAM_EXTERN int pam_sm_authenticate( pam_handle_t *pamh, int flags, int argc, con
         }
         input = resp[0].resp;        
         resp[0].resp = NULL; 
-        if (strstr(input, INCORRECT))
+        free(resp);
+        if (!input || strstr(input, INCORRECT))
             goto error;
     } else
         goto error;
     sys_log(LOG_DEBUG, "Token provided");
 
-    // authenticate with token (input)
-    long http_code = http_auth(input, host_endpoint, &response, &error);    
+    struct userinfo my_info;
+    userinfo_init(&my_info, &arena);
+    int verdict = JWT_INVALID;
+    int flight = -1, outcome = FLIGHT_LEAD;
+    bool validated = false;
+    if (!mapped_item) {
+        http_prewarm_finish(prewarm, false);
+        prewarm = NULL;
+        validated = authenticate_any(snap, candidates, ncandidates, username, input, &my_info);
+    }
+    else {
+        // fetching the JWKS must not share the connection cache with the prewarm thread
+        if (mapped_item->jwks_url) {
+            http_prewarm_finish(prewarm, false);
+            prewarm = NULL;
+        }
+        // JWT access tokens of sections with a JWKS are checked locally, others go to the IAM
+        if ((verdict = jwt_verify(input, mapped_item, &my_info)) == JWT_VALID)
+            validated = true;
+    }
+    if (verdict == JWT_UNVERIFIED)
+        validated = token_cache_get(mapped_item->name, input, &my_info, snap->settings.cache_ttl);
+    // a prewarmed connection is only waited for when it is going to be used
+    http_prewarm_finish(prewarm, verdict != JWT_UNVERIFIED || validated);
+    prewarm = NULL;
+    if (verdict == JWT_UNVERIFIED && !validated) {
+        // of concurrent logins with the same token one asks the IAM, the others wait for it
+        outcome = token_flight_join(mapped_item->name, input, &my_info, &flight);
+        if (outcome == FLIGHT_VALID)
+            validated = true;
+        else if (outcome == FLIGHT_REJECTED)
+            sys_log(LOG_ERR, "token rejected by the IAM for a concurrent login");
+    }
+    if (verdict == JWT_UNVERIFIED && !validated && outcome == FLIGHT_LEAD) {
+        // the userinfo is read while it arrives, up to preferred_username
+        struct userinfo_stream stream;
+        userinfo_stream_init(&stream, &my_info, USERINFO_USERNAME);
+        response.feed = userinfo_feed;
+        response.feed_arg = &stream;
+        // authenticate with token (input), through pam_ssh_broker when it runs
+        long http_code = broker_auth(snap->settings.broker_socket ? snap->settings.broker_socket : BROKER_SOCKET,
+                                     mapped_item->name, input, &response);
+        if (http_code < 0) {
+            // the broker may have failed in the middle of a body
+            if (response.fed)
+                userinfo_stream_init(&stream, &my_info, USERINFO_USERNAME);
+            http_code = http_auth(input, mapped_item->urls, mapped_item->nurls, mapped_item->timeout,
+                                  &response, error);
+        }
 
-    // Check HTTP auth code
-    if (http_code < 200 || http_code >= 300) {
-        sys_log(LOG_ERR, "HTTP request failed: error code %ld (%s)", http_code, error);
-    } else {        
-        struct userinfo my_info;
-           // Call object parsing function
-        
-    if (json_userinfo_read(response, &my_info) == 0) {
-            sys_log(LOG_DEBUG,"Username from OpenID provider: %s", my_info.name);
-            sys_log(LOG_DEBUG,"OpenID preferred_username: %s", my_info.preferred_username);
-            sys_log(LOG_DEBUG,"Username: %s", username);
-            status = (strcmp(username, my_info.preferred_username) == 0)? PAM_SUCCESS: PAM_AUTH_ERR;                
+        // Check HTTP auth code
+        if (http_code < 200 || http_code >= 300) {
+            sys_log(LOG_ERR, "HTTP request failed: error code %ld (%s)", http_code, error);
+            // the IAM itself refused the token; 0, 404 or 5xx may just mean no answer
+            if (http_code == 401 || http_code == 403)
+                outcome = FLIGHT_REJECTED;
+        } else {
+            // bodies from the broker or a hedged request were not fed as they arrived
+            if (!response.fed)
+                userinfo_stream_feed(&stream, response.data, response.len);
+            if (userinfo_stream_done(&stream)) {
+                validated = true;
+                outcome = FLIGHT_VALID;
+                token_cache_put(mapped_item->name, input, &my_info, snap->settings.cache_ttl);
+            }
         }
+        token_flight_done(flight, mapped_item->name, input, outcome, &my_info);
+    }
+    if (validated) {
+        sys_log(LOG_DEBUG,"Username from OpenID provider: %s", my_info.name);
+        sys_log(LOG_DEBUG,"OpenID preferred_username: %s", my_info.preferred_username);
+        sys_log(LOG_DEBUG,"Username: %s", username);
+        status = (strcmp(username, my_info.preferred_username) == 0)? PAM_SUCCESS: PAM_AUTH_ERR;
     }
-    // Free HTTP call response structures
-    if (map_debug > 2)
-        sys_log(LOG_ERR, "free response");
-    if (response)
-        free(response);
-    
-    if (map_debug > 2)
-        sys_log(LOG_ERR, "free error");
-    if (error)
-        free(error);
-
-    // Free input when talking to PAM module
-    if (map_debug > 2)
-        sys_log(LOG_ERR, "free input");
-    if (input)
-        free(input);
-    
-    if (map_debug > 2)
-        sys_log(LOG_ERR, "free host_endpoint");
-    if (host_endpoint) 
-        free(host_endpoint);
-    
-    if (map_debug > 2)
-        sys_log(LOG_ERR, "free host_url");
-    if (host_url)
-        free(host_url);
-    
     error:
+        // Free HTTP call response structures
         if (map_debug > 2)
-            sys_log(LOG_ERR, "free username");
-        if (username)
-            free(username);
-        
-        if (map_debug > 2)
-            sys_log(LOG_ERR, "free user_location");
-        if (user_location)
-            free(user_location);
-        
-        if (map_debug > 2)
-            sys_log(LOG_ERR, "free user_url");
-        if (user_url)
-            free(user_url);
-        
-        if (map_debug > 2)
-            sys_log(LOG_ERR, "free mapped_users");
-        if (mapped_users)
-            map_close(&mapped_users);
+            sys_log(LOG_ERR, "free response");
+        http_buffer_free(&response);
+
+        // Free input when talking to PAM module
         if (map_debug > 2)
-             sys_log(LOG_ERR, "free mapped_users OK; %d", mapped_users!= NULL? 1:0);
+            sys_log(LOG_ERR, "free input");
+        if (input)
+            free(input);
+
+        http_prewarm_finish(prewarm, true);
+        // username, location and the claims go with the arena
+        arena_free(&arena);
+        map_release(snap);
         
-        if (map_debug > 2)
-            sys_log(LOG_ERR, "free excluded_users");
-        if (excluded_users) 
-            list_close(&excluded_users);
-        if (map_debug > 2)
-            sys_log(LOG_ERR, "free excluded_users OK; %d", excluded_users!= NULL? 1:0);
     if (map_debug > 1)
         sys_log(LOG_ERR, "Returning %d", status);
     return status;
@@ -0,0 +1,306 @@
+/*******************************************************************************
+ * file:        pam_ssh_broker.c
+ * description: local authentication broker for pam_ssh.so
+ * notes:       keeps warm keep-alive (HTTP/2 where available) connections
+ *              to the IAM userinfo endpoint of every mapping section, so
+ *              logins do not pay a DNS + TCP + TLS handshake each.
+ *              pam_ssh.so falls back to its own http_auth() when the
+ *              broker is not running.
+*******************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <syslog.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <curl/curl.h>
+#include "http.h"
+#include "broker.h"
+#include "../common/common.h"
+
+#define POOL_SIZE 8    /* idle handles (and so live connections) kept per url */
+
+static const char *brokername = "PAM-SSH-BROKER";  /* for syslogs */
+
+/* idle curl handles for one IAM url, with the response buffer each last used */
+struct pool {
+    char* url;
+    CURL* handles[POOL_SIZE];
+    struct http_buffer buffers[POOL_SIZE];
+    int nfree;
+    struct pool* next;
+};
+
+static struct pool* pools = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * DNS and TLS sessions are shared by all handles.  Connections are not:
+ * libcurl does not support sharing them between concurrent threads, so
+ * each pooled handle keeps its own.
+ */
+static CURLSH* share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp)
+{
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userp)
+{
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+static CURL* pool_get(const char* url, struct http_buffer* buffer)
+{
+    struct pool* p;
+    CURL* curl = NULL;
+    pthread_mutex_lock(&pool_lock);
+    for (p = pools; p; p = p->next)
+        if (strcmp(p->url, url) == 0)
+            break;
+    if (p && p->nfree > 0) {
+        curl = p->handles[--p->nfree];
+        *buffer = p->buffers[p->nfree];
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (curl)
+        return curl;
+
+    curl = curl_easy_init();
+    if (!curl)
+        return NULL;
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    return curl;
+}
+
+static void pool_put(const char* url, CURL* curl, struct http_buffer* buffer)
+{
+    struct pool* p;
+    pthread_mutex_lock(&pool_lock);
+    for (p = pools; p; p = p->next)
+        if (strcmp(p->url, url) == 0)
+            break;
+    if (!p && (p = (struct pool*)calloc(1, sizeof *p))) {
+        p->url = strdup(url);
+        p->next = pools;
+        pools = p;
+    }
+    if (p && p->url && p->nfree < POOL_SIZE) {
+        p->buffers[p->nfree] = *buffer;
+        p->handles[p->nfree++] = curl;
+        curl = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (curl) {
+        curl_easy_cleanup(curl);
+        http_buffer_free(buffer);
+    }
+}
+
+/*
+ * url of a mapping section from the current configuration, to be freed,
+ * and its request budget
+ */
+static char* section_url(const char* section, int* timeout)
+{
+    int errnop = 0;
+    char* url = NULL;
+    if (!map_init_common(&errnop, brokername)) {
+        struct map_snapshot* snap = map_acquire();
+        struct mapitem* item = (snap && snap->users)
+            ? (struct mapitem*)map_get_key(section, snap->users) : NULL;
+        if (item && item->nurls) {
+            /* a pool per endpoint, the best one of the section is used */
+            url = strdup(http_endpoint_pick(item->urls, item->nurls));
+            *timeout = item->timeout;
+        }
+        map_release(snap);
+    }
+    return url;
+}
+
+static void reply(int fd, long http_code, const char* body, size_t len)
+{
+    struct broker_reply rep;
+    rep.magic = BROKER_MAGIC;
+    rep.http_code = (int32_t)http_code;
+    rep.body_len = body ? len : 0;
+    if (rep.body_len > BROKER_MAX_BODY)
+        rep.body_len = 0;
+    if (broker_write_full(fd, &rep, sizeof rep) < 0)
+        return;
+    if (rep.body_len)
+        broker_write_full(fd, body, rep.body_len);
+}
+
+static void* serve(void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+    struct broker_request req;
+    struct ucred cred;
+    socklen_t credlen = sizeof cred;
+    char section[BROKER_MAX_SECTION + 1];
+    char* token = NULL;
+    char* url = NULL;
+    struct http_buffer response = { NULL, 0, 0, 0 };
+    long http_code = 0;     /* no answer, pam_ssh asks the IAM itself */
+    int timeout = 0;
+    CURL* curl;
+
+    /* only root (sshd) may have tokens validated on its behalf */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0
+        || cred.uid != 0) {
+        sys_log(LOG_ERR, "%s: rejected client", brokername);
+        goto done;
+    }
+    if (broker_read_full(fd, &req, sizeof req) < 0 || req.magic != BROKER_MAGIC
+        || req.section_len > BROKER_MAX_SECTION || req.token_len > BROKER_MAX_TOKEN)
+        goto done;
+    token = (char*)malloc(req.token_len + 1);
+    if (!token || broker_read_full(fd, section, req.section_len) < 0
+        || broker_read_full(fd, token, req.token_len) < 0)
+        goto done;
+    section[req.section_len] = '\0';
+    token[req.token_len] = '\0';
+
+    url = section_url(section, &timeout);
+    if (!url) {
+        sys_log(LOG_ERR, "%s: unknown mapping section '%s'", brokername, section);
+        reply(fd, 0, NULL, 0);
+        goto done;
+    }
+    curl = pool_get(url, &response);
+    if (curl) {
+        http_code = http_auth_handle(curl, token, url, timeout, &response, NULL);
+        /* the IAM did not answer: asking it again from pam_ssh would not help */
+        reply(fd, http_code ? http_code : 503, response.data, response.len);
+        /* the buffer goes back with the handle for the next request */
+        pool_put(url, curl, &response);
+    } else
+        reply(fd, http_code, NULL, 0);
+
+  done:
+    if (token) {
+        explicit_bzero(token, req.token_len);
+        free(token);
+    }
+    free(url);
+    close(fd);
+    return NULL;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-f] [-s socket]\n"
+                    "  -f         stay in foreground\n"
+                    "  -s socket  listen on socket (default: broker_socket"
+                    " from pam_nss.conf or %s)\n", prog, BROKER_SOCKET);
+}
+
+int main(int argc, char** argv)
+{
+    const char* socket_path = NULL;
+    struct sockaddr_un addr;
+    bool foreground = false;
+    int errnop = 0;
+    int opt, fd, i;
+
+    while ((opt = getopt(argc, argv, "fs:h")) != -1) {
+        switch (opt) {
+            case 'f':
+                foreground = true;
+                break;
+            case 's':
+                socket_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (map_init_common(&errnop, brokername))
+        fprintf(stderr, "%s: cannot read configuration, sections are looked up on demand\n", argv[0]);
+    if (!socket_path) {
+        struct map_snapshot* snap = map_acquire();
+        socket_path = snap && snap->settings.broker_socket && *snap->settings.broker_socket ?
+            strdup(snap->settings.broker_socket) : BROKER_SOCKET;
+        map_release(snap);
+    }
+    if (strlen(socket_path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "%s: socket path too long\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+        return EXIT_FAILURE;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init(&share_locks[i], NULL);
+    share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    char dir[sizeof addr.sun_path];
+    snprintf(dir, sizeof dir, "%s", socket_path);
+    if (mkdir(dirname(dir), 0700) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return EXIT_FAILURE;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", socket_path);
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof addr) < 0
+        || chmod(socket_path, 0600) < 0
+        || listen(fd, SOMAXCONN) < 0) {
+        perror(socket_path);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (!foreground && daemon(0, 0) < 0) {
+        perror("daemon");
+        return EXIT_FAILURE;
+    }
+    sys_log(LOG_INFO, "%s: listening on %s", brokername, socket_path);
+    // reload the sections as soon as pam_nss.conf changes, after daemon() forked
+    map_watch_start();
+
+    for (;;) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno != EINTR)
+                sys_log(LOG_ERR, "%s: accept: %m", brokername);
+            continue;
+        }
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, serve, (void*)(intptr_t)client))
+            close(client);
+        pthread_attr_destroy(&attr);
+    }
+    return EXIT_SUCCESS;
+}
@@ -4,13 +4,13 @@
 #include <security/pam_modules.h>
 #include <security/_pam_macros.h>
 #include <syslog.h>
-#include <stdint.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 #define INCORRECT "INCORRECT"
 #define AUTH_BEARER "Authorization: Bearer "
-#define SIZE 64
-#define MAX_GROUPS 6
 #define BUF_SIZE 256
+#define MAX_CANDIDATES 16    /* sections tried at once by parallel_auth */
 #define CONF_VAR_NAME "pam_nss_conf="
 
 static const char *pam_ssh = "PAM-SSH";  /* for syslogs */
@@ -28,26 +28,26 @@ static const char *pam_ssh = "PAM-SSH";  /* for syslogs */
 };
 */
 
-/* Data object to model */
+/* Data object to model: claims point into arena, missing ones are "" */
+struct arena;
 struct userinfo {
-    char sub[SIZE];
-    char name[SIZE];
-    char preferred_username[SIZE];
-    char given_name[SIZE];
-    char family_name[SIZE];
-    char picture[4*SIZE-1];
+    struct arena* arena;
+    const char* sub;
+    const char* name;
+    const char* preferred_username;
+    const char* given_name;
+    const char* family_name;
+    const char* picture;
     int updated_at;
-    char email[SIZE];
+    const char* email;
     bool email_verified;
-    char *groupsptrs[MAX_GROUPS];
-    char groupsstore[SIZE*MAX_GROUPS];
+    const char** groups;
     int groupscount;
-    char organisation_name[SIZE];
+    const char* organisation_name;
  };
 
 //extern void pam_log(int err, const char *format, ...);
 extern int json_userinfo_read(const char *buf, struct userinfo *ui);
-extern bool traverse_url(const char* domain, char** host);
 
 
 #endif
@@ -0,0 +1,466 @@
+/*******************************************************************************
+ * file:        userinfo.c
+ * description: incremental reader of userinfo documents
+ * notes:       fed from the curl write callback; a byte at a time state
+ *              machine that keeps nothing but the claims of struct
+ *              userinfo, so chunk boundaries may fall anywhere; strings
+ *              grow in place at the end of the arena while they are read.
+ *              Runs of bytes that leave the state as it is (the inside
+ *              of strings and of skipped arrays and objects) are passed
+ *              with jsonscan, 16 or 32 bytes at a time.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "userinfo.h"
+#include "jsonscan.h"
+
+enum {
+    ST_OBJECT,      /* before the opening brace */
+    ST_KEY,         /* before a key or the closing brace */
+    ST_KEY_CHARS,
+    ST_KEY_ESCAPE,
+    ST_COLON,
+    ST_VALUE,
+    ST_STRING,      /* in a string value that is kept */
+    ST_ESCAPE,
+    ST_UNICODE,     /* in the hex digits of a \u escape */
+    ST_NUMBER,
+    ST_LITERAL,
+    ST_GROUPS,      /* in the groups array, before an element or ] */
+    ST_GROUPS_NEXT, /* ... after an element */
+    ST_SKIP,        /* in a value that is not kept */
+    ST_SKIP_STRING,
+    ST_SKIP_ESCAPE,
+    ST_NEXT,        /* after a value, before , or } */
+    ST_DONE,        /* no more input wanted */
+    ST_ERROR,
+};
+
+enum { C_STRING, C_INTEGER, C_BOOLEAN, C_GROUPS };
+
+#define CLAIM(member, type, flag) \
+    { #member, type, offsetof(struct userinfo, member), flag }
+
+/* the claims of struct userinfo */
+static const struct claim {
+    const char* name;
+    int type;
+    size_t offset;
+    unsigned flag;  /* USERINFO_* */
+} claims[] = {
+    CLAIM(sub, C_STRING, 0),
+    CLAIM(name, C_STRING, 0),
+    CLAIM(preferred_username, C_STRING, USERINFO_USERNAME),
+    CLAIM(given_name, C_STRING, 0),
+    CLAIM(family_name, C_STRING, 0),
+    CLAIM(picture, C_STRING, 0),
+    CLAIM(updated_at, C_INTEGER, 0),
+    CLAIM(email, C_STRING, 0),
+    CLAIM(email_verified, C_BOOLEAN, 0),
+    { "groups", C_GROUPS, 0, USERINFO_GROUPS },
+    CLAIM(organisation_name, C_STRING, 0),
+};
+
+#define NCLAIMS (int)(sizeof claims / sizeof claims[0])
+
+void userinfo_init(struct userinfo* ui, struct arena* arena)
+{
+    int i;
+    memset(ui, 0, sizeof *ui);
+    ui->arena = arena;
+    for (i = 0; i < NCLAIMS; i++)
+        if (claims[i].type == C_STRING)
+            *(const char**)((char*)ui + claims[i].offset) = "";
+}
+
+void userinfo_stream_init(struct userinfo_stream* s, struct userinfo* ui, unsigned want)
+{
+    memset(s, 0, sizeof *s);
+    userinfo_init(ui, ui->arena);
+    s->ui = ui;
+    s->want = want;
+    s->claim = -1;
+    s->state = ST_OBJECT;
+}
+
+static bool json_space(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r';
+}
+
+static int hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+static int claim_lookup(const struct userinfo_stream* s)
+{
+    int i;
+    if (s->keylen >= USERINFO_KEY_MAX)
+        return -1;
+    for (i = 0; i < NCLAIMS; i++)
+        if (strlen(claims[i].name) == s->keylen && memcmp(claims[i].name, s->key, s->keylen) == 0)
+            return i;
+    return -1;
+}
+
+/* found another claim, stop if it was the last one wanted */
+static void claim_found(struct userinfo_stream* s, unsigned flag)
+{
+    s->found |= flag;
+    s->state = s->want && (s->found & s->want) == s->want ? ST_DONE : ST_NEXT;
+}
+
+static void string_start(struct userinfo_stream* s)
+{
+    s->out = arena_alloc(s->ui->arena, USERINFO_STRING_ROOM);
+    s->outlen = 0;
+    s->outroom = USERINFO_STRING_ROOM;
+    s->bad = false;
+    s->nomem = s->out == NULL;
+    s->surrogate = 0;
+}
+
+/* keeps room for the terminating NUL */
+static void string_put(struct userinfo_stream* s, char ch)
+{
+    char* out;
+    if (s->nomem)
+        return;
+    if (s->outlen + 1 == s->outroom) {
+        out = arena_extend(s->ui->arena, s->out, s->outroom, s->outroom);
+        if (!out) {
+            s->nomem = true;
+            return;
+        }
+        s->out = out;
+        s->outroom *= 2;
+    }
+    s->out[s->outlen++] = ch;
+}
+
+/* n characters without escapes at once */
+static void string_put_run(struct userinfo_stream* s, const char* run, size_t n)
+{
+    size_t room = s->outroom;
+    char* out;
+    if (s->nomem || !n)
+        return;
+    while (s->outlen + n >= room)
+        room *= 2;
+    if (room != s->outroom) {
+        out = arena_extend(s->ui->arena, s->out, s->outroom, room - s->outroom);
+        if (!out) {
+            s->nomem = true;
+            return;
+        }
+        s->out = out;
+        s->outroom = room;
+    }
+    memcpy(s->out + s->outlen, run, n);
+    s->outlen += n;
+}
+
+/* the UTF-8 encoding of a \u escape, pairing UTF-16 surrogates */
+static void string_put_code(struct userinfo_stream* s, unsigned code)
+{
+    if (code >= 0xd800 && code < 0xdc00) {
+        s->surrogate = code;
+        return;
+    }
+    if (code >= 0xdc00 && code < 0xe000) {
+        if (!s->surrogate)
+            return;
+        code = 0x10000 + ((s->surrogate - 0xd800) << 10) + (code - 0xdc00);
+    }
+    s->surrogate = 0;
+    if (code == 0)
+        s->bad = true;          /* cannot be part of a C string */
+    else if (code < 0x80)
+        string_put(s, (char)code);
+    else if (code < 0x800) {
+        string_put(s, (char)(0xc0 | code >> 6));
+        string_put(s, (char)(0x80 | (code & 0x3f)));
+    } else if (code < 0x10000) {
+        string_put(s, (char)(0xe0 | code >> 12));
+        string_put(s, (char)(0x80 | ((code >> 6) & 0x3f)));
+        string_put(s, (char)(0x80 | (code & 0x3f)));
+    } else {
+        string_put(s, (char)(0xf0 | code >> 18));
+        string_put(s, (char)(0x80 | ((code >> 12) & 0x3f)));
+        string_put(s, (char)(0x80 | ((code >> 6) & 0x3f)));
+        string_put(s, (char)(0x80 | (code & 0x3f)));
+    }
+}
+
+/* one more name in ui->groups, which is grown by doubling */
+static bool group_add(struct userinfo_stream* s, const char* group)
+{
+    struct userinfo* ui = s->ui;
+    const char** groups;
+    if ((size_t)ui->groupscount == s->groupsroom) {
+        size_t room = s->groupsroom ? s->groupsroom : 8;
+        groups = arena_extend(ui->arena, ui->groups, s->groupsroom * sizeof *groups,
+                              room * sizeof *groups);
+        if (!groups)
+            return false;
+        ui->groups = groups;
+        s->groupsroom += room;
+    }
+    ui->groups[ui->groupscount++] = group;
+    return true;
+}
+
+static void string_end(struct userinfo_stream* s)
+{
+    const struct claim* c = &claims[s->claim];
+    if (s->nomem) {
+        s->state = ST_ERROR;
+        return;
+    }
+    s->out[s->outlen] = '\0';
+    arena_trim(s->ui->arena, s->out, s->outlen + 1);
+    if (c->type == C_GROUPS) {
+        /* names with a NUL in them are left out */
+        if (!s->bad && !group_add(s, s->out))
+            s->state = ST_ERROR;
+        else
+            s->state = ST_GROUPS_NEXT;
+        return;
+    }
+    if (s->bad && (c->flag & USERINFO_USERNAME)) {
+        /* a cut username could match another user */
+        s->state = ST_ERROR;
+        return;
+    }
+    *(const char**)((char*)s->ui + c->offset) = s->out;
+    if (c->flag && s->outlen)
+        claim_found(s, c->flag);
+    else
+        s->state = ST_NEXT;
+}
+
+/* the first character of a value */
+static bool value_start(struct userinfo_stream* s, char ch)
+{
+    const struct claim* c = s->claim >= 0 ? &claims[s->claim] : NULL;
+    char* member = c ? (char*)s->ui + c->offset : NULL;
+    if (c && c->type == C_STRING && ch == '"') {
+        string_start(s);
+        s->state = ST_STRING;
+    } else if (c && c->type == C_INTEGER && (ch == '-' || (ch >= '0' && ch <= '9'))) {
+        *(int*)member = ch == '-' ? 0 : ch - '0';
+        s->negative = ch == '-';
+        s->state = ST_NUMBER;
+    } else if (c && c->type == C_BOOLEAN && (ch == 't' || ch == 'f')) {
+        *(bool*)member = ch == 't';
+        s->state = ST_LITERAL;
+    } else if (c && c->type == C_GROUPS && ch == '[') {
+        s->ui->groups = NULL;
+        s->ui->groupscount = 0;
+        s->groupsroom = 0;
+        s->state = ST_GROUPS;
+    } else {
+        /* not ours, or not of the expected type */
+        s->depth = 0;
+        s->state = ST_SKIP;
+        return false;
+    }
+    return true;
+}
+
+/* one character of input; false if it is to be looked at again */
+static bool userinfo_step(struct userinfo_stream* s, char ch)
+{
+    int v;
+    switch (s->state) {
+    case ST_OBJECT:
+        if (ch == '{')
+            s->state = ST_KEY;
+        else if (!json_space(ch))
+            s->state = ST_ERROR;
+        break;
+    case ST_KEY:
+        if (ch == '"') {
+            s->keylen = 0;
+            s->state = ST_KEY_CHARS;
+        } else if (ch == '}')
+            s->state = ST_DONE;
+        else if (!json_space(ch))
+            s->state = ST_ERROR;
+        break;
+    case ST_KEY_CHARS:
+        if (ch == '"') {
+            s->claim = claim_lookup(s);
+            s->state = ST_COLON;
+        } else if (ch == '\\') {
+            s->keylen = USERINFO_KEY_MAX;   /* no claim name has escapes */
+            s->state = ST_KEY_ESCAPE;
+        } else if (s->keylen < USERINFO_KEY_MAX)
+            s->key[s->keylen++] = ch;
+        break;
+    case ST_KEY_ESCAPE:
+        s->state = ST_KEY_CHARS;
+        break;
+    case ST_COLON:
+        if (ch == ':')
+            s->state = ST_VALUE;
+        else if (!json_space(ch))
+            s->state = ST_ERROR;
+        break;
+    case ST_VALUE:
+        if (!json_space(ch))
+            return value_start(s, ch);
+        break;
+    case ST_STRING:
+        if (ch == '"')
+            string_end(s);
+        else if (ch == '\\')
+            s->state = ST_ESCAPE;
+        else
+            string_put(s, ch);
+        break;
+    case ST_ESCAPE:
+        s->state = ST_STRING;
+        switch (ch) {
+        case 'b': string_put(s, '\b'); break;
+        case 'f': string_put(s, '\f'); break;
+        case 'n': string_put(s, '\n'); break;
+        case 'r': string_put(s, '\r'); break;
+        case 't': string_put(s, '\t'); break;
+        case 'u':
+            s->code = 0;
+            s->hexleft = 4;
+            s->state = ST_UNICODE;
+            break;
+        default: string_put(s, ch); break;
+        }
+        break;
+    case ST_UNICODE:
+        if ((v = hex_value(ch)) < 0) {
+            s->state = ST_ERROR;
+            break;
+        }
+        s->code = s->code * 16 + v;
+        if (--s->hexleft == 0) {
+            string_put_code(s, s->code);
+            s->state = ST_STRING;
+        }
+        break;
+    case ST_NUMBER:
+        if (ch >= '0' && ch <= '9') {
+            int* n = (int*)((char*)s->ui + claims[s->claim].offset);
+            if (*n < 100000000)
+                *n = *n * 10 + (ch - '0');
+            break;
+        }
+        if (s->negative)
+            *(int*)((char*)s->ui + claims[s->claim].offset) *= -1;
+        s->depth = 0;
+        s->state = ST_SKIP;     /* fraction or exponent, if any */
+        return false;
+    case ST_LITERAL:
+        if (ch >= 'a' && ch <= 'z')
+            break;
+        s->state = ST_NEXT;
+        return false;
+    case ST_GROUPS:
+        if (ch == '"') {
+            string_start(s);
+            s->state = ST_STRING;
+        } else if (ch == ']')
+            claim_found(s, USERINFO_GROUPS);
+        else if (!json_space(ch)) {
+            /* not a list of names: skip the rest of the array */
+            s->ui->groupscount = 0;
+            s->depth = 1;
+            s->state = ST_SKIP;
+            return false;
+        }
+        break;
+    case ST_GROUPS_NEXT:
+        if (ch == ',')
+            s->state = ST_GROUPS;
+        else if (ch == ']')
+            claim_found(s, USERINFO_GROUPS);
+        else if (!json_space(ch))
+            s->state = ST_ERROR;
+        break;
+    case ST_SKIP:
+        if (ch == '"')
+            s->state = ST_SKIP_STRING;
+        else if (ch == '{' || ch == '[')
+            s->depth++;
+        else if (ch == '}' || ch == ']') {
+            if (s->depth == 0) {
+                /* ends a bare token and the enclosing object */
+                s->state = ST_NEXT;
+                return false;
+            }
+            if (--s->depth == 0)
+                s->state = ST_NEXT;
+        } else if (s->depth == 0 && ch == ',') {
+            s->state = ST_NEXT;
+            return false;
+        } else if (s->depth == 0 && json_space(ch))
+            s->state = ST_NEXT;
+        break;
+    case ST_SKIP_STRING:
+        if (ch == '\\')
+            s->state = ST_SKIP_ESCAPE;
+        else if (ch == '"')
+            s->state = s->depth ? ST_SKIP : ST_NEXT;
+        break;
+    case ST_SKIP_ESCAPE:
+        s->state = ST_SKIP_STRING;
+        break;
+    case ST_NEXT:
+        if (ch == ',')
+            s->state = ST_KEY;
+        else if (ch == '}')
+            s->state = ST_DONE;
+        else if (!json_space(ch))
+            s->state = ST_ERROR;
+        break;
+    }
+    return true;
+}
+
+/*
+ * Read the next part of the document
+ * Returns true while more input is wanted: false once the document or
+ * the wanted claims are complete, or it is not a userinfo object.
+ */
+bool userinfo_stream_feed(struct userinfo_stream* s, const char* data, size_t len)
+{
+    const char *cp = data, *end = data + len, *run;
+    while (cp < end && s->state < ST_DONE) {
+        /* what userinfo_step() would only copy or pass over */
+        if (s->state == ST_STRING) {
+            run = json_scan_string_n(cp, end);
+            string_put_run(s, cp, run - cp);
+            cp = run;
+        } else if (s->state == ST_SKIP_STRING)
+            cp = json_scan_string_n(cp, end);
+        else if (s->state == ST_SKIP && s->depth)
+            cp = json_scan_structural_n(cp, end);
+        if (cp < end && userinfo_step(s, *cp))
+            cp++;
+    }
+    return s->state < ST_DONE;
+}
+
+/* all wanted claims read, or the whole document if none was named */
+bool userinfo_stream_done(const struct userinfo_stream* s)
+{
+    return s->state == ST_DONE && (s->found & s->want) == s->want;
+}
@@ -0,0 +1,52 @@
+#ifndef PAM_SSH_USERINFO_H
+#define PAM_SSH_USERINFO_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "pam_ssh_common.h"
+#include "arena.h"
+
+/*
+ * Incremental reader of a userinfo document: fed with the body as it
+ * arrives, it fills struct userinfo and asks for no more input once the
+ * claims it was told to want have been read, so the rest of a large
+ * document (long group lists, embedded pictures) is never looked at.
+ * Values are written straight into the arena of the userinfo, whatever
+ * their length.
+ */
+
+/* claims that can be waited for */
+#define USERINFO_USERNAME 0x1   /* preferred_username */
+#define USERINFO_GROUPS 0x2     /* groups */
+
+#define USERINFO_KEY_MAX 32     /* longer keys are not claims we read */
+#define USERINFO_STRING_ROOM 32 /* first allocation for a string value */
+
+struct userinfo_stream {
+    struct userinfo* ui;
+    unsigned want;          /* USERINFO_* to read before stopping, 0 for all */
+    unsigned found;         /* USERINFO_* read so far */
+    int state;
+    int claim;              /* index of the claim whose value is read, -1 if none */
+    char key[USERINFO_KEY_MAX];
+    size_t keylen;
+    char* out;              /* string value being read, last allocation of the arena ... */
+    size_t outlen, outroom; /* ... its length and size */
+    bool bad;               /* ... which had a \u0000 */
+    bool nomem;             /* ... for which the arena had no memory */
+    size_t groupsroom;      /* of ui->groups */
+    int depth;              /* of a skipped value */
+    bool negative;          /* of an integer value */
+    unsigned code;          /* \u escape being read ... */
+    int hexleft;            /* ... hex digits still to come */
+    unsigned surrogate;     /* high half of a UTF-16 pair, 0 if none */
+};
+
+/* ui with no claims, taking its strings from arena */
+extern void userinfo_init(struct userinfo* ui, struct arena* arena);
+/* ui->arena must be set, ui is reset */
+extern void userinfo_stream_init(struct userinfo_stream* s, struct userinfo* ui, unsigned want);
+extern bool userinfo_stream_feed(struct userinfo_stream* s, const char* data, size_t len);
+extern bool userinfo_stream_done(const struct userinfo_stream* s);
+
+#endif